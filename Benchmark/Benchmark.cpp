@@ -0,0 +1,624 @@
+// Micro benchmark of the rewrite kernel.
+// Times splitting and merging back every row of a synthetic CSV, once with
+// the hard-coded comma tokenizer the tool used before dialects existed and
+// once per pre-instantiated dialect, so a dialect never costs more than the
+// plain comma build.
+//
+// Each kernel is measured in two phases, splitting the rows alone and then
+// the whole rewrite, and every measurement comes with the hardware counters
+// of perf.h. With --programs, whole programs are measured instead: each is
+// run as the challenge specifies, PROGRAM INPUT COLUMN VALUE OUTPUT, which
+// is how the tool and the solutions in OtherSolutions, each built on its
+// own, compare. NAME=PROGRAM,ARG,... runs PROGRAM with those arguments
+// instead, {input} and {output} standing for the files, which is how the
+// tool's other modes and flags compare, for instance group-by with and
+// without --numa:
+//
+//   group=tool,{input},{output},--group-by,city
+//   group-numa=tool,{input},{output},--group-by,city,--numa
+//
+// --json writes the measurements to a file, and --compare
+// checks the measurements of a run against those of a baseline, per row,
+// and fails when any grew by more than the threshold.
+
+// g++ -std=c++17 -O2 Benchmark.cpp -o benchmark
+// ./benchmark [number_of_rows] [--json FILE]
+// ./benchmark --programs INPUT COLUMN VALUE NAME=PROGRAM[,ARG...]...
+//             [--json FILE]
+// ./benchmark --compare BASELINE CURRENT [--threshold PERCENT]
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <memory_resource>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "../ExpressiveC++17CodingChallenge/arena.h"
+#include "../ExpressiveC++17CodingChallenge/dialect.h"
+#include "../ExpressiveC++17CodingChallenge/json.h"
+#include "../ExpressiveC++17CodingChallenge/tokenizer.h"
+#include "perf.h"
+
+namespace benchmark {
+constexpr auto DEFAULT_NUMBER_OF_ROWS{1'000'000};
+constexpr auto REPETITIONS{10};
+constexpr auto PROGRAM_REPETITIONS{3};
+constexpr std::size_t ROWS_PER_CHUNK{4096};
+constexpr auto COLUMN_POSITION{3};
+constexpr std::string_view REPLACEMENT{"London"};
+constexpr double DEFAULT_THRESHOLD{5.0};
+
+namespace baseline {
+auto split_line_into_tokens(std::string_view line,
+                            std::pmr::memory_resource* resource) {
+  tool::tokens result{resource};
+  std::size_t begin{0};
+  while (begin < line.size()) {
+    const auto end{std::min(line.find(',', begin), line.size())};
+    result.push_back(line.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  return result;
+}
+
+void merge_tokens_into_line(const tool::tokens& tokens,
+                            std::pmr::string& line) {
+  auto first{true};
+  for (const auto& token : tokens) {
+    if (!first) {
+      line += ',';
+    }
+    line += token;
+    first = false;
+  }
+}
+}  // namespace baseline
+
+auto make_lines(int number_of_rows, char delimiter) {
+  const std::vector<std::string_view> cities{"Tokyo", "Canberra", "Cracow",
+                                             "Paris", "Dublin", "New Delhi"};
+  std::vector<std::string> lines;
+  lines.reserve(number_of_rows);
+  for (auto i{0}; i < number_of_rows; ++i) {
+    std::string line{"John"};
+    line += delimiter;
+    line += "Doe";
+    line += delimiter;
+    line += std::to_string(i % 100);
+    line += delimiter;
+    line += cities[i % cities.size()];
+    line += delimiter;
+    line += "Blue";
+    line += delimiter;
+    line += "Human";
+    lines.push_back(std::move(line));
+  }
+  return lines;
+}
+
+// Keeps the compiler from dropping a computation whose result is unused.
+volatile std::size_t sink;
+
+struct measurement {
+  std::string implementation;
+  std::string phase;
+  // What the figures are divided by when compared: the rows processed.
+  std::uint64_t rows{0};
+  std::uint64_t wall_ns{0};
+  counter_values counters;
+};
+
+// Runs pass repetitions times and keeps the fastest run, with its counters.
+template <typename Pass>
+measurement measure(int repetitions, Pass&& pass) {
+  perf_counters counters;
+  measurement best;
+  best.wall_ns = UINT64_MAX;
+  for (auto repetition{0}; repetition < repetitions; ++repetition) {
+    counters.start();
+    const auto start{std::chrono::steady_clock::now()};
+    pass();
+    const auto wall{std::chrono::steady_clock::now() - start};
+    const auto values{counters.stop()};
+    const auto wall_ns{static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count())};
+    if (wall_ns < best.wall_ns) {
+      best.wall_ns = wall_ns;
+      best.counters = values;
+    }
+  }
+  return best;
+}
+
+// Measures splitting the rows, then rewriting them, in chunks of
+// ROWS_PER_CHUNK rows whose memory is released at once.
+template <typename Split, typename Merge>
+void measure_kernel(std::string_view name,
+                    const std::vector<std::string>& lines, Split split,
+                    Merge merge, std::vector<measurement>& results) {
+  tool::arena_resource arena;
+  const auto by_chunk{[&](auto&& rows) {
+    for (std::size_t first{0}; first < lines.size(); first += ROWS_PER_CHUNK) {
+      rows(first, std::min(first + ROWS_PER_CHUNK, lines.size()));
+      arena.reset();
+    }
+  }};
+
+  std::size_t fields{0};
+  auto split_only{measure(REPETITIONS, [&] {
+    fields = 0;
+    by_chunk([&](std::size_t first, std::size_t last) {
+      for (auto row{first}; row < last; ++row) {
+        fields += split(lines[row], &arena).size();
+      }
+    });
+  })};
+  sink = fields;
+  split_only.implementation = name;
+  split_only.phase = "split";
+  split_only.rows = lines.size();
+  results.push_back(std::move(split_only));
+
+  std::size_t output_size{0};
+  auto rewrite{measure(REPETITIONS, [&] {
+    output_size = 0;
+    by_chunk([&](std::size_t first, std::size_t last) {
+      std::pmr::string chunk{&arena};
+      for (auto row{first}; row < last; ++row) {
+        auto tokens{split(lines[row], &arena)};
+        tokens[COLUMN_POSITION] = REPLACEMENT;
+        merge(tokens, chunk);
+        chunk += '\n';
+      }
+      output_size += chunk.size();
+    });
+  })};
+  sink = output_size;
+  rewrite.implementation = name;
+  rewrite.phase = "rewrite";
+  rewrite.rows = lines.size();
+  results.push_back(std::move(rewrite));
+}
+
+template <typename Dialect>
+void measure_dialect(std::string_view name, int number_of_rows,
+                     std::vector<measurement>& results) {
+  measure_kernel(
+      name, make_lines(number_of_rows, Dialect::delimiter),
+      [](std::string_view line, auto resource) {
+        return tool::split_line_into_tokens<Dialect>(line, resource);
+      },
+      [](const auto& tokens, auto& line) {
+        tool::merge_tokens_into_line<Dialect>(tokens, line);
+      },
+      results);
+}
+
+#ifdef __linux__
+// Runs arguments as a child process, counted from its exec, and tells
+// whether it exited with 0. Its standard output is dropped.
+bool run_program(const std::vector<std::string>& arguments,
+                 std::uint64_t& wall_ns, counter_values& values) {
+  int go[2];
+  if (::pipe2(go, O_CLOEXEC) != 0) return false;
+  const auto child{::fork()};
+  if (child == 0) {
+    char c;
+    const auto ready{::read(go[0], &c, 1) == 1};
+    const auto null{::open("/dev/null", O_WRONLY)};
+    if (!ready || null < 0 || ::dup2(null, STDOUT_FILENO) < 0) ::_exit(127);
+    std::vector<char*> argv;
+    for (const auto& argument : arguments) {
+      argv.push_back(const_cast<char*>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+    ::execv(argv[0], argv.data());
+    ::_exit(127);
+  }
+  ::close(go[0]);
+  if (child < 0) {
+    ::close(go[1]);
+    return false;
+  }
+
+  // Opened before the child execs, so that it counts from the start.
+  perf_counters counters{child};
+  const auto start{std::chrono::steady_clock::now()};
+  static_cast<void>(::write(go[1], "", 1));
+  ::close(go[1]);
+  int status{0};
+  ::waitpid(child, &status, 0);
+  wall_ns = static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count());
+  values = counters.stop();
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+#else
+bool run_program(const std::vector<std::string>&, std::uint64_t&,
+                 counter_values&) {
+  std::cerr << "--programs needs Linux\n";
+  return false;
+}
+#endif
+
+// The arguments a NAME=PROGRAM[,ARG...] of --programs is run with.
+std::vector<std::string> program_arguments(const std::string& program,
+                                           const std::string& input,
+                                           const std::string& column,
+                                           const std::string& value,
+                                           const std::string& output) {
+  std::vector<std::string> arguments;
+  std::istringstream parts{program};
+  for (std::string part; std::getline(parts, part, ',');) {
+    if (part == "{input}") {
+      part = input;
+    } else if (part == "{output}") {
+      part = output;
+    }
+    arguments.push_back(std::move(part));
+  }
+  if (arguments.size() == 1) {
+    arguments.insert(arguments.end(), {input, column, value, output});
+  }
+  return arguments;
+}
+
+// Measures each NAME=PROGRAM of programs rewriting input, the fastest of
+// PROGRAM_REPETITIONS runs.
+bool measure_programs(const std::string& input, const std::string& column,
+                      const std::string& value,
+                      const std::vector<std::string>& programs,
+                      std::vector<measurement>& results) {
+  std::ifstream file{input, std::ios::binary};
+  const auto rows{static_cast<std::uint64_t>(
+      std::count(std::istreambuf_iterator<char>{file},
+                 std::istreambuf_iterator<char>{}, '\n'))};
+  const auto output{input + ".benchmark"};
+
+  for (const auto& program : programs) {
+    const auto equals{program.find('=')};
+    if (equals == std::string::npos) {
+      std::cerr << "expected NAME=PROGRAM: " << program << '\n';
+      return false;
+    }
+    measurement best;
+    best.implementation = program.substr(0, equals);
+    best.phase = "run";
+    best.rows = rows;
+    best.wall_ns = UINT64_MAX;
+    for (auto repetition{0}; repetition < PROGRAM_REPETITIONS; ++repetition) {
+      std::uint64_t wall_ns{0};
+      counter_values values;
+      if (!run_program(program_arguments(program.substr(equals + 1), input,
+                                         column, value, output),
+                       wall_ns, values)) {
+        std::cerr << best.implementation << " failed\n";
+        std::remove(output.c_str());
+        return false;
+      }
+      if (wall_ns < best.wall_ns) {
+        best.wall_ns = wall_ns;
+        best.counters = values;
+      }
+    }
+    results.push_back(std::move(best));
+  }
+  std::remove(output.c_str());
+  return true;
+}
+
+void print_figure(std::optional<double> figure, int width, int precision) {
+  std::cout << std::setw(width);
+  if (figure) {
+    std::cout << std::fixed << std::setprecision(precision) << *figure;
+  } else {
+    std::cout << '-';
+  }
+}
+
+// One line per measurement, its figures per row.
+void print_table(const std::vector<measurement>& results) {
+  std::cout << std::left << std::setw(24) << "implementation" << std::setw(8)
+            << "phase" << std::right << std::setw(10) << "ns/row"
+            << std::setw(8) << "IPC";
+  for (const auto& name : COUNTER_NAMES) {
+    std::cout << std::setw(16) << name;
+  }
+  std::cout << "   (counters per row)\n";
+
+  for (const auto& result : results) {
+    const auto rows{static_cast<double>(std::max<std::uint64_t>(result.rows,
+                                                                1))};
+    std::cout << std::left << std::setw(24) << result.implementation
+              << std::setw(8) << result.phase << std::right;
+    print_figure(result.wall_ns / rows, 10, 1);
+    const auto& cycles{result.counters[0]};
+    const auto& instructions{result.counters[1]};
+    print_figure(cycles && instructions && *cycles > 0
+                     ? std::optional<double>{static_cast<double>(
+                                                 *instructions) /
+                                             *cycles}
+                     : std::nullopt,
+                 8, 2);
+    for (const auto& count : result.counters) {
+      print_figure(count ? std::optional<double>{*count / rows} : std::nullopt,
+                   16, 3);
+    }
+    std::cout << '\n';
+  }
+}
+
+// {"results": [{"implementation": ..., "phase": ..., "rows": ...,
+// "wall_ns": ..., "cycles": ..., ...}, ...]}, a missing counter as null.
+std::string to_json(const std::vector<measurement>& results) {
+  std::string json{"{\"results\": ["};
+  for (std::size_t i{0}; i < results.size(); ++i) {
+    const auto& result{results[i]};
+    json += i == 0 ? "\n  {" : ",\n  {";
+    json += "\"implementation\": ";
+    tool::append_json_string(result.implementation, json);
+    json += ", \"phase\": ";
+    tool::append_json_string(result.phase, json);
+    json += ", \"rows\": " + std::to_string(result.rows);
+    json += ", \"wall_ns\": " + std::to_string(result.wall_ns);
+    for (std::size_t counter{0}; counter < COUNTERS; ++counter) {
+      json += ", \"";
+      json += COUNTER_NAMES[counter];
+      json += "\": ";
+      const auto& count{result.counters[counter]};
+      json += count ? std::to_string(*count) : "null";
+    }
+    json += '}';
+  }
+  json += "\n]}\n";
+  return json;
+}
+
+// Reads back what to_json() wrote: an object of flat objects with string,
+// integer and null members. False when text is something else.
+class json_reader {
+ public:
+  explicit json_reader(std::string_view text) : text_{text} {}
+
+  bool read(std::vector<measurement>& results) {
+    if (!expect('{') || !read_string(key_) || key_ != "results" ||
+        !expect(':') || !expect('[')) {
+      return false;
+    }
+    if (peek() == ']') return expect(']') && expect('}');
+    do {
+      results.emplace_back();
+      if (!read_members(results.back())) return false;
+    } while (peek() == ',' && expect(','));
+    return expect(']') && expect('}');
+  }
+
+ private:
+  bool read_members(measurement& result) {
+    if (!expect('{')) return false;
+    do {
+      if (!read_string(key_) || !expect(':')) return false;
+      if (peek() == '"') {
+        std::string value;
+        if (!read_string(value)) return false;
+        if (key_ == "implementation") result.implementation = value;
+        if (key_ == "phase") result.phase = value;
+        continue;
+      }
+      std::optional<std::uint64_t> number;
+      if (!read_integer(number)) return false;
+      if (key_ == "rows") result.rows = number.value_or(0);
+      if (key_ == "wall_ns") result.wall_ns = number.value_or(0);
+      const auto counter{std::find(COUNTER_NAMES.begin(), COUNTER_NAMES.end(),
+                                   key_)};
+      if (counter != COUNTER_NAMES.end()) {
+        result.counters[counter - COUNTER_NAMES.begin()] = number;
+      }
+    } while (peek() == ',' && expect(','));
+    return expect('}');
+  }
+
+  char peek() {
+    while (pos_ < text_.size() &&
+           (text_[pos_] == ' ' || text_[pos_] == '\n' ||
+            text_[pos_] == '\r' || text_[pos_] == '\t')) {
+      ++pos_;
+    }
+    return pos_ < text_.size() ? text_[pos_] : '\0';
+  }
+
+  bool expect(char c) {
+    if (peek() != c) return false;
+    ++pos_;
+    return true;
+  }
+
+  // Only the escapes append_json_string() writes for printable text.
+  bool read_string(std::string& value) {
+    if (!expect('"')) return false;
+    value.clear();
+    while (pos_ < text_.size() && text_[pos_] != '"') {
+      if (text_[pos_] == '\\' && pos_ + 1 < text_.size()) ++pos_;
+      value += text_[pos_++];
+    }
+    return expect('"');
+  }
+
+  bool read_integer(std::optional<std::uint64_t>& number) {
+    peek();
+    if (text_.substr(pos_, 4) == "null") {
+      pos_ += 4;
+      number.reset();
+      return true;
+    }
+    std::uint64_t value;
+    const auto [end, error]{std::from_chars(
+        text_.data() + pos_, text_.data() + text_.size(), value)};
+    if (error != std::errc{}) return false;
+    pos_ = static_cast<std::size_t>(end - text_.data());
+    number = value;
+    return true;
+  }
+
+  std::string_view text_;
+  std::size_t pos_{0};
+  std::string key_;
+};
+
+bool read_results(const std::string& filename,
+                  std::vector<measurement>& results) {
+  std::ifstream file{filename, std::ios::binary};
+  std::stringstream text;
+  text << file.rdbuf();
+  if (!file || !json_reader{text.str()}.read(results)) {
+    std::cerr << "cannot read results from " << filename << '\n';
+    return false;
+  }
+  return true;
+}
+
+// Lists every figure of current that grew past threshold percent of the
+// same figure of baseline, per row, and tells whether there was none.
+bool compare(const std::vector<measurement>& baseline,
+             const std::vector<measurement>& current, double threshold) {
+  auto regressions{0};
+  const auto check{[&](const measurement& before, const measurement& after,
+                       std::string_view figure, std::uint64_t old_value,
+                       std::uint64_t new_value) {
+    const auto old_per_row{static_cast<double>(old_value) /
+                           std::max<std::uint64_t>(before.rows, 1)};
+    const auto new_per_row{static_cast<double>(new_value) /
+                           std::max<std::uint64_t>(after.rows, 1)};
+    if (old_per_row == 0 ||
+        new_per_row <= old_per_row * (1 + threshold / 100)) {
+      return;
+    }
+    ++regressions;
+    std::cout << std::left << std::setw(24) << after.implementation
+              << std::setw(8) << after.phase << std::setw(16) << figure
+              << std::right << std::fixed << std::setprecision(3)
+              << std::setw(14) << old_per_row << std::setw(14) << new_per_row
+              << std::setprecision(1) << std::setw(9)
+              << (new_per_row / old_per_row - 1) * 100 << "%\n";
+  }};
+
+  for (const auto& before : baseline) {
+    const auto after{std::find_if(
+        current.begin(), current.end(), [&](const measurement& result) {
+          return result.implementation == before.implementation &&
+                 result.phase == before.phase;
+        })};
+    if (after == current.end()) {
+      std::cout << before.implementation << ' ' << before.phase
+                << " missing from the current results\n";
+      ++regressions;
+      continue;
+    }
+    check(before, *after, "wall_ns", before.wall_ns, after->wall_ns);
+    for (std::size_t counter{0}; counter < COUNTERS; ++counter) {
+      if (before.counters[counter] && after->counters[counter]) {
+        check(before, *after, COUNTER_NAMES[counter],
+              *before.counters[counter], *after->counters[counter]);
+      }
+    }
+  }
+
+  std::cout << std::defaultfloat << regressions << " regressions over "
+            << threshold << "%\n";
+  return regressions == 0;
+}
+}  // namespace benchmark
+
+int main(int argc, char* argv[]) {
+  const std::vector<std::string> args(argv + 1, argv + argc);
+
+  if (!args.empty() && args[0] == "--compare") {
+    auto threshold{benchmark::DEFAULT_THRESHOLD};
+    if (args.size() == 5 && args[3] == "--threshold") {
+      threshold = std::atof(args[4].c_str());
+    } else if (args.size() != 3) {
+      std::cerr << "usage: benchmark --compare BASELINE CURRENT "
+                   "[--threshold PERCENT]\n";
+      return 2;
+    }
+    std::vector<benchmark::measurement> baseline;
+    std::vector<benchmark::measurement> current;
+    if (!benchmark::read_results(args[1], baseline) ||
+        !benchmark::read_results(args[2], current)) {
+      return 2;
+    }
+    return benchmark::compare(baseline, current, threshold) ? 0 : 1;
+  }
+
+  std::vector<std::string> positional;
+  std::string json_filename;
+  auto programs{false};
+  for (std::size_t i{0}; i < args.size(); ++i) {
+    if (args[i] == "--json" && i + 1 < args.size()) {
+      json_filename = args[++i];
+    } else if (args[i] == "--programs") {
+      programs = true;
+    } else {
+      positional.push_back(args[i]);
+    }
+  }
+
+  std::vector<benchmark::measurement> results;
+  if (programs) {
+    if (positional.size() < 4) {
+      std::cerr << "usage: benchmark --programs INPUT COLUMN VALUE "
+                   "NAME=PROGRAM[,ARG...]...\n";
+      return 2;
+    }
+    if (!benchmark::measure_programs(
+            positional[0], positional[1], positional[2],
+            {positional.begin() + 3, positional.end()}, results)) {
+      return 1;
+    }
+  } else {
+    const auto number_of_rows{positional.empty()
+                                  ? benchmark::DEFAULT_NUMBER_OF_ROWS
+                                  : std::atoi(positional[0].c_str())};
+    benchmark::measure_kernel("hard-coded comma",
+                              benchmark::make_lines(number_of_rows, ','),
+                              benchmark::baseline::split_line_into_tokens,
+                              benchmark::baseline::merge_tokens_into_line,
+                              results);
+    benchmark::measure_dialect<tool::comma_dialect>("comma", number_of_rows,
+                                                    results);
+    benchmark::measure_dialect<tool::semicolon_dialect>(
+        "semicolon", number_of_rows, results);
+    benchmark::measure_dialect<tool::tab_dialect>("tab", number_of_rows,
+                                                  results);
+    benchmark::measure_dialect<tool::pipe_dialect>("pipe", number_of_rows,
+                                                   results);
+    benchmark::measure_dialect<
+        tool::dialect<',', '"', tool::escape_rule::none, false>>(
+        "comma, no quoting", number_of_rows, results);
+  }
+
+  benchmark::print_table(results);
+  if (!json_filename.empty()) {
+    std::ofstream{json_filename, std::ios::binary}
+        << benchmark::to_json(results);
+  }
+}
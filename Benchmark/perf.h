@@ -0,0 +1,142 @@
+#pragma once
+
+// Hardware performance counters.
+// Wall clock time tells which kernel is faster, not why: the counters tell
+// whether it runs fewer instructions, mispredicts fewer branches or misses
+// the caches less. They are read through perf_event_open(2), each counter
+// on its own so that the ones the machine does not have (in most virtual
+// machines) or the kernel does not allow (perf_event_paranoid) are reported
+// as missing instead of failing the benchmark. Counts are scaled up when
+// the kernel had to multiplex the counters.
+//
+// Linux only; elsewhere every counter is missing.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#endif
+
+namespace benchmark {
+constexpr std::size_t COUNTERS{6};
+constexpr std::array<std::string_view, COUNTERS> COUNTER_NAMES{
+    "cycles",          "instructions", "branch_misses",
+    "l1d_read_misses", "llc_misses",   "page_faults"};
+
+// Per counter, its count, or nothing when it could not be read.
+using counter_values = std::array<std::optional<std::uint64_t>, COUNTERS>;
+
+class perf_counters {
+ public:
+  // Counts the calling thread or, with a pid, that process and its
+  // children, from the moment it calls exec.
+  explicit perf_counters(int pid = 0) {
+#ifdef __linux__
+    constexpr std::uint64_t l1d_read_miss{
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+    constexpr std::uint64_t llc_read_miss{
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+    const std::array<std::pair<std::uint32_t, std::uint64_t>, COUNTERS>
+        events{{{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+                {PERF_TYPE_HW_CACHE, l1d_read_miss},
+                {PERF_TYPE_HW_CACHE, llc_read_miss},
+                {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}}};
+    for (std::size_t i{0}; i < COUNTERS; ++i) {
+      fds_[i] = open(events[i].first, events[i].second, pid);
+    }
+#else
+    static_cast<void>(pid);
+#endif
+  }
+
+  perf_counters(const perf_counters&) = delete;
+  perf_counters& operator=(const perf_counters&) = delete;
+
+  ~perf_counters() {
+#ifdef __linux__
+    for (const auto fd : fds_) {
+      if (fd >= 0) ::close(fd);
+    }
+#endif
+  }
+
+  // Resets the counters and starts them.
+  void start() {
+#ifdef __linux__
+    for (const auto fd : fds_) {
+      if (fd < 0) continue;
+      ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  counter_values stop() {
+    counter_values values;
+#ifdef __linux__
+    for (const auto fd : fds_) {
+      if (fd >= 0) ::ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (std::size_t i{0}; i < COUNTERS; ++i) values[i] = read(fds_[i]);
+#endif
+    return values;
+  }
+
+ private:
+#ifdef __linux__
+  // Tries the kernel's side of the count too, then the user's side alone,
+  // which is all perf_event_paranoid 2 allows.
+  static int open(std::uint32_t type, std::uint64_t config, int pid) {
+    perf_event_attr attributes;
+    std::memset(&attributes, 0, sizeof attributes);
+    attributes.size = sizeof attributes;
+    attributes.type = type;
+    attributes.config = config;
+    attributes.disabled = 1;
+    attributes.exclude_hv = 1;
+    attributes.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    if (pid != 0) {
+      attributes.inherit = 1;
+      attributes.enable_on_exec = 1;
+    }
+    for (const auto exclude_kernel : {0, 1}) {
+      attributes.exclude_kernel = exclude_kernel;
+      const auto fd{::syscall(SYS_perf_event_open, &attributes, pid, -1, -1,
+                              PERF_FLAG_FD_CLOEXEC)};
+      if (fd >= 0) return static_cast<int>(fd);
+    }
+    return -1;
+  }
+
+  static std::optional<std::uint64_t> read(int fd) {
+    // The count, the time enabled and the time running.
+    std::uint64_t data[3];
+    if (fd < 0 ||
+        ::read(fd, data, sizeof data) != static_cast<ssize_t>(sizeof data) ||
+        data[2] == 0) {
+      return std::nullopt;
+    }
+    if (data[2] == data[1]) return data[0];
+    return static_cast<std::uint64_t>(static_cast<double>(data[0]) *
+                                      data[1] / data[2]);
+  }
+
+  std::array<int, COUNTERS> fds_{-1, -1, -1, -1, -1, -1};
+#endif
+};
+}  // namespace benchmark
@@ -48,8 +48,101 @@
 // My entry on coliru:
 // http://coliru.stacked-crooked.com/a/122f7799b53dfba1
 
+// Options, accepted anywhere on the command line:
+// --delimiter comma|semicolon|tab|pipe  field delimiter (default: comma)
+// --quote double|backslash|none         escaping inside quoted fields
+//                                       (default: double, as in RFC 4180)
+// --crlf                                lines end with \r\n
+// --sniff-bytes N                       bytes sampled to guess the parts of
+//                                       the dialect not given (default: 64 KiB)
+// --check                               only check that every row has as
+//                                       many fields as the header, reporting
+//                                       the lines that do not; needs only the
+//                                       input file
+// --format csv|arrow|jsonl              format of the rewritten rows: CSV, an
+//                                       Arrow IPC (Feather) file with the
+//                                       column types of --schema, where
+//                                       empty values, text included, are
+//                                       null, or JSON Lines with one object
+//                                       of strings per row
+// --serve SOCKET                        run rewrite jobs sent as lines to the
+//                                       Unix domain socket SOCKET, keeping
+//                                       inputs loaded between jobs (see
+//                                       daemon.h); takes no other parameter
+// --schema                              only print the type of every column,
+//                                       integer, real, date (YYYY-MM-DD) or
+//                                       text, inferred from the first rows;
+//                                       needs only the input file
+// --pseudonymize KEYFILE                replace each value of the column by a
+//                                       token keyed with the 32 hexadecimal
+//                                       digits in KEYFILE, the same for equal
+//                                       values; the replacement string is put
+//                                       in front of the tokens
+// --profile COLUMN                      report the distinct count, most
+//                                       frequent values, empty count and
+//                                       lengths of COLUMN; may be repeated
+// --top-k N                             most frequent values reported by
+//                                       --profile (default: 10)
+// --sort-by COLUMN                      sort the rows by COLUMN instead of
+//                                       rewriting them; takes the input and
+//                                       output files only
+// --numeric                             sort numbers by value, before any
+//                                       other value (default: byte order)
+// --join FILE --on COLUMN               join each row with the row of FILE
+//                                       with the same COLUMN, taking the
+//                                       values of the columns FILE has too
+//                                       and appending its other columns
+// --group-by COLUMN --agg LIST          aggregate the rows by the value of
+//                                       COLUMN instead of rewriting them;
+//                                       LIST is a comma separated list of
+//                                       count, sum(C), avg(C), min(C) and
+//                                       max(C) (default: count); takes the
+//                                       input and output files only
+// --threads N                           worker threads (default: one per
+//                                       hardware thread)
+// --numa                                spread the workers over the NUMA
+//                                       nodes, pinned to them, with the
+//                                       blocks they read on their nodes
+// --memory-budget BYTES                 memory for sorting, for the joined
+//                                       file or for the groups, past which
+//                                       they are spilled to disk (default:
+//                                       256 MiB)
+// --temp-dir DIR                        where spilled data goes (default: the
+//                                       system's temporary directory)
+// --direct-io                           preallocate the output and write it
+//                                       around the page cache
+// --io uring|threads                    asynchronous I/O backend (default:
+//                                       io_uring when the kernel has it)
+// --incremental                         reuse the output of the previous
+//                                       run with the same arguments for the
+//                                       parts of the input left unchanged
+// --huge-pages                          put I/O buffers and arenas on 2 MiB
+//                                       pages when the system has them, and
+//                                       report how much memory got them
+// --where COLUMN=VALUE                  only rewrite the rows whose COLUMN
+//                                       holds VALUE, or any of the values
+//                                       when given again; the other rows
+//                                       are copied as they are
+// --drop-others                         leave the other rows out instead
+// --head N, --tail N                    rewrite the first or the last N rows
+//                                       only, reading no more of the input
+//                                       than that takes
+// --sample K [--seed S]                 rewrite a uniform random sample of K
+//                                       rows, in input order; S makes it
+//                                       the same every run
+// --follow                              once at the end of the input, wait
+//                                       for rows appended to it and rewrite
+//                                       them too, until the input is
+//                                       removed, renamed or truncated
+
 #include <algorithm>
+#include <array>
+#include <cstring>
 #include <iostream>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <random>
 #ifdef _WIN32
 #include <filesystem>
 #else
@@ -57,103 +150,745 @@
 #endif
 #include <fstream>
 #include <gsl/multi_span>
-#include <sstream>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.h"
+#include "arrow.h"
+#include "check.h"
+#include "daemon.h"
+#include "dialect.h"
+#include "follow.h"
+#include "group.h"
+#include "header.h"
+#include "incremental.h"
+#include "io.h"
+#include "join.h"
+#include "json.h"
+#include "options.h"
+#include "output.h"
+#include "pages.h"
+#include "prefilter.h"
+#include "profile.h"
+#include "pseudonym.h"
+#include "rows.h"
+#include "sample.h"
+#include "scanner.h"
+#include "schema.h"
+#include "sniffer.h"
+#include "sort.h"
+#include "tokenizer.h"
+#include "workers.h"
 
 namespace fs = std::experimental::filesystem;
 
 namespace tool {
-const auto NUMBER_OF_PARAMETERS{4};
+// Tells why the input could not be read to its end, and returns the error
+// code for it.
+int input_failed(int error) {
+  std::cerr << "input file not read: " << std::strerror(error) << '\n';
+  return error_codes::NO_CSV_INPUT_FILE;
+}
 
-namespace error_codes {
-constexpr auto NOT_ENOUGH_PARAMETERS{1};
-constexpr auto NO_CSV_INPUT_FILE{2};
-constexpr auto NO_COLUMN_NAME{3};
-};  // namespace error_codes
+// Tells why output could not be written, and returns the error code for it.
+int output_failed(const output_file& output) {
+  std::cerr << "output file not written: " << std::strerror(output.error())
+            << '\n';
+  return error_codes::NO_CSV_OUTPUT_FILE;
+}
 
-namespace parameter_position {
-constexpr auto CSV_INPUT_FILE{1};
-constexpr auto COLUMN_NAME{2};
-constexpr auto REPLACEMENT_STRING{3};
-constexpr auto CSV_OUTPUT_FILE{4};
-};  // namespace parameter_position
+// Tells why the temporary files under --temp-dir could not be written or
+// read back, removes the output they left incomplete, and returns the error
+// code for it.
+int temp_failed(int error, output_file& output) {
+  std::cerr << "temporary file not written or read: " << std::strerror(error)
+            << '\n';
+  output.discard();
+  return error_codes::NO_CSV_OUTPUT_FILE;
+}
 
-auto split_line_into_tokens(const std::string& line) {
-  std::vector<std::string> result;
+template <typename Dialect>
+int rewrite(const options& options) {
+  auto input_file{file_handle::open_read(options.input_filename)};
+  // Reads the input to its end or, when following it, until it is gone;
+  // idle() runs before waiting for more rows.
+  std::optional<block_reader<Dialect>> reader;
+  std::optional<follow_reader<Dialect>> follower;
+  if (options.follow) {
+    follower.emplace(options.input_filename, input_file);
+  } else {
+    reader.emplace(input_file, options.io);
+  }
+  input_block block;
+  const auto next_block{[&](auto&& idle) {
+    return follower ? follower->next_block(block, idle)
+                    : reader->next_block(block);
+  }};
+  next_block([] {});
+  auto records{block.records};
+  const auto bom{follower ? follower->bom() : reader->bom()};
 
-  std::istringstream line_stream(line);
-  std::string cell;
+  const auto header{parse_header<Dialect>(
+      records.empty() ? record{} : next_record<Dialect>(records))};
+  const auto header_end{bom.size() + block.records.size() - records.size()};
+  const auto number_of_columns{header.number_of_columns()};
+  const auto column_position{header.find(options.column_name)};
+  if (!column_position) {
+    std::cerr << "column name doesn't exists in the input file\n";
+    return error_codes::NO_COLUMN_NAME;
+  }
 
-  while (std::getline(line_stream, cell, ',')) {
-    result.push_back(cell);
+  std::vector<std::pair<std::size_t, column_profile>> profiles;
+  for (const auto& column_name : options.profile_columns) {
+    const auto position{header.find(column_name)};
+    if (!position) {
+      std::cerr << "column name doesn't exists in the input file\n";
+      return error_codes::NO_COLUMN_NAME;
+    }
+    profiles.emplace_back(*position, column_profile{options.top_k});
   }
 
-  return result;
-}
+  std::optional<hash_join<Dialect>> join;
+  if (!options.join_filename.empty()) {
+    join.emplace();
+    if (const auto error{join->open(options, header)}) {
+      return error;
+    }
+    // Partitioned rows are only joined once the whole input is read.
+    if (options.follow && join->partitioned()) {
+      std::cerr << "invalid option: --follow with a joined file over the "
+                   "memory budget\n";
+      return error_codes::INVALID_OPTION;
+    }
+  }
+
+  // The column --where selects rows on. A row can only hold one of its
+  // values if the prefilter finds it.
+  std::optional<std::size_t> where_position;
+  std::optional<row_prefilter<Dialect>> prefilter;
+  if (!options.where_column.empty()) {
+    where_position = header.find(options.where_column);
+    if (!where_position) {
+      std::cerr << "column name doesn't exists in the input file\n";
+      return error_codes::NO_COLUMN_NAME;
+    }
+    std::vector<std::string> needles;
+    for (const auto& value : options.where_values) {
+      needles.emplace_back(verbatim_part<Dialect>(value));
+    }
+    // A value with no part written as is could be in any row.
+    if (std::none_of(needles.begin(), needles.end(),
+                     [](const auto& needle) { return needle.empty(); })) {
+      prefilter.emplace(std::move(needles));
+    }
+  }
+  // Counts the fields of the rows the prefilter passes over, reporting
+  // nothing: the rewrite reports the rows it leaves out.
+  std::ostream nowhere{nullptr};
+  std::optional<structure_check<Dialect>> structure;
+  if (prefilter) structure.emplace(header, nowhere);
+  std::string where_storage;
+  const auto selected{[&](const csv_row& row) {
+    const auto value{
+        field_value<Dialect>(row.fields[*where_position], where_storage)};
+    return std::find(options.where_values.begin(), options.where_values.end(),
+                     value) != options.where_values.end();
+  }};
+
+  const auto wanted_value{quote_field<Dialect>(options.replacement)};
+
+  std::optional<incremental_rewrite<Dialect>> incremental;
+  if (options.incremental) {
+    incremental.emplace(options.output_filename,
+                        rewrite_fingerprint<Dialect>(options, header, bom));
+  }
+  output_file output_file(incremental ? incremental->partial_filename()
+                                      : options.output_filename,
+                          options.output_mode, options.io);
+  std::optional<arrow_writer> arrow;
+  std::optional<json_lines> jsonl;
+  if (options.format == output_format::csv) {
+    output_file << bom;
+    output_file << (join ? join->header_line(header) : header.line);
+    output_file << header.line_ending;
+  } else {
+    auto column_names{header.column_names};
+    if (join) {
+      column_names.insert(column_names.end(), join->appended_names().begin(),
+                          join->appended_names().end());
+    }
+    if (options.format == output_format::arrow) {
+      arrow.emplace(std::move(column_names), output_file);
+    } else {
+      jsonl.emplace(column_names);
+    }
+  }
+
+  // Appends the row made of tokens to chunk, or to the Arrow batch, joined,
+  // and with replacement in the overwritten column.
+  std::string storage;
+  const auto rewrite_row{[&](tokens& tokens, bool terminated,
+                             std::string_view ending,
+                             std::string_view replacement,
+                             std::pmr::string& chunk) {
+    if (join) {
+      join->apply(tokens, storage);
+    }
+    tokens[*column_position] = replacement;
+    // Rows the join defers reach the Arrow batch once back in order.
+    if (arrow && !(join && join->partitioned())) {
+      arrow->add_row<Dialect>(tokens);
+      return;
+    }
+    if (jsonl) {
+      jsonl->append_row<Dialect>(tokens, chunk);
+      return;
+    }
+    merge_tokens_into_line<Dialect>(tokens, chunk);
+    if (terminated) {
+      chunk += Dialect::delimiter;
+    }
+    chunk += ending.empty() ? header.line_ending : ending;
+  }};
+
+  // When pseudonymizing, the replacement string is the prefix of the
+  // pseudonyms, and empty values stay empty.
+  const auto quote_pseudonyms{quote_field<Dialect>(options.replacement) !=
+                              options.replacement};
+  std::string pseudonym;
+  const auto make_pseudonym{[&](std::string_view value, std::uint64_t hash) {
+    pseudonym.clear();
+    if (!value.empty()) {
+      append_pseudonym(pseudonym, options.replacement, hash);
+      if (quote_pseudonyms) {
+        pseudonym = quote_field<Dialect>(pseudonym);
+      }
+    }
+    return std::string_view{pseudonym};
+  }};
+
+  // In CSV, a row is written at once with a placeholder for the digits of
+  // its pseudonym, which are filled in once PSEUDONYM_BATCH values have
+  // been hashed together: rows are neither held back nor moved. The Arrow
+  // and JSON Lines writers take a row with its pseudonym.
+  const auto batch_pseudonyms{options.pseudonym_key && !arrow && !jsonl};
+  const std::string placeholder{make_pseudonym("-", 0)};
+  const auto placeholder_digits{placeholder.size() - PSEUDONYM_SIZE -
+                                (quote_pseudonyms ? 1 : 0)};
+  std::array<std::string, PSEUDONYM_BATCH> value_storage;
+  std::array<std::string_view, PSEUDONYM_BATCH> values;
+  // Where the digits of each pseudonym go in the chunk.
+  std::array<std::size_t, PSEUDONYM_BATCH> digits_at;
+  std::array<std::uint64_t, PSEUDONYM_BATCH> hashes;
+  std::size_t pending{0};
+  const auto flush_batch{[&](std::pmr::string& chunk) {
+    siphash_batch(*options.pseudonym_key, values.data(), pending,
+                  hashes.data());
+    for (std::size_t i{0}; i < pending; ++i) {
+      write_pseudonym_digits(chunk.data() + digits_at[i], hashes[i]);
+    }
+    pending = 0;
+  }};
+  const auto pseudonymize_row{[&](tokens& fields, bool terminated,
+                                  std::string_view ending,
+                                  std::pmr::string& chunk) {
+    const auto value{field_value<Dialect>(fields[*column_position],
+                                          value_storage[pending])};
+    if (!batch_pseudonyms || value.empty()) {
+      rewrite_row(fields, terminated, ending,
+                  make_pseudonym(value, siphash(*options.pseudonym_key, value)),
+                  chunk);
+      return;
+    }
+    auto at{chunk.size() + placeholder_digits};
+    rewrite_row(fields, terminated, ending, placeholder, chunk);
+    for (std::size_t i{0}; i < *column_position; ++i) {
+      at += fields[i].size() + 1;
+    }
+    values[pending] = value;
+    digits_at[pending] = at;
+    if (++pending == PSEUDONYM_BATCH) flush_batch(chunk);
+  }};
+
+  // The first block tells how much the replacement grows or shrinks rows,
+  // which gives an estimate of the output size for preallocation.
+  const auto input_size{input_file.size()};
+  const auto estimate_bytes_read{block.records.size() + bom.size()};
+  auto first_block{true};
+
+  // Rows are rewritten a block at a time: everything a block allocates comes
+  // from the arena, which is reset wholesale once the block has been flushed.
+  arena_resource arena;
+  // Rows with another number of fields than the header are reported and
+  // left out.
+  const auto well_formed{[&](const csv_row& row) {
+    if (row.fields.size() == number_of_columns) return true;
+    std::pmr::string skipped{&arena};
+    merge_tokens_into_line<Dialect>(row.fields, skipped);
+    std::cout << "skipping line: " << skipped << '\n';
+    return false;
+  }};
+  const auto rewrite_records{[&](std::string_view records) {
+    std::pmr::string chunk{&arena};
+
+    // Rows --where leaves alone are copied as they are, or left out.
+    const auto others{[&](std::string_view run) {
+      if (!options.drop_others) chunk += run;
+    }};
+    const auto rewrite_run{[&](std::string_view run) {
+      for (auto& row : records_of<Dialect>(run) |
+                           split_rows<Dialect>(header, &arena) |
+                           filter(well_formed)) {
+        if (where_position && !selected(row)) {
+          others(row.source.line);
+          others(row.source.ending);
+          continue;
+        }
+        for (auto& [position, profile] : profiles) {
+          add_field<Dialect>(profile, row.fields[position]);
+        }
+        const auto ending{row.source.ending};
+        if (join && join->partitioned()) {
+          join->defer(row.fields, row.source.line, ending, storage);
+        } else if (options.pseudonym_key) {
+          pseudonymize_row(row.fields, row.terminated, ending, chunk);
+        } else {
+          rewrite_row(row.fields, row.terminated, ending, wanted_value,
+                      chunk);
+        }
+      }
+    }};
+    if (prefilter) {
+      // Runs without a candidate are copied whole unless they hold a row of
+      // another number of fields, which the rewrite reports and leaves out.
+      prefilter->split(
+          records,
+          [&](std::string_view run) {
+            const auto malformed{structure->malformed_rows()};
+            structure->check(run);
+            if (structure->malformed_rows() > malformed) {
+              rewrite_run(run);
+            } else {
+              others(run);
+            }
+          },
+          rewrite_run);
+    } else {
+      rewrite_run(records);
+    }
+    if (pending > 0) flush_batch(chunk);
+
+    output_file << chunk;
+  }};
+
+  // A tail is read from the end of the input, and a sample is rewritten
+  // once the whole input has been read.
+  std::optional<record_sample<Dialect>> sample;
+  if (options.selection == row_selection::sample) {
+    sample.emplace(options.selected_rows,
+                   options.sample_seed ? *options.sample_seed
+                                       : std::random_device{}());
+  }
+  auto rows_left{options.selected_rows};
+  auto reading{options.selection != row_selection::tail};
+  while (reading) {
+    if (options.selection == row_selection::head) {
+      records = first_records<Dialect>(records, rows_left);
+    }
+    if (sample) {
+      sample->add(records);
+    } else if (incremental) {
+      incremental->add(records, output_file, rewrite_records);
+    } else {
+      rewrite_records(records);
+    }
+    if (first_block && estimate_bytes_read < input_size && !arrow &&
+        options.selection == row_selection::all && !options.follow &&
+        !(join && join->partitioned())) {
+      output_file.preallocate(input_size * output_file.bytes_written() /
+                              estimate_bytes_read);
+    }
+    first_block = false;
+    arena.reset();
+    if (follower) {
+      follower->recycle(std::move(block.buffer));
+    } else {
+      reader->recycle(std::move(block.buffer));
+    }
+    if (options.selection == row_selection::head && rows_left == 0) break;
+    // Rows rewritten so far are written out before waiting for more.
+    if (!next_block([&] { output_file.flush(); })) break;
+    records = block.records;
+  }
+  if (reader && reader->error() != 0) return input_failed(reader->error());
+  if (options.selection == row_selection::tail) {
+    rewrite_records(last_records<Dialect>(input_file, header_end,
+                                          options.selected_rows));
+  } else if (sample) {
+    rewrite_records(sample->records());
+  }
+
+  if (join) {
+    const auto joined{join->finish(
+        [&](std::string_view line, std::string_view ending,
+            std::pmr::string& chunk) {
+          arena.reset();
+          const auto terminated{
+              strip_trailing_delimiter<Dialect>(header, line)};
+          auto tokens{split_line_into_tokens<Dialect>(line, &arena)};
+          if (options.pseudonym_key) {
+            const auto value{
+                field_value<Dialect>(tokens[*column_position], storage)};
+            rewrite_row(tokens, terminated, ending,
+                        make_pseudonym(value, siphash(*options.pseudonym_key,
+                                                      value)),
+                        chunk);
+          } else {
+            rewrite_row(tokens, terminated, ending, wanted_value, chunk);
+          }
+        },
+        [&](std::string_view record) {
+          if (!arrow) {
+            output_file << record;
+            return;
+          }
+          arena.reset();
+          auto line{next_record<Dialect>(record).line};
+          strip_trailing_delimiter<Dialect>(header, line);
+          const auto tokens{split_line_into_tokens<Dialect>(line, &arena)};
+          arrow->add_row<Dialect>(tokens);
+        })};
+    if (!joined) return temp_failed(join->error(), output_file);
+  }
 
-auto merge_tokens_into_line(const std::vector<std::string>& tokens) {
-  std::ostringstream oss;
-  for (const auto& token : tokens) {
-    oss << token;
-    oss << ',';
+  if (incremental) {
+    incremental->finish(output_file, rewrite_records);
+    const auto size{output_file.bytes_written()};
+    if (!output_file.close()) return output_failed(output_file);
+    if (!incremental->commit(size)) {
+      std::cerr << "output file not replaced, or its chunk list not saved: "
+                << std::strerror(errno) << '\n';
+      return error_codes::NO_CSV_OUTPUT_FILE;
+    }
+    std::cout << incremental->reused_chunks() << " of "
+              << incremental->chunks() << " chunks reused\n";
   }
 
-  std::string line{oss.str()};
-  if (!line.empty()) {
-    line.pop_back();
+  if (arrow) {
+    arrow->finish();
+    if (!arrow->invalid_text().empty()) {
+      std::cerr << "column " << arrow->invalid_text()
+                << " is utf8 from its first rows but holds a value that is not"
+                   " valid UTF-8: output removed\n";
+      output_file.discard();
+      return error_codes::INVALID_TEXT;
+    }
+    if (const auto mismatched{arrow->mismatched_values()}) {
+      std::cerr << mismatched
+                << " values not of the type of their column written as null\n";
+    }
   }
-  return line;
+  if (!output_file.close()) return output_failed(output_file);
+
+  for (std::size_t i{0}; i < profiles.size(); ++i) {
+    print_profile(std::cout, options.profile_columns[i], profiles[i].second,
+                  options.top_k);
+  }
+  return 0;
 }
-}  // namespace tool
 
-int main(int argc, char* argv[]) {
-  if (argc != tool::NUMBER_OF_PARAMETERS + 1) {
-    return tool::error_codes::NOT_ENOUGH_PARAMETERS;
+template <typename Dialect>
+int check(const options& options) {
+  auto input_file{file_handle::open_read(options.input_filename)};
+  block_reader<Dialect> reader{input_file, options.io};
+  input_block block;
+  if (!reader.next_block(block)) {
+    return 0;
   }
 
-  const auto args = gsl::multi_span<char*>(argv, argc);
+  auto records{block.records};
+  const auto header{parse_header<Dialect>(next_record<Dialect>(records))};
+  structure_check<Dialect> check{header, std::cout};
+  do {
+    check.check(records);
+    reader.recycle(std::move(block.buffer));
+    if (!reader.next_block(block)) break;
+    records = block.records;
+  } while (true);
+  if (reader.error() != 0) return input_failed(reader.error());
 
-  const auto input_filename{args[tool::parameter_position::CSV_INPUT_FILE]};
-  if (!fs::exists(input_filename)) {
-    std::cerr << "input file missing\n";
-    return tool::error_codes::NO_CSV_INPUT_FILE;
+  std::cout << check.rows() << " rows, " << check.malformed_rows()
+            << " malformed\n";
+  return check.malformed_rows() == 0 ? 0 : error_codes::MALFORMED_ROWS;
+}
+
+template <typename Dialect>
+int print_schema(const options& options) {
+  auto input_file{file_handle::open_read(options.input_filename)};
+  block_reader<Dialect> reader{input_file, options.io};
+  input_block block;
+  if (!reader.next_block(block)) {
+    return 0;
   }
 
-  std::ifstream input_file(input_filename);
-  std::string column_line;
-  std::getline(input_file, column_line);
-  const auto column_names{tool::split_line_into_tokens(column_line)};
-  const auto number_of_columns{column_names.size()};
+  auto records{block.records};
+  const auto header{parse_header<Dialect>(next_record<Dialect>(records))};
+  csv_schema schema;
+  do {
+    infer_schema<Dialect>(records, header, schema);
+    reader.recycle(std::move(block.buffer));
+    if (schema_complete(schema) || !reader.next_block(block)) break;
+    records = block.records;
+  } while (true);
 
-  const std::string wanted_column{args[tool::parameter_position::COLUMN_NAME]};
+  for (std::size_t i{0}; i < schema.types.size(); ++i) {
+    std::cout << header.column_names[i] << ": "
+              << column_type_name(schema.types[i]);
+    if (schema.empty_values[i] > 0) {
+      std::cout << ", " << schema.empty_values[i] << " empty";
+    }
+    std::cout << '\n';
+  }
+  std::cout << schema.rows << " rows sampled\n";
+  return 0;
+}
 
-  const auto found_column{std::find(std::begin(column_names),
-                                    std::end(column_names), wanted_column)};
-  if (found_column == std::end(column_names)) {
+template <typename Dialect>
+int sort_by(const options& options) {
+  auto input_file{file_handle::open_read(options.input_filename)};
+  block_reader<Dialect> reader{input_file, options.io};
+  input_block block;
+  reader.next_block(block);
+  auto records{block.records};
+
+  const auto header{parse_header<Dialect>(
+      records.empty() ? record{} : next_record<Dialect>(records))};
+  const auto number_of_columns{header.number_of_columns()};
+  const auto key_position{header.find(options.sort_column)};
+  if (!key_position) {
     std::cerr << "column name doesn't exists in the input file\n";
-    return tool::error_codes::NO_COLUMN_NAME;
+    return error_codes::NO_COLUMN_NAME;
+  }
+
+  external_sorter sorter{options.sort_keys, options.memory_budget,
+                         options.temp_directory, options.io};
+  arena_resource arena;
+  std::string storage;
+  do {
+    while (!records.empty()) {
+      const auto [line, ending]{next_record<Dialect>(records)};
+      auto fields{line};
+      strip_trailing_delimiter<Dialect>(header, fields);
+
+      const auto tokens{split_line_into_tokens<Dialect>(fields, &arena)};
+      if (tokens.size() == number_of_columns) {
+        sorter.add(field_value<Dialect>(tokens[*key_position], storage), line,
+                   ending.empty() ? header.line_ending : ending);
+      } else {
+        std::cout << "skipping line: " << line << '\n';
+      }
+    }
+    arena.reset();
+    reader.recycle(std::move(block.buffer));
+    if (!reader.next_block(block)) break;
+    records = block.records;
+  } while (true);
+  if (reader.error() != 0) return input_failed(reader.error());
+
+  output_file output_file(options.output_filename, options.output_mode,
+                          options.io);
+  output_file << reader.bom();
+  output_file << header.line;
+  output_file << header.line_ending;
+  if (!sorter.finish([&](std::string_view record) { output_file << record; })) {
+    return temp_failed(sorter.error(), output_file);
+  }
+  if (!output_file.close()) return output_failed(output_file);
+  return 0;
+}
+
+template <typename Dialect>
+int group_by(const options& options) {
+  auto input_file{file_handle::open_read(options.input_filename)};
+  block_reader<Dialect> reader{input_file, options.io};
+  input_block block;
+  reader.next_block(block);
+
+  const auto header{parse_header<Dialect>(
+      block.records.empty() ? record{} : next_record<Dialect>(block.records))};
+  const auto number_of_columns{header.number_of_columns()};
+  const auto group_position{header.find(options.group_column)};
+  if (!group_position) {
+    std::cerr << "column name doesn't exists in the input file\n";
+    return error_codes::NO_COLUMN_NAME;
+  }
+
+  // The columns the aggregates take numbers from, each once, and which of
+  // them each aggregate uses.
+  std::vector<std::size_t> measured;
+  std::vector<std::size_t> measured_by;
+  for (const auto& aggregate : options.aggregates) {
+    if (aggregate.function == aggregate_function::count) {
+      measured_by.push_back(0);
+      continue;
+    }
+    const auto position{header.find(aggregate.column)};
+    if (!position) {
+      std::cerr << "column name doesn't exists in the input file\n";
+      return error_codes::NO_COLUMN_NAME;
+    }
+    const auto found{std::find(measured.begin(), measured.end(), *position)};
+    measured_by.push_back(
+        static_cast<std::size_t>(std::distance(measured.begin(), found)));
+    if (found == measured.end()) {
+      measured.push_back(*position);
+    }
   }
-  const auto column_position{
-      std::distance(std::begin(column_names), found_column)};
 
-  const std::string wanted_value{
-      args[tool::parameter_position::REPLACEMENT_STRING]};
+  const auto workers{worker_count(options.threads)};
+  group_aggregation aggregation{measured.size(), workers,
+                                options.memory_budget,
+                                options.temp_directory};
+  std::vector<arena_resource> arenas(workers);
+  std::mutex report_mutex;
+  const auto numa{options.numa ? std::optional{numa_topology::detect()}
+                               : std::nullopt};
+  for_each_block(reader, block, workers, [&](std::string_view records,
+                                             std::size_t worker) {
+    auto& table{aggregation.table(worker)};
+    auto& arena{arenas[worker]};
+    std::string key_storage;
+    std::string value_storage;
+    while (!records.empty()) {
+      auto line{next_record<Dialect>(records).line};
+      strip_trailing_delimiter<Dialect>(header, line);
+      const auto tokens{split_line_into_tokens<Dialect>(line, &arena)};
+      if (tokens.size() != number_of_columns) {
+        std::lock_guard<std::mutex> lock{report_mutex};
+        std::cout << "skipping line: " << line << '\n';
+        continue;
+      }
 
-  const auto output_filename{args[tool::parameter_position::CSV_OUTPUT_FILE]};
-  std::ofstream output_file(output_filename);
-  output_file << column_line;
-  output_file << '\n';
+      const auto key{field_value<Dialect>(tokens[*group_position],
+                                          key_storage)};
+      const auto index{table.find_or_add(key, hash_bytes(key))};
+      ++table.at(index).rows;
+      for (std::size_t c{0}; c < measured.size(); ++c) {
+        table.numbers(index)[c].add(
+            field_value<Dialect>(tokens[measured[c]], value_storage));
+      }
+    }
+    arena.reset();
+    aggregation.check_memory(worker);
+  }, numa ? &*numa : nullptr);
+  if (reader.error() != 0) return input_failed(reader.error());
 
+  output_file output_file(options.output_filename, options.output_mode,
+                          options.io);
+  output_file << reader.bom();
+  output_file << quote_field<Dialect>(options.group_column);
+  for (const auto& aggregate : options.aggregates) {
+    output_file << std::string_view{&Dialect::delimiter, 1};
+    output_file << quote_field<Dialect>(aggregate_name(aggregate));
+  }
+  output_file << header.line_ending;
+
+  // Groups come out in no particular order: they are sorted by key.
+  external_sorter sorter{key_type::lexicographic, options.memory_budget,
+                         options.temp_directory, options.io};
   std::string line;
-  while (std::getline(input_file, line)) {
-    auto tokens{tool::split_line_into_tokens(line)};
-    if (tokens.size() == number_of_columns) {
-      tokens[column_position] = wanted_value;
-      output_file << tool::merge_tokens_into_line(tokens);
-      output_file << '\n';
-    } else {
-      std::cout << "skipping line: " << tool::merge_tokens_into_line(tokens)
-                << '\n';
+  const auto aggregated{aggregation.finish(
+      [&](std::string_view key, std::uint64_t rows,
+          const accumulator* numbers) {
+        line = quote_field<Dialect>(key);
+        for (std::size_t i{0}; i < options.aggregates.size(); ++i) {
+          const auto function{options.aggregates[i].function};
+          line += Dialect::delimiter;
+          append_aggregate(line, function, rows,
+                           function == aggregate_function::count
+                               ? accumulator{}
+                               : numbers[measured_by[i]]);
+        }
+        sorter.add(key, line, header.line_ending);
+      })};
+  if (!aggregated) return temp_failed(aggregation.error(), output_file);
+
+  if (!sorter.finish([&](std::string_view record) { output_file << record; })) {
+    return temp_failed(sorter.error(), output_file);
+  }
+  if (!output_file.close()) return output_failed(output_file);
+  return 0;
+}
+
+// Completes the dialect from a sample of the input, then runs the kernel
+// specialized for it.
+int run(options options) {
+  // The server has no input of its own to guess the dialect from.
+  if (options.mode == run_mode::serve) {
+    return dispatch_dialect(options.dialect, [&](auto dialect) {
+      return serve<decltype(dialect)>(options);
+    });
+  }
+
+  if (!fs::exists(options.input_filename)) {
+    std::cerr << "input file missing\n";
+    return error_codes::NO_CSV_INPUT_FILE;
+  }
+
+  auto complete{false};
+  const auto sample{[&] {
+    std::ifstream input_file(options.input_filename, std::ios::binary);
+    return read_sample(input_file, options.sniff_bytes, complete);
+  }()};
+  const auto sniffed{sniff_dialect(
+      sample, complete,
+      options.explicit_delimiter ? std::vector<char>{options.dialect.delimiter}
+                                 : std::vector<char>{',', ';', '\t', '|'},
+      options.explicit_escape
+          ? std::vector<escape_rule>{options.dialect.escape}
+          : std::vector<escape_rule>{escape_rule::doubled_quote,
+                                     escape_rule::backslash,
+                                     escape_rule::none})};
+  options.dialect.delimiter = sniffed.delimiter;
+  options.dialect.escape = sniffed.escape;
+  if (!options.explicit_crlf) {
+    options.dialect.crlf = sniffed.crlf;
+  }
+
+  if (options.temp_directory.empty()) {
+    options.temp_directory = fs::temp_directory_path().string();
+  }
+
+  return dispatch_dialect(options.dialect, [&](auto dialect) {
+    using dialect_type = decltype(dialect);
+    switch (options.mode) {
+      case run_mode::check:
+        return check<dialect_type>(options);
+      case run_mode::sort:
+        return sort_by<dialect_type>(options);
+      case run_mode::group:
+        return group_by<dialect_type>(options);
+      case run_mode::schema:
+        return print_schema<dialect_type>(options);
+      default:
+        return rewrite<dialect_type>(options);
     }
+  });
+}
+}  // namespace tool
+
+int main(int argc, char* argv[]) {
+  tool::options options;
+  if (const auto error{
+          tool::parse_options(gsl::multi_span<char*>(argv, argc), options)}) {
+    return error;
   }
+
+  tool::page_allocator::instance().use_huge_pages(options.huge_pages);
+  const auto result{tool::run(options)};
+  if (options.huge_pages) {
+    tool::print_huge_page_stats(std::cout);
+  }
+  return result;
 }
\ No newline at end of file
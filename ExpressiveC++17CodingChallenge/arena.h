@@ -0,0 +1,97 @@
+#pragma once
+
+// Bump allocator for per-chunk row storage.
+// Every field vector, rebuilt line and replacement copy created while a chunk
+// is being rewritten is carved out of a few large blocks; deallocation is a
+// no-op and the whole chunk is released at once by reset().
+//
+// std::pmr::monotonic_buffer_resource is close, but its release() hands the
+// blocks back upstream, so every chunk would go through the global allocator
+// again. The arena keeps its blocks and reuses them for the next chunk. The
+// blocks come from the page_allocator, on huge pages with --huge-pages.
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+#include "pages.h"
+
+namespace tool {
+constexpr std::size_t ARENA_BLOCK_SIZE{1 << 20};
+
+class arena_resource : public std::pmr::memory_resource {
+ public:
+  explicit arena_resource(std::size_t block_size = ARENA_BLOCK_SIZE)
+      : block_size_{block_size} {}
+
+  arena_resource(const arena_resource&) = delete;
+  arena_resource& operator=(const arena_resource&) = delete;
+
+  // Makes every block available again. Memory handed out before the call
+  // must not be used afterwards.
+  void reset() noexcept {
+    current_ = 0;
+    offset_ = 0;
+    bytes_in_use_ = 0;
+  }
+
+  std::size_t bytes_in_use() const noexcept { return bytes_in_use_; }
+  std::size_t bytes_reserved() const noexcept {
+    std::size_t total{0};
+    for (const auto& block : blocks_) total += block.size;
+    return total;
+  }
+
+ private:
+  struct block {
+    std::unique_ptr<std::byte[], page_deleter> data;
+    std::size_t size;
+  };
+
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+    while (current_ < blocks_.size()) {
+      if (auto* p{carve(blocks_[current_], bytes, alignment)}) return p;
+      ++current_;
+      offset_ = 0;
+    }
+
+    const auto size{std::max(block_size_, bytes + alignment)};
+    blocks_.push_back(
+        {std::unique_ptr<std::byte[], page_deleter>{
+             static_cast<std::byte*>(page_allocator::instance().allocate(size)),
+             page_deleter{size}},
+         size});
+    current_ = blocks_.size() - 1;
+    offset_ = 0;
+    return carve(blocks_.back(), bytes, alignment);
+  }
+
+  void do_deallocate(void*, std::size_t, std::size_t) override {}
+
+  bool do_is_equal(const std::pmr::memory_resource& other) const
+      noexcept override {
+    return this == &other;
+  }
+
+  void* carve(block& b, std::size_t bytes, std::size_t alignment) noexcept {
+    void* p{b.data.get() + offset_};
+    auto space{b.size - offset_};
+    if (!std::align(alignment, bytes, p, space)) return nullptr;
+
+    const auto used{static_cast<std::size_t>(static_cast<std::byte*>(p) -
+                                             b.data.get()) +
+                    bytes};
+    bytes_in_use_ += used - offset_;
+    offset_ = used;
+    return p;
+  }
+
+  std::size_t block_size_;
+  std::vector<block> blocks_;
+  std::size_t current_{0};
+  std::size_t offset_{0};
+  std::size_t bytes_in_use_{0};
+};
+}  // namespace tool
@@ -0,0 +1,683 @@
+#pragma once
+
+// Arrow IPC file output.
+// Rows are gathered into record batches of ARROW_BATCH_ROWS, a column at a
+// time, and written in the Arrow IPC file format (Feather version 2), which
+// Arrow readers open without parsing any text. The types of the columns are
+// inferred from the first batch: integers become int64, reals float64,
+// dates date32, and text utf8, dictionary-encoded when the first batch has
+// few distinct values. Empty values are nulls, in text columns too, where
+// an empty string cannot be told from a missing value in CSV; so are later
+// values that do not parse as the type of their column.
+//
+// Arrow readers check that utf8 values are valid UTF-8, so the text of each
+// batch is checked before it is written: text with other bytes in the first
+// batch, such as Latin-1, makes its column binary. Once the schema is
+// written it cannot change, and a later value that is not UTF-8 in a utf8
+// column stops the output, which invalid_text() then tells about: the file
+// is left without its footer, for the caller to remove.
+//
+// The metadata is FlatBuffers, built here by hand for the few tables Arrow
+// needs, and written on the assumption of a little-endian host, as Arrow
+// data is.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "output.h"
+#include "schema.h"
+#include "swar.h"
+#include "tokenizer.h"
+
+namespace tool {
+constexpr std::size_t ARROW_BATCH_ROWS{64 * 1024};
+// A batch is written early once its text reaches this size, which keeps its
+// string offsets within 32 bits.
+constexpr std::size_t ARROW_BATCH_BYTES{std::size_t{64} << 20};
+// A text column is dictionary-encoded when its first batch has at least
+// this many values per distinct value.
+constexpr std::size_t ARROW_DICTIONARY_RATIO{4};
+
+namespace detail {
+// Builds a FlatBuffer back to front, as the FlatBuffers library does, so
+// that objects are written before the tables referring to them, which point
+// forward as the format requires. Objects are identified by their distance
+// from the end of the buffer.
+class flatbuffer_builder {
+ public:
+  using offset = std::uint32_t;
+
+  offset size() const { return static_cast<offset>(bytes_.size()); }
+
+  offset create_string(std::string_view text) {
+    align(text.size() + 1, 4);
+    bytes_.insert(0, 1, '\0');
+    bytes_.insert(0, text);
+    put(static_cast<std::uint32_t>(text.size()));
+    return size();
+  }
+
+  template <typename Struct>
+  offset create_vector(const std::vector<Struct>& items) {
+    const auto bytes{items.size() * sizeof(Struct)};
+    align(bytes, 4);
+    align(bytes, alignof(Struct));
+    bytes_.insert(0, reinterpret_cast<const char*>(items.data()), bytes);
+    put(static_cast<std::uint32_t>(items.size()));
+    return size();
+  }
+
+  offset create_offset_vector(const std::vector<offset>& items) {
+    align(items.size() * 4, 4);
+    for (auto item{items.rbegin()}; item != items.rend(); ++item) {
+      put(size() + 4 - *item);
+    }
+    put(static_cast<std::uint32_t>(items.size()));
+    return size();
+  }
+
+  // Tables do not nest: the objects a table refers to come first.
+  void start_table() {
+    fields_.clear();
+    table_end_ = size();
+  }
+
+  template <typename T>
+  void add_scalar(std::uint16_t id, T value) {
+    align(sizeof(T), sizeof(T));
+    put(value);
+    fields_.push_back({id, size()});
+  }
+
+  void add_offset(std::uint16_t id, offset object) {
+    align(4, 4);
+    put(size() + 4 - object);
+    fields_.push_back({id, size()});
+  }
+
+  offset end_table() {
+    align(4, 4);
+    put(std::int32_t{0});
+    const auto table{size()};
+
+    std::uint16_t fields{0};
+    for (const auto& field : fields_) {
+      fields = std::max<std::uint16_t>(fields, field.id + 1);
+    }
+    std::vector<std::uint16_t> vtable(2 + fields, 0);
+    vtable[0] = static_cast<std::uint16_t>(vtable.size() * 2);
+    vtable[1] = static_cast<std::uint16_t>(table - table_end_);
+    for (const auto& field : fields_) {
+      vtable[2 + field.id] = static_cast<std::uint16_t>(table - field.position);
+    }
+    for (auto entry{vtable.rbegin()}; entry != vtable.rend(); ++entry) {
+      put(*entry);
+    }
+
+    // The table starts with the distance back to its vtable.
+    const auto to_vtable{static_cast<std::int32_t>(size() - table)};
+    std::memcpy(&bytes_[bytes_.size() - table], &to_vtable, sizeof to_vtable);
+    return table;
+  }
+
+  std::string finish(offset root) {
+    align(4, max_alignment_);
+    put(size() + 4 - root);
+    return std::move(bytes_);
+  }
+
+ private:
+  struct field_position {
+    std::uint16_t id;
+    offset position;
+  };
+
+  // Pads so that size bytes prepended next end aligned to alignment.
+  void align(std::size_t size, std::size_t alignment) {
+    max_alignment_ = std::max(max_alignment_, alignment);
+    const auto misalignment{(bytes_.size() + size) % alignment};
+    if (misalignment != 0) {
+      bytes_.insert(0, alignment - misalignment, '\0');
+    }
+  }
+
+  template <typename T>
+  void put(T value) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    bytes_.insert(0, bytes, sizeof(T));
+  }
+
+  std::string bytes_;
+  std::vector<field_position> fields_;
+  offset table_end_{0};
+  std::size_t max_alignment_{1};
+};
+
+// Whether text is valid UTF-8: no overlong forms, surrogates, or code
+// points past U+10FFFF. ASCII is skipped a word at a time.
+inline bool is_utf8(std::string_view text) {
+  std::size_t i{0};
+  while (i < text.size()) {
+    if (i + swar::WORD_SIZE <= text.size() &&
+        (swar::load(text.data() + i) & ~swar::LOW_BITS) == 0) {
+      i += swar::WORD_SIZE;
+      continue;
+    }
+    const auto c{static_cast<unsigned char>(text[i])};
+    if (c < 0x80) {
+      ++i;
+      continue;
+    }
+    // The length of the sequence, and the range of its second byte, which
+    // rules out the overlong forms, surrogates and code points too large.
+    std::size_t length{0};
+    unsigned char low{0x80};
+    unsigned char high{0xBF};
+    if (c >= 0xC2 && c <= 0xDF) {
+      length = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+      length = 3;
+      if (c == 0xE0) low = 0xA0;
+      if (c == 0xED) high = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+      length = 4;
+      if (c == 0xF0) low = 0x90;
+      if (c == 0xF4) high = 0x8F;
+    } else {
+      return false;
+    }
+    if (text.size() - i < length) return false;
+    const auto second{static_cast<unsigned char>(text[i + 1])};
+    if (second < low || second > high) return false;
+    for (std::size_t j{2}; j < length; ++j) {
+      if ((static_cast<unsigned char>(text[i + j]) & 0xC0) != 0x80) {
+        return false;
+      }
+    }
+    i += length;
+  }
+  return true;
+}
+
+// The structs of the Arrow metadata, laid out as FlatBuffers lays them out.
+struct arrow_buffer {
+  std::int64_t offset;
+  std::int64_t length;
+};
+
+struct arrow_field_node {
+  std::int64_t length;
+  std::int64_t null_count;
+};
+
+struct arrow_block {
+  std::int64_t offset;
+  std::int32_t metadata_length;
+  std::int32_t padding;
+  std::int64_t body_length;
+};
+static_assert(sizeof(arrow_block) == 24, "Block is 24 bytes in Arrow");
+
+// Values from the Arrow schema: Schema.fbs, Message.fbs and File.fbs.
+constexpr std::int16_t METADATA_V5{4};
+constexpr std::uint8_t TYPE_INT{2};
+constexpr std::uint8_t TYPE_FLOATING_POINT{3};
+constexpr std::uint8_t TYPE_BINARY{4};
+constexpr std::uint8_t TYPE_UTF8{5};
+constexpr std::uint8_t TYPE_DATE{8};
+constexpr std::int16_t PRECISION_DOUBLE{2};
+constexpr std::int16_t DATE_UNIT_DAY{0};
+constexpr std::uint8_t HEADER_SCHEMA{1};
+constexpr std::uint8_t HEADER_DICTIONARY_BATCH{2};
+constexpr std::uint8_t HEADER_RECORD_BATCH{3};
+
+// The body of a message: buffers, each padded to 8 bytes, and the nodes of
+// the arrays they make up.
+struct arrow_body {
+  std::string bytes;
+  std::vector<arrow_buffer> buffers;
+  std::vector<arrow_field_node> nodes;
+
+  void add_buffer(const void* data, std::size_t size) {
+    buffers.push_back({static_cast<std::int64_t>(bytes.size()),
+                       static_cast<std::int64_t>(size)});
+    bytes.append(static_cast<const char*>(data), size);
+    bytes.append((8 - bytes.size() % 8) % 8, '\0');
+  }
+
+  template <typename T>
+  void add_buffer(const std::vector<T>& items) {
+    add_buffer(items.data(), items.size() * sizeof(T));
+  }
+};
+}  // namespace detail
+
+class arrow_writer {
+ public:
+  arrow_writer(std::vector<std::string> column_names, output_file& output)
+      : output_{output}, columns_(column_names.size()) {
+    for (std::size_t i{0}; i < columns_.size(); ++i) {
+      columns_[i].name = std::move(column_names[i]);
+    }
+  }
+
+  // Adds a row with a field per column. Does nothing once a value was not
+  // valid text.
+  template <typename Dialect>
+  void add_row(const tokens& fields) {
+    if (!invalid_text_.empty()) return;
+    if (rows_ % 8 == 0) {
+      for (auto& column : columns_) column.validity.push_back(0);
+    }
+    for (std::size_t i{0}; i < columns_.size(); ++i) {
+      auto& column{columns_[i]};
+      const auto value{field_value<Dialect>(fields[i], storage_)};
+      if (value.empty()) {
+        ++column.nulls;
+      } else {
+        column.validity.back() |= static_cast<std::uint8_t>(1 << rows_ % 8);
+        column.data += value;
+        text_bytes_ += value.size();
+      }
+      column.offsets.push_back(static_cast<std::int32_t>(column.data.size()));
+    }
+    ++rows_;
+    if (rows_ == ARROW_BATCH_ROWS || text_bytes_ >= ARROW_BATCH_BYTES) {
+      write_batch();
+    }
+  }
+
+  // Writes the rows left and the footer, unless a value was not valid text.
+  void finish() {
+    if (!invalid_text_.empty()) return;
+    if (rows_ > 0) {
+      write_batch();
+    } else if (!started_) {
+      start();
+    }
+    write_u32(0xFFFFFFFF);
+    write_u32(0);
+
+    detail::flatbuffer_builder builder;
+    const auto schema{add_schema(builder)};
+    const auto dictionaries{builder.create_vector(dictionary_blocks_)};
+    const auto record_batches{builder.create_vector(record_batch_blocks_)};
+    builder.start_table();
+    builder.add_scalar(0, detail::METADATA_V5);
+    builder.add_offset(1, schema);
+    builder.add_offset(2, dictionaries);
+    builder.add_offset(3, record_batches);
+    const auto footer{builder.finish(builder.end_table())};
+    write(footer);
+    write_u32(static_cast<std::uint32_t>(footer.size()));
+    write("ARROW1");
+  }
+
+  // Values written as null because they did not parse as the type of their
+  // column.
+  std::uint64_t mismatched_values() const { return mismatched_values_; }
+
+  // The name of the utf8 column a value that is not valid UTF-8 was added
+  // to after the first batch, which left the output unfinished. Empty if
+  // none was.
+  const std::string& invalid_text() const { return invalid_text_; }
+
+ private:
+  struct column {
+    std::string name;
+    column_type type{column_type::text};
+    bool dictionary{false};
+    // Text declared binary, since its first batch was not all UTF-8.
+    bool binary{false};
+
+    // The batch being built, as Arrow lays out strings.
+    std::vector<std::uint8_t> validity;
+    std::vector<std::int32_t> offsets{0};
+    std::string data;
+    std::int64_t nulls{0};
+
+    // The dictionary of the column, in index order, and the values already
+    // written.
+    std::deque<std::string> values;
+    std::unordered_map<std::string_view, std::int32_t> indices;
+    std::size_t values_written{0};
+    bool dictionary_written{false};
+  };
+
+  std::string_view value(const column& column, std::size_t row) const {
+    const auto begin{static_cast<std::size_t>(column.offsets[row])};
+    return std::string_view{column.data}.substr(
+        begin, static_cast<std::size_t>(column.offsets[row + 1]) - begin);
+  }
+
+  static bool is_valid(const column& column, std::size_t row) {
+    return (column.validity[row / 8] >> row % 8) & 1;
+  }
+
+  // Whether every value of the batch of column is valid UTF-8: the values
+  // together are, and none starts inside a character, which the one before
+  // would have ended in.
+  bool is_utf8(const column& column) const {
+    if (!detail::is_utf8(column.data)) return false;
+    for (std::size_t row{0}; row < rows_; ++row) {
+      const auto text{value(column, row)};
+      if (!text.empty() &&
+          (static_cast<unsigned char>(text[0]) & 0xC0) == 0x80) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void set_null(column& column, std::size_t row) {
+    column.validity[row / 8] &= static_cast<std::uint8_t>(~(1 << row % 8));
+    ++column.nulls;
+    ++mismatched_values_;
+  }
+
+  // Infers the types of the columns from the first batch, and writes the
+  // head of the file.
+  void start() {
+    for (auto& column : columns_) {
+      auto type{column_type::empty};
+      for (std::size_t row{0}; row < rows_ && type != column_type::text;
+           ++row) {
+        if (is_valid(column, row)) {
+          type = widen(type, detect_type(value(column, row)));
+        }
+      }
+      column.type = type == column_type::empty ? column_type::text : type;
+
+      if (column.type == column_type::text) {
+        column.binary = !is_utf8(column);
+        std::unordered_set<std::string_view> distinct;
+        for (std::size_t row{0}; row < rows_; ++row) {
+          if (is_valid(column, row)) distinct.insert(value(column, row));
+        }
+        column.dictionary =
+            !distinct.empty() &&
+            distinct.size() * ARROW_DICTIONARY_RATIO <= rows_;
+      }
+    }
+
+    write("ARROW1");
+    write(std::string(2, '\0'));
+    detail::flatbuffer_builder builder;
+    const auto schema{add_schema(builder)};
+    write_message(builder, detail::HEADER_SCHEMA, schema, {});
+    started_ = true;
+  }
+
+  void write_batch() {
+    if (!started_) start();
+    for (const auto& column : columns_) {
+      if (column.type == column_type::text && !column.binary &&
+          !is_utf8(column)) {
+        invalid_text_ = column.name;
+        return;
+      }
+    }
+
+    detail::arrow_body body;
+    for (std::size_t i{0}; i < columns_.size(); ++i) {
+      auto& column{columns_[i]};
+      switch (column.type) {
+        case column_type::integer:
+          add_values<std::int64_t>(column, body,
+                                   [](const std::int64_t& x) { return x; });
+          break;
+        case column_type::real:
+          add_values<double>(column, body, [](const double& x) { return x; });
+          break;
+        case column_type::date:
+          add_values<civil_date>(column, body, [](const civil_date& date) {
+            return static_cast<std::int32_t>(date.days());
+          });
+          break;
+        default:
+          if (column.dictionary) {
+            add_indices(i, column, body);
+          } else {
+            add_validity(column, body);
+            body.add_buffer(column.offsets);
+            body.add_buffer(column.data.data(), column.data.size());
+          }
+      }
+    }
+
+    detail::flatbuffer_builder builder;
+    const auto batch{add_record_batch(builder, rows_, body)};
+    record_batch_blocks_.push_back(write_message(
+        builder, detail::HEADER_RECORD_BATCH, batch, body.bytes));
+
+    for (auto& column : columns_) {
+      column.validity.clear();
+      column.offsets.resize(1);
+      column.data.clear();
+      column.nulls = 0;
+    }
+    rows_ = 0;
+    text_bytes_ = 0;
+  }
+
+  void add_validity(const column& column, detail::arrow_body& body) {
+    body.nodes.push_back({static_cast<std::int64_t>(rows_), column.nulls});
+    if (column.nulls == 0) {
+      body.add_buffer(nullptr, 0);
+    } else {
+      body.add_buffer(column.validity);
+    }
+  }
+
+  // Parses the values of column as T, and adds them to body as convert
+  // makes them.
+  template <typename T, typename Convert>
+  void add_values(column& column, detail::arrow_body& body, Convert convert) {
+    std::vector<decltype(convert(T{}))> values(rows_);
+    for (std::size_t row{0}; row < rows_; ++row) {
+      if (!is_valid(column, row)) continue;
+      T parsed;
+      if (parse_value(value(column, row), parsed)) {
+        values[row] = convert(parsed);
+      } else {
+        set_null(column, row);
+      }
+    }
+    add_validity(column, body);
+    body.add_buffer(values);
+  }
+
+  // Replaces the values of column by their indices in its dictionary, and
+  // writes the values new to the dictionary first.
+  void add_indices(std::size_t id, column& column, detail::arrow_body& body) {
+    std::vector<std::int32_t> indices(rows_);
+    for (std::size_t row{0}; row < rows_; ++row) {
+      if (!is_valid(column, row)) continue;
+      const auto text{value(column, row)};
+      auto found{column.indices.find(text)};
+      if (found == column.indices.end()) {
+        column.values.emplace_back(text);
+        found = column.indices
+                    .emplace(column.values.back(),
+                             static_cast<std::int32_t>(column.values.size() -
+                                                       1))
+                    .first;
+      }
+      indices[row] = found->second;
+    }
+    write_dictionary(id, column);
+    add_validity(column, body);
+    body.add_buffer(indices);
+  }
+
+  // The first dictionary batch of a column holds the values of its first
+  // record batch; later ones are deltas with the values new since.
+  void write_dictionary(std::size_t id, column& column) {
+    const auto delta{column.dictionary_written};
+    if (delta && column.values_written == column.values.size()) return;
+
+    detail::arrow_body body;
+    std::vector<std::int32_t> offsets{0};
+    std::string data;
+    for (auto i{column.values_written}; i < column.values.size(); ++i) {
+      data += column.values[i];
+      offsets.push_back(static_cast<std::int32_t>(data.size()));
+    }
+    const auto count{column.values.size() - column.values_written};
+    body.nodes.push_back({static_cast<std::int64_t>(count), 0});
+    body.add_buffer(nullptr, 0);
+    body.add_buffer(offsets);
+    body.add_buffer(data.data(), data.size());
+
+    detail::flatbuffer_builder builder;
+    const auto data_batch{add_record_batch(builder, count, body)};
+    builder.start_table();
+    builder.add_scalar(0, static_cast<std::int64_t>(id));
+    builder.add_offset(1, data_batch);
+    builder.add_scalar(2, static_cast<std::uint8_t>(delta));
+    const auto batch{builder.end_table()};
+    dictionary_blocks_.push_back(write_message(
+        builder, detail::HEADER_DICTIONARY_BATCH, batch, body.bytes));
+    column.values_written = column.values.size();
+    column.dictionary_written = true;
+  }
+
+  detail::flatbuffer_builder::offset add_record_batch(
+      detail::flatbuffer_builder& builder, std::size_t length,
+      const detail::arrow_body& body) {
+    const auto nodes{builder.create_vector(body.nodes)};
+    const auto buffers{builder.create_vector(body.buffers)};
+    builder.start_table();
+    builder.add_scalar(0, static_cast<std::int64_t>(length));
+    builder.add_offset(1, nodes);
+    builder.add_offset(2, buffers);
+    return builder.end_table();
+  }
+
+  detail::flatbuffer_builder::offset add_type(
+      detail::flatbuffer_builder& builder, column_type type) {
+    builder.start_table();
+    switch (type) {
+      case column_type::integer:
+        builder.add_scalar(0, std::int32_t{64});
+        builder.add_scalar(1, std::uint8_t{1});
+        break;
+      case column_type::real:
+        builder.add_scalar(0, detail::PRECISION_DOUBLE);
+        break;
+      case column_type::date:
+        builder.add_scalar(0, detail::DATE_UNIT_DAY);
+        break;
+      default:
+        break;
+    }
+    return builder.end_table();
+  }
+
+  static std::uint8_t type_tag(const column& column) {
+    switch (column.type) {
+      case column_type::integer:
+        return detail::TYPE_INT;
+      case column_type::real:
+        return detail::TYPE_FLOATING_POINT;
+      case column_type::date:
+        return detail::TYPE_DATE;
+      default:
+        return column.binary ? detail::TYPE_BINARY : detail::TYPE_UTF8;
+    }
+  }
+
+  detail::flatbuffer_builder::offset add_schema(
+      detail::flatbuffer_builder& builder) {
+    std::vector<detail::flatbuffer_builder::offset> fields;
+    for (std::size_t i{0}; i < columns_.size(); ++i) {
+      const auto& column{columns_[i]};
+      const auto name{builder.create_string(column.name)};
+      const auto type{add_type(builder, column.type)};
+      const auto children{builder.create_offset_vector({})};
+      detail::flatbuffer_builder::offset encoding{0};
+      if (column.dictionary) {
+        builder.start_table();
+        builder.add_scalar(0, std::int32_t{32});
+        builder.add_scalar(1, std::uint8_t{1});
+        const auto index_type{builder.end_table()};
+        builder.start_table();
+        builder.add_scalar(0, static_cast<std::int64_t>(i));
+        builder.add_offset(1, index_type);
+        encoding = builder.end_table();
+      }
+
+      builder.start_table();
+      builder.add_offset(0, name);
+      builder.add_scalar(1, std::uint8_t{1});
+      builder.add_scalar(2, type_tag(column));
+      builder.add_offset(3, type);
+      if (column.dictionary) builder.add_offset(4, encoding);
+      builder.add_offset(5, children);
+      fields.push_back(builder.end_table());
+    }
+    const auto field_vector{builder.create_offset_vector(fields)};
+
+    builder.start_table();
+    builder.add_scalar(0, std::int16_t{0});
+    builder.add_offset(1, field_vector);
+    return builder.end_table();
+  }
+
+  // Writes a message whose header is the table header of type header_type,
+  // followed by body, and returns where it is in the file.
+  detail::arrow_block write_message(detail::flatbuffer_builder& builder,
+                                    std::uint8_t header_type,
+                                    detail::flatbuffer_builder::offset header,
+                                    std::string_view body) {
+    builder.start_table();
+    builder.add_scalar(0, detail::METADATA_V5);
+    builder.add_scalar(1, header_type);
+    builder.add_offset(2, header);
+    builder.add_scalar(3, static_cast<std::int64_t>(body.size()));
+    auto metadata{builder.finish(builder.end_table())};
+    metadata.append((8 - (metadata.size() + 8) % 8) % 8, '\0');
+
+    const detail::arrow_block block{
+        static_cast<std::int64_t>(position_),
+        static_cast<std::int32_t>(8 + metadata.size()), 0,
+        static_cast<std::int64_t>(body.size())};
+    write_u32(0xFFFFFFFF);
+    write_u32(static_cast<std::uint32_t>(metadata.size()));
+    write(metadata);
+    write(body);
+    return block;
+  }
+
+  void write(std::string_view data) {
+    output_ << data;
+    position_ += data.size();
+  }
+
+  void write_u32(std::uint32_t value) {
+    char bytes[4];
+    std::memcpy(bytes, &value, sizeof bytes);
+    write(std::string_view{bytes, sizeof bytes});
+  }
+
+  output_file& output_;
+  std::vector<column> columns_;
+  std::size_t rows_{0};
+  std::size_t text_bytes_{0};
+  bool started_{false};
+  std::string storage_;
+  std::uint64_t position_{0};
+  std::vector<detail::arrow_block> dictionary_blocks_;
+  std::vector<detail::arrow_block> record_batch_blocks_;
+  std::uint64_t mismatched_values_{0};
+  std::string invalid_text_;
+};
+}  // namespace tool
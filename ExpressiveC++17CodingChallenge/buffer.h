@@ -0,0 +1,51 @@
+#pragma once
+
+// Page aligned byte buffers, as needed by unbuffered (O_DIRECT) file I/O,
+// from the page_allocator.
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <utility>
+
+#include "pages.h"
+
+namespace tool {
+constexpr std::size_t BUFFER_ALIGNMENT{BASE_PAGE_SIZE};
+
+class aligned_buffer {
+ public:
+  aligned_buffer() = default;
+  explicit aligned_buffer(std::size_t capacity)
+      : data_{static_cast<char*>(
+                  page_allocator::instance().allocate(capacity)),
+              page_deleter{capacity}},
+        capacity_{capacity} {}
+
+  aligned_buffer(aligned_buffer&& other) noexcept
+      : data_{std::move(other.data_)},
+        capacity_{std::exchange(other.capacity_, 0)},
+        size_{std::exchange(other.size_, 0)} {}
+  aligned_buffer& operator=(aligned_buffer&& other) noexcept {
+    data_ = std::move(other.data_);
+    capacity_ = std::exchange(other.capacity_, 0);
+    size_ = std::exchange(other.size_, 0);
+    return *this;
+  }
+
+  char* data() noexcept { return data_.get(); }
+  const char* data() const noexcept { return data_.get(); }
+  std::size_t capacity() const noexcept { return capacity_; }
+
+  std::size_t size() const noexcept { return size_; }
+  void resize(std::size_t size) noexcept { size_ = size; }
+  std::size_t available() const noexcept { return capacity_ - size_; }
+
+  std::string_view view() const noexcept { return {data_.get(), size_}; }
+
+ private:
+  std::unique_ptr<char[], page_deleter> data_{nullptr, page_deleter{0}};
+  std::size_t capacity_{0};
+  std::size_t size_{0};
+};
+}  // namespace tool
@@ -0,0 +1,165 @@
+#pragma once
+
+// Structure check.
+// Counts the fields of every row the way the rewrite splits them, and reports
+// the rows whose count differs from the header's, without materializing
+// tokens or writing anything. Records with no quote in them, and all records
+// of a dialect without quoting, are scanned eight bytes at a time for
+// delimiters and newlines; only the records with a quote go through the
+// field walk of the tokenizer.
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <string_view>
+
+#include "header.h"
+#include "scanner.h"
+#include "swar.h"
+#include "tokenizer.h"
+
+namespace tool {
+template <typename Dialect>
+class structure_check {
+ public:
+  structure_check(const csv_header& header, std::ostream& report)
+      : header_{header}, report_{report} {}
+
+  // Checks a run of whole records; lines are numbered on from the previous
+  // run.
+  void check(std::string_view records) {
+    for (std::size_t start{0}; start < records.size();) {
+      start = check_unquoted(records, start);
+      if (start == records.size()) break;
+      auto rest{records.substr(start)};
+      walk_record(rest);
+      start = records.size() - rest.size();
+    }
+  }
+
+  std::uint64_t rows() const { return rows_; }
+  std::uint64_t malformed_rows() const { return malformed_rows_; }
+
+ private:
+  // Records of data from start on with no quoted field: every '\n' ends
+  // one, every delimiter separates two fields. Stops at the start of the
+  // first record with a quote in it, or of the last record when it has no
+  // terminator, and returns it.
+  std::size_t check_unquoted(std::string_view data, std::size_t start) {
+    const auto delimiters{swar::broadcast(Dialect::delimiter)};
+    const auto newlines{swar::broadcast('\n')};
+    [[maybe_unused]] const auto quotes{swar::broadcast(Dialect::quote)};
+    std::size_t count{0};
+
+    auto pos{start};
+    for (; pos + swar::WORD_SIZE <= data.size(); pos += swar::WORD_SIZE) {
+      const auto w{swar::load(data.data() + pos)};
+      auto delimiter_mask{swar::match(w, delimiters)};
+      auto newline_mask{swar::match(w, newlines)};
+      swar::word quote_mask{0};
+      if constexpr (Dialect::quoting) {
+        quote_mask = swar::match(w, quotes);
+        if (quote_mask != 0) {
+          newline_mask = swar::before(newline_mask, quote_mask);
+        }
+      }
+      while (newline_mask != 0) {
+        const auto end{pos + swar::first(newline_mask)};
+        const auto counted{swar::before(delimiter_mask, newline_mask)};
+        count += swar::count(counted);
+        delimiter_mask ^= counted;
+        row(data.substr(start, end - start), count);
+        start = end + 1;
+        count = 0;
+        newline_mask = swar::drop_first(newline_mask);
+      }
+      if (quote_mask != 0) return start;
+      count += swar::count(delimiter_mask);
+    }
+    for (; pos < data.size(); ++pos) {
+      if (Dialect::quoting && data[pos] == Dialect::quote) {
+        return start;
+      } else if (data[pos] == Dialect::delimiter) {
+        ++count;
+      } else if (data[pos] == '\n') {
+        row(data.substr(start, pos - start), count);
+        start = pos + 1;
+        count = 0;
+      }
+    }
+    return start;
+  }
+
+  // The first record of records, removed from them. Its fields are counted
+  // on the walk find_record_end() takes to find its end, as count_fields()
+  // counts those of its line.
+  void walk_record(std::string_view& records) {
+    std::size_t separators{0};
+    // Just past the last delimiter that separated two fields.
+    std::size_t last_separator{0};
+    std::uint64_t newlines{0};
+    std::size_t pos{0};
+    while (true) {
+      if constexpr (Dialect::quoting) {
+        if (pos < records.size() && records[pos] == Dialect::quote) {
+          const auto closed{std::min(find_closing_quote<Dialect>(records, pos),
+                                     records.size())};
+          newlines += static_cast<std::uint64_t>(std::count(
+              records.begin() + pos, records.begin() + closed, '\n'));
+          pos = closed;
+        }
+      }
+      while (pos < records.size() && records[pos] != Dialect::delimiter &&
+             records[pos] != '\n') {
+        ++pos;
+      }
+      if (pos == records.size() || records[pos] == '\n') break;
+      ++separators;
+      last_separator = ++pos;
+    }
+
+    auto line{records.substr(0, pos)};
+    // As next_record() does, a last record with no terminator keeps its
+    // '\r'.
+    if (pos < records.size() && !line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    records.remove_prefix(std::min(pos + 1, records.size()));
+    if (strip_trailing_delimiter<Dialect>(header_, line) &&
+        last_separator == line.size() + 1) {
+      --separators;
+    }
+    report(line_, line.empty() ? 0 : separators + 1);
+    line_ += newlines;
+  }
+
+  // A record of an unquoted run: line may still end with the '\r' of a CRLF,
+  // and has delimiters separators, or terminators per the header.
+  void row(std::string_view line, std::size_t delimiters) {
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    if (strip_trailing_delimiter<Dialect>(header_, line)) {
+      --delimiters;
+    }
+    report(line_, line.empty() ? 0 : delimiters + 1);
+  }
+
+  void report(std::uint64_t line, std::size_t fields) {
+    ++rows_;
+    ++line_;
+    if (fields != header_.number_of_columns()) {
+      ++malformed_rows_;
+      report_ << "line " << line << ": " << fields << " fields instead of "
+              << header_.number_of_columns() << '\n';
+    }
+  }
+
+  const csv_header& header_;
+  std::ostream& report_;
+  // The header is line 1.
+  std::uint64_t line_{2};
+  std::uint64_t rows_{0};
+  std::uint64_t malformed_rows_{0};
+};
+}  // namespace tool
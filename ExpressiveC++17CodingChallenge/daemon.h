@@ -0,0 +1,464 @@
+#pragma once
+
+// Daemon mode.
+// For callers that rewrite many small files, the process start, the option
+// parsing and the loading of the input can cost more than the rewrite
+// itself. --serve SOCKET instead listens on a Unix domain socket and runs
+// rewrite jobs sent to it, one per line, on a pool of threads that lives as
+// long as the server does. Inputs stay loaded as csv_tables between jobs,
+// up to the memory budget, and are reloaded when their size or modification
+// time changes.
+//
+// One thread waits on every connection at once and queues the jobs they
+// send for the pool, so that any number of clients may stay connected,
+// idle or not. The jobs of a connection run one at a time, in the order
+// sent, and are answered in that order. A job writes its output with as
+// many threads as the pool has for each job running.
+//
+// A job line holds tab-separated fields: the input file, the output file,
+// then one or more pairs of a column name and its new value; "\t", "\n" and
+// "\\" stand for a tab, a newline and a backslash. Each job gets a line
+// back, "ok" followed by the rows written and the time taken in
+// microseconds, or "error", an error code and a message. "shutdown" stops
+// the server. Every job uses the dialect the server was started with.
+//
+// The socket is created for the user running the server only (mode 0600),
+// since any client may have the server read and write files on its behalf.
+// A client sending more than DAEMON_MAX_LINE bytes without a line break is
+// disconnected.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif
+
+#include "options.h"
+#include "output.h"
+#include "table.h"
+#include "tokenizer.h"
+#include "workers.h"
+
+namespace tool {
+constexpr int DAEMON_BACKLOG{64};
+constexpr std::size_t DAEMON_READ_SIZE{64 * 1024};
+// The longest job line a connection may send.
+constexpr std::size_t DAEMON_MAX_LINE{64 * 1024};
+
+struct daemon_job {
+  std::string input_filename;
+  std::string output_filename;
+  // Column names and their new values, applied in order.
+  std::vector<std::pair<std::string, std::string>> overwrites;
+};
+
+// Splits line on tabs, decoding escapes, into job. False when fields are
+// missing.
+inline bool parse_job(std::string_view line, daemon_job& job) {
+  std::vector<std::string> fields(1);
+  for (std::size_t i{0}; i < line.size(); ++i) {
+    const auto c{line[i]};
+    if (c == '\t') {
+      fields.emplace_back();
+    } else if (c == '\\' && i + 1 < line.size()) {
+      const auto escaped{line[++i]};
+      fields.back() += escaped == 't' ? '\t' : escaped == 'n' ? '\n' : escaped;
+    } else {
+      fields.back() += c;
+    }
+  }
+  if (fields.size() < 4 || fields.size() % 2 != 0) return false;
+
+  job.input_filename = std::move(fields[0]);
+  job.output_filename = std::move(fields[1]);
+  job.overwrites.clear();
+  for (std::size_t i{2}; i < fields.size(); i += 2) {
+    job.overwrites.emplace_back(std::move(fields[i]), std::move(fields[i + 1]));
+  }
+  return true;
+}
+
+#ifdef __linux__
+// Loaded inputs, the least recently used dropped first once they take more
+// than the budget. Jobs hold on to the tables they use, and lock them while
+// they swap their columns.
+template <typename Dialect>
+class table_cache {
+ public:
+  struct entry {
+    std::mutex mutex;
+    csv_table<Dialect> table;
+    struct ::stat status;
+    std::uint64_t last_use{0};
+  };
+
+  table_cache(std::size_t budget, io_backend io) : budget_{budget}, io_{io} {}
+
+  // Returns 0 and the table of filename in result, loaded now unless it was
+  // cached and has not changed since, as cached tells, or an error code and
+  // its message.
+  int get(const std::string& filename, std::shared_ptr<entry>& result,
+          bool& cached, std::string& message) {
+    struct ::stat status;
+    if (::stat(filename.c_str(), &status) != 0) {
+      message = "input file missing";
+      return error_codes::NO_CSV_INPUT_FILE;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      const auto found{entries_.find(filename)};
+      if (found != entries_.end() && unchanged(found->second->status, status)) {
+        found->second->last_use = ++uses_;
+        result = found->second;
+        cached = true;
+        return 0;
+      }
+    }
+
+    // Loaded without the lock, so that jobs on other files go on meanwhile.
+    auto loaded{std::make_shared<entry>()};
+    if (const auto error{loaded->table.load(filename, io_)}) {
+      message = "input file not read";
+      return error;
+    }
+    loaded->status = status;
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    loaded->last_use = ++uses_;
+    entries_[filename] = loaded;
+    evict();
+    result = std::move(loaded);
+    cached = false;
+    return 0;
+  }
+
+ private:
+  static bool unchanged(const struct ::stat& a, const struct ::stat& b) {
+    return a.st_ino == b.st_ino && a.st_size == b.st_size &&
+           a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+           a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+  }
+
+  // Keeps at least the most recent table, however large.
+  void evict() {
+    while (entries_.size() > 1) {
+      std::size_t bytes{0};
+      auto oldest{entries_.begin()};
+      for (auto it{entries_.begin()}; it != entries_.end(); ++it) {
+        bytes += it->second->table.bytes();
+        if (it->second->last_use < oldest->second->last_use) oldest = it;
+      }
+      if (bytes <= budget_) return;
+      entries_.erase(oldest);
+    }
+  }
+
+  std::size_t budget_;
+  io_backend io_;
+  std::mutex mutex_;
+  std::map<std::string, std::shared_ptr<entry>> entries_;
+  std::uint64_t uses_{0};
+};
+
+// Runs job, writing its output on workers threads, and returns the line
+// that answers it.
+template <typename Dialect>
+std::string run_job(const daemon_job& job, table_cache<Dialect>& cache,
+                    const options& options, std::size_t workers) {
+  using clock = std::chrono::steady_clock;
+  const auto microseconds{[](clock::duration duration) {
+    return std::to_string(
+        std::chrono::duration_cast<std::chrono::microseconds>(duration)
+            .count());
+  }};
+  const auto error{[](int code, std::string_view message) {
+    return "error " + std::to_string(code) + ' ' + std::string{message} + '\n';
+  }};
+
+  const auto start{clock::now()};
+  std::shared_ptr<typename table_cache<Dialect>::entry> entry;
+  auto cached{false};
+  std::string message;
+  if (const auto code{cache.get(job.input_filename, entry, cached, message)}) {
+    return error(code, message);
+  }
+  const auto loaded{clock::now()};
+
+  std::lock_guard<std::mutex> lock{entry->mutex};
+  auto& table{entry->table};
+  // The columns swapped out, swapped back in reverse order so that a column
+  // overwritten twice ends up as it was.
+  std::vector<std::pair<std::size_t, table_column>> swapped;
+  const auto restore{[&] {
+    for (auto it{swapped.rbegin()}; it != swapped.rend(); ++it) {
+      table.swap_column(it->first, it->second);
+    }
+  }};
+  for (const auto& [column_name, value] : job.overwrites) {
+    const auto position{table.header().find(column_name)};
+    if (!position) {
+      restore();
+      return error(error_codes::NO_COLUMN_NAME,
+                   "column name doesn't exists in the input file");
+    }
+    swapped.emplace_back(*position,
+                         table_column::constant(quote_field<Dialect>(value)));
+    table.swap_column(*position, swapped.back().second);
+  }
+
+  {
+    output_file output(job.output_filename, options.output_mode, options.io);
+    if (!output.is_open()) {
+      restore();
+      return error(error_codes::NO_CSV_OUTPUT_FILE, "output file not created");
+    }
+    table.write(output, workers);
+    if (!output.close()) {
+      restore();
+      return error(error_codes::NO_CSV_OUTPUT_FILE,
+                   std::string{"output file not written: "} +
+                       std::strerror(output.error()));
+    }
+  }
+  restore();
+  const auto written{clock::now()};
+
+  return "ok rows=" + std::to_string(table.rows()) +
+         " cached=" + (cached ? "1" : "0") +
+         " load_us=" + microseconds(loaded - start) +
+         " write_us=" + microseconds(written - loaded) +
+         " total_us=" + microseconds(written - start) + '\n';
+}
+
+inline void send_all(int socket, std::string_view data) {
+  while (!data.empty()) {
+    const auto sent{::send(socket, data.data(), data.size(), MSG_NOSIGNAL)};
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return;
+    data.remove_prefix(static_cast<std::size_t>(sent));
+  }
+}
+
+// A client connection, closed with the last reference to it.
+struct daemon_connection {
+  explicit daemon_connection(int socket) : socket{socket} {}
+  daemon_connection(const daemon_connection&) = delete;
+  daemon_connection& operator=(const daemon_connection&) = delete;
+  ~daemon_connection() { ::close(socket); }
+
+  int socket;
+  // Received after the last line break.
+  std::string partial;
+  // The lines received and not answered yet, and whether the connection is
+  // queued for a worker or has one running its job. Guarded by the mutex
+  // of the server.
+  std::deque<std::string> lines;
+  bool scheduled{false};
+};
+
+template <typename Dialect>
+class job_server {
+ public:
+  explicit job_server(const options& options)
+      : options_{options},
+        cache_{options.memory_budget, options.io},
+        workers_{worker_count(options.threads)} {}
+
+  // Serves the clients of listener until one of them asks for a shutdown.
+  // False when the server could not run.
+  bool run(int listener) {
+    if (::pipe2(wake_, O_CLOEXEC) != 0) return false;
+    std::vector<std::thread> threads;
+    for (std::size_t i{0}; i < workers_; ++i) {
+      threads.emplace_back([this] { work(); });
+    }
+
+    std::vector<std::shared_ptr<daemon_connection>> connections;
+    std::vector<::pollfd> polled;
+    std::vector<char> buffer(DAEMON_READ_SIZE);
+    while (!stopping_) {
+      polled.assign({{listener, POLLIN, 0}, {wake_[0], POLLIN, 0}});
+      for (const auto& connection : connections) {
+        polled.push_back({connection->socket, POLLIN, 0});
+      }
+      if (::poll(polled.data(), polled.size(), -1) < 0) {
+        if (errno == EINTR) continue;
+        break;
+      }
+
+      for (auto i{connections.size()}; i-- > 0;) {
+        if (polled[2 + i].revents != 0 &&
+            !receive(connections[i], buffer.data())) {
+          // The connection stays open until its jobs are answered.
+          connections.erase(connections.begin() +
+                            static_cast<std::ptrdiff_t>(i));
+        }
+      }
+      if (polled[0].revents & POLLIN) {
+        const auto socket{
+            ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC)};
+        if (socket >= 0) {
+          connections.push_back(std::make_shared<daemon_connection>(socket));
+        }
+      }
+    }
+
+    {
+      const std::lock_guard<std::mutex> lock{mutex_};
+      stopping_ = true;
+    }
+    work_.notify_all();
+    for (auto& thread : threads) thread.join();
+    ready_.clear();
+    ::close(wake_[0]);
+    ::close(wake_[1]);
+    return true;
+  }
+
+ private:
+  // Reads what connection sent, and queues its lines for the workers.
+  // False once the client is gone, or has sent a line too long.
+  bool receive(const std::shared_ptr<daemon_connection>& connection,
+               char* buffer) {
+    const auto received{::read(connection->socket, buffer, DAEMON_READ_SIZE)};
+    if (received < 0 && errno == EINTR) return true;
+    if (received <= 0) return false;
+    auto& partial{connection->partial};
+    partial.append(buffer, static_cast<std::size_t>(received));
+
+    const std::lock_guard<std::mutex> lock{mutex_};
+    std::size_t begin{0};
+    for (auto end{partial.find('\n')}; end != std::string::npos;
+         begin = end + 1, end = partial.find('\n', begin)) {
+      auto line{std::string_view{partial}.substr(begin, end - begin)};
+      if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+      connection->lines.emplace_back(line);
+    }
+    partial.erase(0, begin);
+    if (!connection->lines.empty() && !connection->scheduled) {
+      connection->scheduled = true;
+      ready_.push_back(connection);
+      work_.notify_one();
+    }
+    return partial.size() <= DAEMON_MAX_LINE;
+  }
+
+  // Answers the oldest line of the connections queued, one after another,
+  // until the server stops.
+  void work() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    while (true) {
+      work_.wait(lock, [this] { return stopping_ || !ready_.empty(); });
+      if (stopping_) return;
+      auto connection{std::move(ready_.front())};
+      ready_.pop_front();
+      const auto line{std::move(connection->lines.front())};
+      connection->lines.pop_front();
+      // The workers are shared among the jobs running.
+      const auto writers{std::max<std::size_t>(1, workers_ / ++running_)};
+      lock.unlock();
+
+      const auto shutdown{line == "shutdown"};
+      daemon_job job;
+      send_all(connection->socket,
+               shutdown ? "ok\n"
+               : parse_job(line, job)
+                   ? run_job(job, cache_, options_, writers)
+                   : "error " + std::to_string(error_codes::INVALID_OPTION) +
+                         " malformed job\n");
+
+      lock.lock();
+      --running_;
+      if (shutdown) {
+        stopping_ = true;
+        work_.notify_all();
+        // Wakes the thread waiting on the connections.
+        static_cast<void>(::write(wake_[1], "", 1));
+        return;
+      }
+      if (connection->lines.empty()) {
+        connection->scheduled = false;
+      } else {
+        ready_.push_back(std::move(connection));
+        work_.notify_one();
+      }
+    }
+  }
+
+  const options& options_;
+  table_cache<Dialect> cache_;
+  std::size_t workers_;
+  int wake_[2]{-1, -1};
+  std::mutex mutex_;
+  std::condition_variable work_;
+  // Connections with lines to answer and no worker on them, in turn.
+  std::deque<std::shared_ptr<daemon_connection>> ready_;
+  std::size_t running_{0};
+  std::atomic<bool> stopping_{false};
+};
+
+template <typename Dialect>
+int serve(const options& options) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (options.socket_path.size() >= sizeof address.sun_path) {
+    std::cerr << "socket path too long\n";
+    return error_codes::INVALID_OPTION;
+  }
+  options.socket_path.copy(address.sun_path, options.socket_path.size());
+
+  const auto listener{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+  ::unlink(options.socket_path.c_str());
+  // The socket file gets the permissions the umask leaves: 0600.
+  const auto umask{::umask(S_IXUSR | S_IRWXG | S_IRWXO)};
+  const auto bound{
+      listener >= 0 &&
+      ::bind(listener, reinterpret_cast<const sockaddr*>(&address),
+             sizeof address) == 0};
+  ::umask(umask);
+  if (!bound || ::listen(listener, DAEMON_BACKLOG) != 0) {
+    std::cerr << "cannot listen on " << options.socket_path << '\n';
+    if (listener >= 0) ::close(listener);
+    return error_codes::INVALID_OPTION;
+  }
+
+  job_server<Dialect> server{options};
+  const auto served{server.run(listener)};
+  ::close(listener);
+  ::unlink(options.socket_path.c_str());
+  if (!served) {
+    std::cerr << "cannot serve on " << options.socket_path << '\n';
+    return error_codes::INVALID_OPTION;
+  }
+  return 0;
+}
+#else
+template <typename Dialect>
+int serve(const options&) {
+  std::cerr << "--serve needs Unix domain sockets\n";
+  return error_codes::INVALID_OPTION;
+}
+#endif
+}  // namespace tool
@@ -0,0 +1,87 @@
+#pragma once
+
+// CSV dialects.
+// The delimiter, quote character, escape rule and line ending are template
+// parameters, so the tokenizer and the writer compile down to one kernel per
+// dialect with no runtime delimiter check in the inner loop. The common
+// dialects are instantiated up front and dispatch_dialect() picks one of them
+// once, at startup, from the command line flags.
+
+#include <string_view>
+
+namespace tool {
+enum class escape_rule {
+  none,           // no quoting at all, the quote character is plain data
+  doubled_quote,  // RFC 4180: "a ""quoted"" word"
+  backslash       // "a \"quoted\" word"
+};
+
+template <char Delimiter, char Quote, escape_rule Escape, bool Crlf>
+struct dialect {
+  static constexpr char delimiter{Delimiter};
+  static constexpr char quote{Quote};
+  static constexpr escape_rule escape{Escape};
+  static constexpr bool quoting{Escape != escape_rule::none};
+  static constexpr bool crlf{Crlf};
+  static constexpr std::string_view line_ending{Crlf ? "\r\n" : "\n"};
+};
+
+using comma_dialect = dialect<',', '"', escape_rule::doubled_quote, false>;
+using semicolon_dialect = dialect<';', '"', escape_rule::doubled_quote, false>;
+using tab_dialect = dialect<'\t', '"', escape_rule::doubled_quote, false>;
+using pipe_dialect = dialect<'|', '"', escape_rule::doubled_quote, false>;
+
+// The runtime description of a dialect, as given on the command line.
+struct dialect_config {
+  char delimiter{','};
+  escape_rule escape{escape_rule::doubled_quote};
+  bool crlf{false};
+};
+
+constexpr bool is_supported_delimiter(char delimiter) {
+  return delimiter == ',' || delimiter == ';' || delimiter == '\t' ||
+         delimiter == '|';
+}
+
+namespace detail {
+template <char Delimiter, char Quote, escape_rule Escape, typename F>
+auto dispatch_line_ending(const dialect_config& config, F& f) {
+  if (config.crlf) {
+    return f(dialect<Delimiter, Quote, Escape, true>{});
+  }
+  return f(dialect<Delimiter, Quote, Escape, false>{});
+}
+
+template <char Delimiter, typename F>
+auto dispatch_escape(const dialect_config& config, F& f) {
+  switch (config.escape) {
+    case escape_rule::none:
+      return dispatch_line_ending<Delimiter, '"', escape_rule::none>(config, f);
+    case escape_rule::backslash:
+      return dispatch_line_ending<Delimiter, '"', escape_rule::backslash>(
+          config, f);
+    case escape_rule::doubled_quote:
+    default:
+      return dispatch_line_ending<Delimiter, '"', escape_rule::doubled_quote>(
+          config, f);
+  }
+}
+}  // namespace detail
+
+// Calls f with a default constructed dialect matching config. The delimiter
+// must satisfy is_supported_delimiter().
+template <typename F>
+auto dispatch_dialect(const dialect_config& config, F&& f) {
+  switch (config.delimiter) {
+    case ';':
+      return detail::dispatch_escape<';'>(config, f);
+    case '\t':
+      return detail::dispatch_escape<'\t'>(config, f);
+    case '|':
+      return detail::dispatch_escape<'|'>(config, f);
+    case ',':
+    default:
+      return detail::dispatch_escape<','>(config, f);
+  }
+}
+}  // namespace tool
@@ -0,0 +1,182 @@
+#pragma once
+
+// Following an input that grows.
+// With --follow, the rewrite does not stop at the end of the input: it
+// waits for rows to be appended, and rewrites each of them once. The reader
+// remembers the offset it has read up to, and reads on from there when the
+// file changes, which inotify reports on Linux; elsewhere the file is
+// polled. Only whole records are handed out: a last line without its
+// terminator, or a quoted field still open, is held back until the rest of
+// it arrives. The header is read once, from the first block.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "buffer.h"
+#include "io.h"
+#include "scanner.h"
+
+namespace tool {
+// How often the input is polled where the system cannot report changes.
+constexpr std::chrono::milliseconds FOLLOW_POLL_INTERVAL{1000};
+
+template <typename Dialect>
+class follow_reader {
+ public:
+  follow_reader(const std::string& filename, file_handle& file)
+      : filename_{filename}, file_{file}, pending_{INPUT_BLOCK_SIZE} {
+#ifdef __linux__
+    struct ::stat status;
+    if (::stat(filename.c_str(), &status) == 0) inode_ = status.st_ino;
+    watch_ = ::inotify_init1(IN_CLOEXEC);
+    if (watch_ >= 0 &&
+        ::inotify_add_watch(watch_, filename.c_str(),
+                            IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF |
+                                IN_MOVE_SELF) < 0) {
+      ::close(watch_);
+      watch_ = -1;
+    }
+#endif
+  }
+
+  follow_reader(const follow_reader&) = delete;
+  follow_reader& operator=(const follow_reader&) = delete;
+
+  ~follow_reader() {
+#ifdef __linux__
+    if (watch_ >= 0) ::close(watch_);
+#endif
+  }
+
+  std::string_view bom() const { return bom_; }
+
+  // Moves the next run of whole records into block. When there is none,
+  // calls idle() and waits for the input to grow. False once the input is
+  // removed, renamed or truncated.
+  template <typename Idle>
+  bool next_block(input_block& block, Idle&& idle) {
+    while (true) {
+      if (pending_.available() == 0) grow();
+      const auto n{file_.read_at(pending_.data() + pending_.size(),
+                                 pending_.available(), read_offset_)};
+      read_offset_ += n;
+      pending_.resize(pending_.size() + n);
+      if (at_start_) find_bom();
+
+      const auto data{pending_.view().substr(skip_)};
+      const auto boundary{at_start_ ? 0 : last_record_boundary<Dialect>(data)};
+      if (boundary > 0) {
+        hand_out(block, boundary);
+        return true;
+      }
+      if (n > 0) continue;
+
+      if (file_.size() < read_offset_) return false;
+      idle();
+      if (!wait()) return false;
+    }
+  }
+
+  // Gives back the buffer of a block returned by next_block().
+  void recycle(aligned_buffer buffer) {
+    if (buffer.capacity() == INPUT_BLOCK_SIZE) {
+      free_.push_back(std::move(buffer));
+    }
+  }
+
+ private:
+  // Waits for as many bytes as a byte order mark has, unless those read so
+  // far already differ from one.
+  void find_bom() {
+    const auto head{pending_.view()};
+    if (head.size() < UTF8_BOM.size() &&
+        UTF8_BOM.substr(0, head.size()) == head) {
+      return;
+    }
+    at_start_ = false;
+    if (head.substr(0, UTF8_BOM.size()) == UTF8_BOM) {
+      bom_ = UTF8_BOM;
+      skip_ = UTF8_BOM.size();
+    }
+  }
+
+  // Hands out the first boundary bytes of data, and keeps the rest for the
+  // next block.
+  void hand_out(input_block& block, std::size_t boundary) {
+    aligned_buffer rest{take_buffer()};
+    const auto tail{pending_.view().substr(skip_ + boundary)};
+    if (rest.capacity() < tail.size()) rest = aligned_buffer{tail.size()};
+    std::copy(tail.begin(), tail.end(), rest.data());
+    rest.resize(tail.size());
+
+    block.records = pending_.view().substr(skip_, boundary);
+    block.buffer = std::move(pending_);
+    pending_ = std::move(rest);
+    skip_ = 0;
+  }
+
+  aligned_buffer take_buffer() {
+    if (free_.empty()) return aligned_buffer{INPUT_BLOCK_SIZE};
+    auto buffer{std::move(free_.back())};
+    free_.pop_back();
+    buffer.resize(0);
+    return buffer;
+  }
+
+  // For a record longer than a block.
+  void grow() {
+    aligned_buffer grown{pending_.capacity() * 2};
+    std::copy(pending_.view().begin(), pending_.view().end(), grown.data());
+    grown.resize(pending_.size());
+    pending_ = std::move(grown);
+  }
+
+  // Waits for the input to change; false once it is gone.
+  bool wait() {
+#ifdef __linux__
+    if (watch_ >= 0) {
+      alignas(inotify_event) char events[4096];
+      const auto n{::read(watch_, events, sizeof events)};
+      if (n <= 0) return false;
+      for (std::size_t i{0}; i < static_cast<std::size_t>(n);) {
+        const auto* event{reinterpret_cast<const inotify_event*>(events + i)};
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+          return false;
+        }
+        i += sizeof(inotify_event) + event->len;
+      }
+      // Removing the file only changes its link count while it is open.
+      struct ::stat status;
+      return ::stat(filename_.c_str(), &status) == 0 &&
+             status.st_ino == inode_;
+    }
+#endif
+    std::this_thread::sleep_for(FOLLOW_POLL_INTERVAL);
+    return true;
+  }
+
+  std::string filename_;
+  file_handle& file_;
+  aligned_buffer pending_;
+  std::vector<aligned_buffer> free_;
+  std::uint64_t read_offset_{0};
+  std::size_t skip_{0};
+  bool at_start_{true};
+  std::string_view bom_;
+#ifdef __linux__
+  int watch_{-1};
+  ino_t inode_{0};
+#endif
+};
+}  // namespace tool
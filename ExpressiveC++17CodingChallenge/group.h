@@ -0,0 +1,410 @@
+#pragma once
+
+// Group-by aggregation.
+// Rows are grouped by the value of a column, and each group is summarized by
+// aggregates: its number of rows, and the sum, average, minimum or maximum of
+// the numbers of a column. Values that are not numbers are left out of the
+// numeric aggregates.
+//
+// Each worker aggregates the blocks it is given into a table of its own, and
+// the tables are merged at the end. A table that grows past its share of the
+// memory budget is spilled to disk, split by the hash of the group key into
+// partitions; the partitions are then merged one at a time, so that only the
+// groups of one partition are in memory at once.
+//
+// The tables share half the memory budget. The partitions of every worker
+// are written through small blocks of their own, written synchronously
+// rather than by a ring or a thread per file, which share the other half. A
+// partition that cannot be written whole, or read back whole, fails the
+// aggregation: finish() tells of it.
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.h"
+#include "hash.h"
+#include "io.h"
+#include "output.h"
+#include "schema.h"
+#include "sort.h"
+
+namespace tool {
+constexpr std::size_t GROUP_TABLE_MIN_CAPACITY{1024};
+constexpr std::size_t GROUP_PARTITIONS{16};
+// The largest block a partition file is written through.
+constexpr std::size_t GROUP_PARTITION_BLOCK_SIZE{64 * 1024};
+
+enum class aggregate_function { count, sum, avg, min, max };
+
+struct aggregate {
+  aggregate_function function;
+  // Empty for count.
+  std::string column;
+};
+
+// Parses a comma separated list of count, sum(COLUMN), avg(COLUMN),
+// min(COLUMN) and max(COLUMN).
+inline bool parse_aggregates(std::string_view list,
+                             std::vector<aggregate>& result) {
+  result.clear();
+  while (!list.empty()) {
+    // A comma inside parentheses belongs to the column name.
+    const auto open{list.find('(')};
+    auto end{list.find(',')};
+    if (open < end) {
+      const auto close{list.find(')', open)};
+      if (close == std::string_view::npos) return false;
+      end = list.find(',', close);
+    }
+    const auto item{list.substr(0, end)};
+    list = end == std::string_view::npos ? std::string_view{}
+                                         : list.substr(end + 1);
+
+    if (item == "count") {
+      result.push_back({aggregate_function::count, {}});
+      continue;
+    }
+    const auto parenthesis{item.find('(')};
+    if (parenthesis == std::string_view::npos || item.back() != ')' ||
+        parenthesis + 2 >= item.size()) {
+      return false;
+    }
+    const auto name{item.substr(0, parenthesis)};
+    const std::string column{
+        item.substr(parenthesis + 1, item.size() - parenthesis - 2)};
+    if (name == "sum") {
+      result.push_back({aggregate_function::sum, column});
+    } else if (name == "avg") {
+      result.push_back({aggregate_function::avg, column});
+    } else if (name == "min") {
+      result.push_back({aggregate_function::min, column});
+    } else if (name == "max") {
+      result.push_back({aggregate_function::max, column});
+    } else {
+      return false;
+    }
+  }
+  return !result.empty();
+}
+
+inline std::string aggregate_name(const aggregate& aggregate) {
+  switch (aggregate.function) {
+    case aggregate_function::sum:
+      return "sum(" + aggregate.column + ")";
+    case aggregate_function::avg:
+      return "avg(" + aggregate.column + ")";
+    case aggregate_function::min:
+      return "min(" + aggregate.column + ")";
+    case aggregate_function::max:
+      return "max(" + aggregate.column + ")";
+    default:
+      return "count";
+  }
+}
+
+// The numbers of a column in a group.
+struct accumulator {
+  std::uint64_t count{0};
+  double sum{0};
+  double min{std::numeric_limits<double>::infinity()};
+  double max{-std::numeric_limits<double>::infinity()};
+
+  void add(std::string_view value) {
+    double number;
+    if (!parse_value(value, number)) return;
+    ++count;
+    sum += number;
+    min = std::min(min, number);
+    max = std::max(max, number);
+  }
+
+  void merge(const accumulator& other) {
+    count += other.count;
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+  }
+};
+
+// Appends the value of aggregate for a group of rows, whose numbers are in
+// numbers: nothing for a numeric aggregate over no number.
+inline void append_aggregate(std::string& line, aggregate_function function,
+                             std::uint64_t rows, const accumulator& numbers) {
+  if (function != aggregate_function::count && numbers.count == 0) return;
+
+  char text[32];
+  std::to_chars_result result;
+  switch (function) {
+    case aggregate_function::count:
+      result = std::to_chars(std::begin(text), std::end(text), rows);
+      break;
+    case aggregate_function::sum:
+      result = std::to_chars(std::begin(text), std::end(text), numbers.sum);
+      break;
+    case aggregate_function::avg:
+      result = std::to_chars(std::begin(text), std::end(text),
+                             numbers.sum / static_cast<double>(numbers.count));
+      break;
+    case aggregate_function::min:
+      result = std::to_chars(std::begin(text), std::end(text), numbers.min);
+      break;
+    default:
+      result = std::to_chars(std::begin(text), std::end(text), numbers.max);
+      break;
+  }
+  line.append(text, result.ptr);
+}
+
+// Groups by key, in open addressing with linear probing; the keys are copied
+// into an arena. Each group has an accumulator per measured column.
+class group_table {
+ public:
+  struct group {
+    std::string_view key;
+    std::uint64_t hash;
+    std::uint64_t rows;
+  };
+
+  explicit group_table(std::size_t columns) : columns_{columns} {}
+
+  group_table(const group_table&) = delete;
+  group_table& operator=(const group_table&) = delete;
+
+  // The group with key, added if new.
+  std::size_t find_or_add(std::string_view key, std::uint64_t hash) {
+    if (2 * (groups_.size() + 1) > slots_.size()) {
+      grow();
+    }
+    const auto mask{slots_.size() - 1};
+    auto i{static_cast<std::size_t>(hash) & mask};
+    for (; slots_[i] != EMPTY; i = (i + 1) & mask) {
+      const auto& group{groups_[slots_[i]]};
+      if (group.hash == hash && group.key == key) return slots_[i];
+    }
+
+    auto* copy{static_cast<char*>(arena_.allocate(key.size(), 1))};
+    std::memcpy(copy, key.data(), key.size());
+    slots_[i] = groups_.size();
+    groups_.push_back({{copy, key.size()}, hash, 0});
+    accumulators_.resize(accumulators_.size() + columns_);
+    return slots_[i];
+  }
+
+  group& at(std::size_t index) { return groups_[index]; }
+  const group& at(std::size_t index) const { return groups_[index]; }
+  accumulator* numbers(std::size_t index) {
+    return accumulators_.data() + index * columns_;
+  }
+  const accumulator* numbers(std::size_t index) const {
+    return accumulators_.data() + index * columns_;
+  }
+
+  std::size_t size() const { return groups_.size(); }
+  std::size_t columns() const { return columns_; }
+
+  std::size_t bytes() const {
+    return arena_.bytes_in_use() + slots_.size() * sizeof(std::size_t) +
+           groups_.size() * (sizeof(group) + columns_ * sizeof(accumulator));
+  }
+
+  void clear() {
+    arena_.reset();
+    slots_.clear();
+    groups_.clear();
+    accumulators_.clear();
+  }
+
+ private:
+  static constexpr std::size_t EMPTY{static_cast<std::size_t>(-1)};
+
+  void grow() {
+    slots_.assign(std::max(GROUP_TABLE_MIN_CAPACITY, 2 * slots_.size()),
+                  EMPTY);
+    const auto mask{slots_.size() - 1};
+    for (std::size_t index{0}; index < groups_.size(); ++index) {
+      auto i{static_cast<std::size_t>(groups_[index].hash) & mask};
+      while (slots_[i] != EMPTY) i = (i + 1) & mask;
+      slots_[i] = index;
+    }
+  }
+
+  std::size_t columns_;
+  arena_resource arena_;
+  std::vector<std::size_t> slots_;
+  std::vector<group> groups_;
+  std::vector<accumulator> accumulators_;
+};
+
+class group_aggregation {
+ public:
+  group_aggregation(std::size_t columns, std::size_t workers,
+                    std::size_t memory_budget,
+                    const std::string& temp_directory)
+      : columns_{columns},
+        // One share for the table the others are merged into.
+        share_{memory_budget / 2 / (workers + 1)},
+        block_size_{std::clamp<std::size_t>(
+            memory_budget / 2 / (workers * GROUP_PARTITIONS) /
+                BUFFER_ALIGNMENT * BUFFER_ALIGNMENT,
+            BUFFER_ALIGNMENT, GROUP_PARTITION_BLOCK_SIZE)},
+        temp_directory_{temp_directory},
+        spills_(workers) {
+    for (std::size_t worker{0}; worker < workers; ++worker) {
+      tables_.push_back(std::make_unique<group_table>(columns));
+    }
+  }
+
+  // The table of worker, used by no other thread.
+  group_table& table(std::size_t worker) { return *tables_[worker]; }
+
+  // Spills the table of worker if it has grown past its share of the
+  // memory budget.
+  void check_memory(std::size_t worker) {
+    if (tables_[worker]->bytes() > share_) {
+      spill(worker);
+    }
+  }
+
+  // Calls sink(key, rows, numbers) for every group, numbers pointing to its
+  // accumulator for each measured column. Returns false, with error()
+  // telling why, when a partition could not be written or read back whole.
+  template <typename Sink>
+  bool finish(Sink&& sink) {
+    const auto spilled{std::any_of(spills_.begin(), spills_.end(),
+                                   [](const auto& s) { return !s.empty(); })};
+    if (!spilled) {
+      auto& merged{*tables_[0]};
+      for (std::size_t worker{1}; worker < tables_.size(); ++worker) {
+        merge(merged, *tables_[worker]);
+        tables_[worker]->clear();
+      }
+      emit(merged, sink);
+      return true;
+    }
+
+    for (std::size_t worker{0}; worker < tables_.size(); ++worker) {
+      spill(worker);
+      for (auto& partition : spills_[worker]) {
+        if (!partition.file->close()) fail(partition.file->error());
+        partition.file.reset();
+      }
+    }
+    if (error_ != 0) return false;
+    auto& merged{*tables_[0]};
+    for (std::size_t p{0}; p < GROUP_PARTITIONS; ++p) {
+      merged.clear();
+      for (auto& partitions : spills_) {
+        if (partitions.empty()) continue;
+        run_reader reader{partitions[p].name, key_type::lexicographic,
+                          RUN_BUFFER_SIZE};
+        for (; !reader.done(); reader.next()) {
+          read_partial(merged, reader.key().text, reader.record());
+        }
+        fail(reader.error());
+        files_->remove(partitions[p].name);
+      }
+      if (error_ != 0) return false;
+      emit(merged, sink);
+    }
+    return true;
+  }
+
+  // The errno of the first partition that could not be written or read back
+  // whole, 0 if none.
+  int error() const { return error_; }
+
+ private:
+  static constexpr std::size_t RUN_BUFFER_SIZE{1 << 20};
+
+  struct partition {
+    std::string name;
+    std::unique_ptr<output_file> file;
+  };
+
+  void merge(group_table& into, const group_table& from) const {
+    for (std::size_t i{0}; i < from.size(); ++i) {
+      const auto& group{from.at(i)};
+      const auto index{into.find_or_add(group.key, group.hash)};
+      into.at(index).rows += group.rows;
+      for (std::size_t c{0}; c < columns_; ++c) {
+        into.numbers(index)[c].merge(from.numbers(i)[c]);
+      }
+    }
+  }
+
+  template <typename Sink>
+  void emit(const group_table& table, Sink& sink) const {
+    for (std::size_t i{0}; i < table.size(); ++i) {
+      sink(table.at(i).key, table.at(i).rows, table.numbers(i));
+    }
+  }
+
+  // Writes the groups of a table to the partitions of worker as partial
+  // aggregates: the key, then the rows and the accumulators, as in memory.
+  void spill(std::size_t worker) {
+    auto& partitions{spills_[worker]};
+    if (partitions.empty()) {
+      std::lock_guard<std::mutex> lock{files_mutex_};
+      if (!files_) files_.emplace(temp_directory_, "group");
+      for (std::size_t p{0}; p < GROUP_PARTITIONS; ++p) {
+        auto name{files_->create()};
+        auto file{std::make_unique<output_file>(
+            name, write_mode::buffered, io_backend::synchronous, block_size_)};
+        partitions.push_back({std::move(name), std::move(file)});
+      }
+    }
+
+    auto& table{*tables_[worker]};
+    std::string record;
+    for (std::size_t i{0}; i < table.size(); ++i) {
+      const auto& group{table.at(i)};
+      record.assign(reinterpret_cast<const char*>(&group.rows),
+                    sizeof group.rows);
+      record.append(reinterpret_cast<const char*>(table.numbers(i)),
+                    columns_ * sizeof(accumulator));
+      write_run_record(*partitions[(group.hash >> 32) % GROUP_PARTITIONS].file,
+                       group.key, record);
+    }
+    table.clear();
+  }
+
+  // Keeps the first error.
+  void fail(int error) {
+    if (error_ == 0) error_ = error;
+  }
+
+  void read_partial(group_table& into, std::string_view key,
+                    std::string_view record) const {
+    const auto index{into.find_or_add(key, hash_bytes(key))};
+    std::uint64_t rows;
+    std::memcpy(&rows, record.data(), sizeof rows);
+    into.at(index).rows += rows;
+    for (std::size_t c{0}; c < columns_; ++c) {
+      accumulator numbers;
+      std::memcpy(&numbers, record.data() + sizeof rows + c * sizeof numbers,
+                  sizeof numbers);
+      into.numbers(index)[c].merge(numbers);
+    }
+  }
+
+  std::size_t columns_;
+  std::size_t share_;
+  std::size_t block_size_;
+  std::string temp_directory_;
+  std::vector<std::unique_ptr<group_table>> tables_;
+  // The partitions each worker spilled to, none until it first spills.
+  std::vector<std::vector<partition>> spills_;
+  std::mutex files_mutex_;
+  std::optional<temp_files> files_;
+  int error_{0};
+};
+}  // namespace tool
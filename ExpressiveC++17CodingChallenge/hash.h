@@ -0,0 +1,40 @@
+#pragma once
+
+// Fast, unkeyed 64 bit hashing of field values, for sketches and hash tables.
+// Not suitable where an adversary picks the input: flooding a table with
+// colliding keys only takes knowing the function.
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "swar.h"
+
+namespace tool {
+// The splitmix64 finalizer: every input bit affects every output bit.
+constexpr std::uint64_t mix_bits(std::uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EB;
+  x ^= x >> 31;
+  return x;
+}
+
+// Eight bytes per step; the length is folded in so that values differing
+// only by trailing zero bytes do not collide.
+inline std::uint64_t hash_bytes(std::string_view data) {
+  std::uint64_t h{0x9E3779B97F4A7C15 ^ data.size()};
+  auto p{data.data()};
+  auto n{data.size()};
+  for (; n >= swar::WORD_SIZE; p += swar::WORD_SIZE, n -= swar::WORD_SIZE) {
+    h = mix_bits(h ^ swar::load(p));
+  }
+  if (n > 0) {
+    swar::word tail{0};
+    std::memcpy(&tail, p, n);
+    h = mix_bits(h ^ tail);
+  }
+  return mix_bits(h);
+}
+}  // namespace tool
@@ -0,0 +1,75 @@
+#pragma once
+
+// The header line of a CSV file and the lookup of columns by name.
+
+#include <algorithm>
+#include <iterator>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "scanner.h"
+#include "tokenizer.h"
+
+namespace tool {
+struct csv_header {
+  // As in the input, without its terminator.
+  std::string line;
+  // Unquoted.
+  std::vector<std::string> column_names;
+  // A delimiter ending the header line terminates every line rather than
+  // starting an empty last column.
+  bool trailing_delimiter{false};
+  // Lines keep the terminator they had in the input; an unterminated last
+  // line gets the one of the header.
+  std::string_view line_ending;
+
+  std::size_t number_of_columns() const { return column_names.size(); }
+
+  std::optional<std::size_t> find(std::string_view column_name) const {
+    const auto found_column{std::find(std::begin(column_names),
+                                      std::end(column_names), column_name)};
+    if (found_column == std::end(column_names)) {
+      return std::nullopt;
+    }
+    return static_cast<std::size_t>(
+        std::distance(std::begin(column_names), found_column));
+  }
+};
+
+template <typename Dialect>
+csv_header parse_header(const record& header) {
+  csv_header result;
+  result.line = header.line;
+  result.trailing_delimiter =
+      !header.line.empty() && header.line.back() == Dialect::delimiter;
+  // Not a view of the input, which does not outlive its block.
+  result.line_ending = header.ending == "\r\n" ? std::string_view{"\r\n"}
+                       : header.ending == "\n"  ? std::string_view{"\n"}
+                                                 : Dialect::line_ending;
+
+  for (const auto& token : split_line_into_tokens<Dialect>(
+           result.trailing_delimiter
+               ? header.line.substr(0, header.line.size() - 1)
+               : header.line,
+           std::pmr::get_default_resource())) {
+    result.column_names.push_back(unquote_field<Dialect>(token));
+  }
+  return result;
+}
+
+// Removes the delimiter terminating line, if the header says lines have one,
+// and tells whether it did.
+template <typename Dialect>
+bool strip_trailing_delimiter(const csv_header& header,
+                              std::string_view& line) {
+  if (header.trailing_delimiter && !line.empty() &&
+      line.back() == Dialect::delimiter) {
+    line.remove_suffix(1);
+    return true;
+  }
+  return false;
+}
+}  // namespace tool
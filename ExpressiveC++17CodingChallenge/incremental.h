@@ -0,0 +1,318 @@
+#pragma once
+
+// Incremental rewrite.
+// Rewriting a large input again after a few of its rows changed redoes the
+// whole file. With --incremental the input is cut into chunks where a
+// rolling hash of its bytes, over a window of 64 of them, has its top bits
+// clear, moved on to the end of the record; since the cuts depend on the
+// bytes around them only, a change moves the cuts of its own chunk and
+// leaves the others as they were. The fingerprint of every chunk, and where
+// its rows went in the output, are kept in OUTPUT.chunks. The next run with
+// the same arguments and header copies the chunks it finds there from the
+// previous output, with copy_file_range() on Linux so that file systems
+// able to share the blocks do, and rewrites only the others.
+//
+// The previous output is read while the new one is written, so the new one
+// goes to OUTPUT.partial and replaces it once complete. The chunk list is
+// removed meanwhile: a run that stops half way leaves none behind, and the
+// next one starts over. Rows skipped for their number of fields are only
+// reported when their chunk is rewritten.
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "header.h"
+#include "io.h"
+#include "options.h"
+#include "output.h"
+#include "pseudonym.h"
+#include "scanner.h"
+
+namespace tool {
+// Chunks are at least CHUNK_MIN_SIZE bytes, then cut with a probability of
+// one in 2^CHUNK_BITS at every byte, which makes them about 320 KiB on
+// average, and cut at CHUNK_MAX_SIZE at the latest; a record is never cut.
+constexpr std::size_t CHUNK_MIN_SIZE{64 * 1024};
+constexpr std::size_t CHUNK_MAX_SIZE{4 << 20};
+constexpr int CHUNK_BITS{18};
+constexpr std::uint64_t CHUNK_LIST_MAGIC{0x314b4e4843565343};  // CSVCHNK1
+
+namespace detail {
+// Random values for the bytes, from SplitMix64.
+constexpr std::array<std::uint64_t, 256> make_gear_table() {
+  std::array<std::uint64_t, 256> table{};
+  std::uint64_t state{0};
+  for (auto& value : table) {
+    state += 0x9e3779b97f4a7c15;
+    auto z{state};
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    value = z ^ (z >> 31);
+  }
+  return table;
+}
+
+constexpr auto GEAR_TABLE{make_gear_table()};
+// Every byte shifts the hash left by one, so the top bits depend on the
+// most bytes.
+constexpr std::uint64_t CHUNK_MASK{~std::uint64_t{0} << (64 - CHUNK_BITS)};
+constexpr siphash_key CHUNK_KEY{0x6b6e756863747663, 0x746e697270726766};
+}  // namespace detail
+
+inline std::uint64_t chunk_fingerprint(std::string_view chunk) {
+  return siphash(detail::CHUNK_KEY, chunk);
+}
+
+// The fingerprint of what the output of a chunk depends on besides its rows.
+template <typename Dialect>
+std::uint64_t rewrite_fingerprint(const options& options,
+                                  const csv_header& header,
+                                  std::string_view bom) {
+  std::string arguments;
+  for (const std::string_view part :
+       {std::string_view{options.column_name},
+        std::string_view{options.replacement}, std::string_view{header.line},
+        header.line_ending, bom}) {
+    arguments += std::to_string(part.size());
+    arguments += ':';
+    arguments += part;
+  }
+  arguments += Dialect::delimiter;
+  arguments += Dialect::quote;
+  arguments += static_cast<char>(Dialect::escape);
+  arguments += static_cast<char>(options.format);
+  arguments += options.drop_others ? 'd' : 'c';
+  for (const auto& part : options.where_values) {
+    arguments += options.where_column + '=' + std::to_string(part.size()) +
+                 ':' + part;
+  }
+  if (options.pseudonym_key) {
+    for (const auto word : *options.pseudonym_key) {
+      arguments += std::to_string(word) + ':';
+    }
+  }
+  return chunk_fingerprint(arguments);
+}
+
+// Cuts runs of whole records into chunks.
+template <typename Dialect>
+class record_chunker {
+ public:
+  // Calls emit with every chunk records completes. The rest of records is
+  // kept for the next call.
+  template <typename Emit>
+  void add(std::string_view records, Emit&& emit) {
+    std::size_t begin{0};
+    std::size_t i{0};
+    // The first record boundary not before i, as far as found.
+    std::size_t boundary{0};
+    while (i < records.size()) {
+      const auto size{pending_.size() + i - begin};
+      if (size < CHUNK_MIN_SIZE) {
+        i += std::min(CHUNK_MIN_SIZE - size, records.size() - i);
+        continue;
+      }
+      hash_ = (hash_ << 1) +
+              detail::GEAR_TABLE[static_cast<unsigned char>(records[i])];
+      ++i;
+      if ((hash_ & detail::CHUNK_MASK) != 0 && size + 1 < CHUNK_MAX_SIZE) {
+        continue;
+      }
+
+      while (boundary < i) {
+        const auto end{find_record_end<Dialect>(records, boundary)};
+        boundary = end == std::string_view::npos ? records.size() : end + 1;
+      }
+      emit_chunk(records.substr(begin, boundary - begin), emit);
+      begin = boundary;
+      i = boundary;
+      hash_ = 0;
+    }
+    pending_.append(records.substr(begin));
+  }
+
+  // Calls emit with the last chunk, if any.
+  template <typename Emit>
+  void finish(Emit&& emit) {
+    if (!pending_.empty()) emit_chunk({}, emit);
+  }
+
+ private:
+  template <typename Emit>
+  void emit_chunk(std::string_view records, Emit&& emit) {
+    if (pending_.empty()) {
+      emit(records);
+      return;
+    }
+    pending_.append(records);
+    emit(std::string_view{pending_});
+    pending_.clear();
+  }
+
+  // The start of the current chunk, from earlier calls.
+  std::string pending_;
+  std::uint64_t hash_{0};
+};
+
+struct chunk_entry {
+  std::uint64_t fingerprint;
+  std::uint64_t input_size;
+  std::uint64_t output_offset;
+  std::uint64_t output_size;
+};
+
+// The chunk list is [magic][arguments][output size][chunks] followed by the
+// chunks, all native 64 bit integers: the list only serves on the machine
+// that wrote it.
+class chunk_list {
+ public:
+  // Reads the list of filename, if it was written with these arguments for
+  // an output of output_size bytes.
+  bool load(const std::string& filename, std::uint64_t arguments,
+            std::uint64_t output_size) {
+    auto file{file_handle::open_read(filename)};
+    if (!file.is_open()) return false;
+    std::uint64_t head[4];
+    if (file.read_at(reinterpret_cast<char*>(head), sizeof head, 0) !=
+            sizeof head ||
+        head[0] != CHUNK_LIST_MAGIC || head[1] != arguments ||
+        head[2] != output_size ||
+        head[3] > (file.size() - sizeof head) / sizeof(chunk_entry)) {
+      return false;
+    }
+
+    std::vector<chunk_entry> chunks(head[3]);
+    const auto bytes{chunks.size() * sizeof(chunk_entry)};
+    if (file.read_at(reinterpret_cast<char*>(chunks.data()), bytes,
+                     sizeof head) != bytes) {
+      return false;
+    }
+    for (const auto& chunk : chunks) add(chunk);
+    return true;
+  }
+
+  void add(const chunk_entry& chunk) {
+    index_.emplace(chunk.fingerprint, chunks_.size());
+    chunks_.push_back(chunk);
+  }
+
+  const chunk_entry* find(std::uint64_t fingerprint,
+                          std::uint64_t input_size) const {
+    const auto found{index_.find(fingerprint)};
+    if (found == index_.end()) return nullptr;
+    const auto& chunk{chunks_[found->second]};
+    return chunk.input_size == input_size ? &chunk : nullptr;
+  }
+
+  // Writes the list to filename. A list not written whole is removed, and
+  // errno tells why.
+  bool save(const std::string& filename, std::uint64_t arguments,
+            std::uint64_t output_size) const {
+    output_file file{filename, write_mode::buffered};
+    if (!file.is_open()) return false;
+    const std::uint64_t head[4]{CHUNK_LIST_MAGIC, arguments, output_size,
+                                chunks_.size()};
+    file.write({reinterpret_cast<const char*>(head), sizeof head});
+    file.write({reinterpret_cast<const char*>(chunks_.data()),
+                chunks_.size() * sizeof(chunk_entry)});
+    if (file.close()) return true;
+    const auto error{file.error()};
+    file.discard();
+    errno = error;
+    return false;
+  }
+
+ private:
+  std::vector<chunk_entry> chunks_;
+  std::unordered_map<std::uint64_t, std::size_t> index_;
+};
+
+template <typename Dialect>
+class incremental_rewrite {
+ public:
+  // Looks for the output and chunk list of a previous run of the rewrite
+  // with these arguments.
+  incremental_rewrite(const std::string& output_filename,
+                      std::uint64_t arguments)
+      : output_filename_{output_filename},
+        list_filename_{output_filename + ".chunks"},
+        arguments_{arguments},
+        previous_output_{file_handle::open_read(output_filename)} {
+    if (previous_output_.is_open() &&
+        previous_.load(list_filename_, arguments_, previous_output_.size())) {
+      std::remove(list_filename_.c_str());
+    } else {
+      previous_output_.close();
+    }
+  }
+
+  std::string partial_filename() const {
+    return output_filename_ + ".partial";
+  }
+
+  // Cuts records, whole ones, into chunks, copies to output the rows of the
+  // chunks the previous run had, and calls rewrite(records) with the others.
+  template <typename Rewrite>
+  void add(std::string_view records, output_file& output, Rewrite&& rewrite) {
+    chunker_.add(records, [&](std::string_view chunk) {
+      add_chunk(chunk, output, rewrite);
+    });
+  }
+
+  template <typename Rewrite>
+  void finish(output_file& output, Rewrite&& rewrite) {
+    chunker_.finish([&](std::string_view chunk) {
+      add_chunk(chunk, output, rewrite);
+    });
+  }
+
+  // Replaces the output with the closed partial one, and keeps its chunks
+  // for the next run. On failure errno tells why.
+  bool commit(std::uint64_t output_size) {
+    previous_output_.close();
+    return std::rename(partial_filename().c_str(),
+                       output_filename_.c_str()) == 0 &&
+           current_.save(list_filename_, arguments_, output_size);
+  }
+
+  std::uint64_t chunks() const { return chunks_; }
+  std::uint64_t reused_chunks() const { return reused_chunks_; }
+
+ private:
+  template <typename Rewrite>
+  void add_chunk(std::string_view chunk, output_file& output,
+                 Rewrite& rewrite) {
+    const auto fingerprint{chunk_fingerprint(chunk)};
+    const auto offset{output.bytes_written()};
+    const auto* reused{previous_output_.is_open()
+                           ? previous_.find(fingerprint, chunk.size())
+                           : nullptr};
+    if (reused) {
+      output.copy_from(previous_output_, reused->output_offset,
+                       reused->output_size);
+      ++reused_chunks_;
+    } else {
+      rewrite(chunk);
+    }
+    ++chunks_;
+    current_.add({fingerprint, chunk.size(), offset,
+                  output.bytes_written() - offset});
+  }
+
+  std::string output_filename_;
+  std::string list_filename_;
+  std::uint64_t arguments_;
+  file_handle previous_output_;
+  chunk_list previous_;
+  chunk_list current_;
+  record_chunker<Dialect> chunker_;
+  std::uint64_t chunks_{0};
+  std::uint64_t reused_chunks_{0};
+};
+}  // namespace tool
@@ -0,0 +1,515 @@
+#pragma once
+
+// Asynchronous file I/O.
+// An io_queue keeps several reads or writes in flight on one file while the
+// caller parses or rewrites, and hands buffers back in submission order.
+// Buffers are moved in and out of the queue, never copied. The queue is
+// built on io_uring when the kernel has it (Linux 5.6 or later), and on a
+// worker thread doing plain positioned reads and writes otherwise. The
+// synchronous queue does them at once, on the calling thread, for files
+// opened by the dozen and written a little at a time, for which neither a
+// ring nor a thread each is worth it.
+//
+// A transfer that fails is not retried past its error, which the request
+// carries back: it is up to the owner of the queue to give up on the file.
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#endif
+
+#include "buffer.h"
+
+namespace tool {
+constexpr std::size_t IO_QUEUE_DEPTH{4};
+
+enum class io_backend { uring, threads, synchronous };
+
+// An open file, read and written at explicit offsets.
+class file_handle {
+ public:
+  file_handle() = default;
+  file_handle(const file_handle&) = delete;
+  file_handle& operator=(const file_handle&) = delete;
+  file_handle(file_handle&& other) noexcept { swap(other); }
+  file_handle& operator=(file_handle&& other) noexcept {
+    swap(other);
+    return *this;
+  }
+  ~file_handle() { close(); }
+
+  static file_handle open_read(const std::string& filename) {
+    file_handle file;
+#ifdef __linux__
+    file.fd_ = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+#else
+    file.file_ = std::fopen(filename.c_str(), "rb");
+#endif
+    return file;
+  }
+
+  // With direct set, the file is opened with O_DIRECT when the file system
+  // allows it, in which case direct is left set.
+  static file_handle open_write(const std::string& filename, bool& direct) {
+    file_handle file;
+#ifdef __linux__
+    constexpr auto flags{O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC};
+    if (direct) {
+      file.fd_ = ::open(filename.c_str(), flags | O_DIRECT, 0666);
+    }
+    if (file.fd_ < 0) {
+      direct = false;
+      file.fd_ = ::open(filename.c_str(), flags, 0666);
+    }
+#else
+    direct = false;
+    file.file_ = std::fopen(filename.c_str(), "wb");
+#endif
+    return file;
+  }
+
+  bool is_open() const {
+#ifdef __linux__
+    return fd_ >= 0;
+#else
+    return file_ != nullptr;
+#endif
+  }
+
+  std::uint64_t size() const {
+#ifdef __linux__
+    struct stat status {};
+    return ::fstat(fd_, &status) == 0 ? static_cast<std::uint64_t>(
+                                            status.st_size)
+                                      : 0;
+#else
+    const auto position{std::ftell(file_)};
+    std::fseek(file_, 0, SEEK_END);
+    const auto size{std::ftell(file_)};
+    std::fseek(file_, position, SEEK_SET);
+    return static_cast<std::uint64_t>(size);
+#endif
+  }
+
+  // Reads until length bytes are read or the end of the file is reached,
+  // and returns the number of bytes read. When fewer than length, errno
+  // tells why, and is 0 at the end of the file.
+  std::size_t read_at(char* data, std::size_t length, std::uint64_t offset) {
+    std::size_t done{0};
+    errno = 0;
+#ifdef __linux__
+    while (done < length) {
+      const auto n{::pread(fd_, data + done, length - done,
+                           static_cast<off_t>(offset + done))};
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) break;
+      if (n == 0) {
+        errno = 0;
+        break;
+      }
+      done += static_cast<std::size_t>(n);
+    }
+#else
+    std::fseek(file_, static_cast<long>(offset), SEEK_SET);
+    done = std::fread(data, 1, length, file_);
+    if (done < length) errno = std::ferror(file_) ? EIO : 0;
+#endif
+    return done;
+  }
+
+  // Writes until length bytes are written or a write fails, and returns the
+  // number of bytes written. When fewer than length, errno tells why.
+  std::size_t write_at(const char* data, std::size_t length,
+                       std::uint64_t offset) {
+    std::size_t done{0};
+#ifdef __linux__
+    while (done < length) {
+      const auto n{::pwrite(fd_, data + done, length - done,
+                            static_cast<off_t>(offset + done))};
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) break;
+      if (n == 0) {
+        errno = EIO;
+        break;
+      }
+      done += static_cast<std::size_t>(n);
+    }
+#else
+    std::fseek(file_, static_cast<long>(offset), SEEK_SET);
+    done = std::fwrite(data, 1, length, file_);
+    if (done < length) errno = EIO;
+#endif
+    return done;
+  }
+
+  // False when closing reported an error, such as a failed write back,
+  // which errno then tells.
+  bool close() {
+    auto closed{true};
+#ifdef __linux__
+    if (fd_ >= 0) closed = ::close(fd_) == 0;
+    fd_ = -1;
+#else
+    if (file_) closed = std::fclose(file_) == 0;
+    file_ = nullptr;
+#endif
+    return closed;
+  }
+
+#ifdef __linux__
+  int fd() const { return fd_; }
+#endif
+
+ private:
+  void swap(file_handle& other) noexcept {
+#ifdef __linux__
+    std::swap(fd_, other.fd_);
+#else
+    std::swap(file_, other.file_);
+#endif
+  }
+
+#ifdef __linux__
+  int fd_{-1};
+#else
+  std::FILE* file_{nullptr};
+#endif
+};
+
+// A read or a write, and after completion its outcome: for a read, the
+// buffer size is the number of bytes read.
+struct io_request {
+  aligned_buffer buffer;
+  std::uint64_t offset{0};
+  bool write{false};
+  std::size_t length{0};
+  // The errno of a transfer that failed, 0 if it did not. A read short of
+  // length at the end of the file did not fail.
+  int error{0};
+};
+
+// Does request, recording its outcome in it.
+inline void transfer(file_handle& file, io_request& request) {
+  if (request.write) {
+    if (file.write_at(request.buffer.data(), request.length, request.offset) <
+        request.length) {
+      request.error = errno;
+    }
+  } else {
+    const auto done{
+        file.read_at(request.buffer.data(), request.length, request.offset)};
+    if (done < request.length) request.error = errno;
+    request.buffer.resize(done);
+  }
+}
+
+class io_queue {
+ public:
+  virtual ~io_queue() = default;
+
+  // Reads length bytes at offset into buffer, which must be large enough.
+  void read(aligned_buffer buffer, std::uint64_t offset, std::size_t length) {
+    submit({std::move(buffer), offset, false, length});
+  }
+
+  // Writes all of buffer at offset.
+  void write(aligned_buffer buffer, std::uint64_t offset) {
+    const auto length{buffer.size()};
+    submit({std::move(buffer), offset, true, length});
+  }
+
+  // Blocks until the oldest request completes and returns it.
+  virtual io_request wait() = 0;
+
+  std::size_t in_flight() const { return in_flight_; }
+
+ protected:
+  virtual void submit(io_request request) = 0;
+
+  std::size_t in_flight_{0};
+};
+
+// Positioned reads and writes on a worker thread, one request at a time.
+class thread_queue : public io_queue {
+ public:
+  explicit thread_queue(file_handle& file)
+      : file_{file}, worker_{[this] { work(); }} {}
+
+  ~thread_queue() override {
+    {
+      const std::lock_guard<std::mutex> lock{mutex_};
+      stopping_ = true;
+    }
+    changed_.notify_all();
+    worker_.join();
+  }
+
+  io_request wait() override {
+    std::unique_lock<std::mutex> lock{mutex_};
+    changed_.wait(lock, [this] { return !done_.empty(); });
+    auto request{std::move(done_.front())};
+    done_.pop_front();
+    --in_flight_;
+    return request;
+  }
+
+ protected:
+  void submit(io_request request) override {
+    {
+      const std::lock_guard<std::mutex> lock{mutex_};
+      pending_.push_back(std::move(request));
+    }
+    ++in_flight_;
+    changed_.notify_all();
+  }
+
+ private:
+  void work() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    while (true) {
+      changed_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+      if (pending_.empty()) return;
+
+      auto request{std::move(pending_.front())};
+      pending_.pop_front();
+      lock.unlock();
+      transfer(file_, request);
+      lock.lock();
+      done_.push_back(std::move(request));
+      changed_.notify_all();
+    }
+  }
+
+  file_handle& file_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::deque<io_request> pending_;
+  std::deque<io_request> done_;
+  bool stopping_{false};
+  std::thread worker_;
+};
+
+// Reads and writes done as they are submitted.
+class synchronous_queue : public io_queue {
+ public:
+  explicit synchronous_queue(file_handle& file) : file_{file} {}
+
+  io_request wait() override {
+    auto request{std::move(done_.front())};
+    done_.pop_front();
+    --in_flight_;
+    return request;
+  }
+
+ protected:
+  void submit(io_request request) override {
+    transfer(file_, request);
+    done_.push_back(std::move(request));
+    ++in_flight_;
+  }
+
+ private:
+  file_handle& file_;
+  std::deque<io_request> done_;
+};
+
+#ifdef __linux__
+// io_uring through the raw system calls, no liburing. Requests complete in
+// any order; they are handed back in submission order.
+class uring_queue : public io_queue {
+ public:
+  uring_queue(file_handle& file, std::size_t depth) : file_{file} {
+    io_uring_params params{};
+    ring_fd_ = static_cast<int>(
+        ::syscall(__NR_io_uring_setup, static_cast<unsigned>(depth), &params));
+    // IORING_OP_READ and IORING_OP_WRITE came with this feature.
+    if (ring_fd_ < 0 || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+      return;
+    }
+
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sq_ = map(sq_size_, IORING_OFF_SQ_RING);
+    cq_ = map(cq_size_, IORING_OFF_CQ_RING);
+    sqes_ = static_cast<io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+    if (!sq_ || !cq_ || !sqes_) return;
+
+    sq_head_ = at<unsigned>(sq_, params.sq_off.head);
+    sq_tail_ = at<unsigned>(sq_, params.sq_off.tail);
+    sq_mask_ = *at<unsigned>(sq_, params.sq_off.ring_mask);
+    sq_array_ = at<unsigned>(sq_, params.sq_off.array);
+    cq_head_ = at<unsigned>(cq_, params.cq_off.head);
+    cq_tail_ = at<unsigned>(cq_, params.cq_off.tail);
+    cq_mask_ = *at<unsigned>(cq_, params.cq_off.ring_mask);
+    cqes_ = at<io_uring_cqe>(cq_, params.cq_off.cqes);
+    ready_ = true;
+  }
+
+  ~uring_queue() override {
+    while (in_flight_ > 0) wait();
+    if (sqes_) ::munmap(sqes_, sqes_size_);
+    if (cq_) ::munmap(cq_, cq_size_);
+    if (sq_) ::munmap(sq_, sq_size_);
+    if (ring_fd_ >= 0) ::close(ring_fd_);
+  }
+
+  // False when the kernel has no usable io_uring.
+  bool ready() const { return ready_; }
+
+  io_request wait() override {
+    while (!requests_.front().completed) reap();
+
+    auto request{std::move(requests_.front().request)};
+    const auto result{requests_.front().result};
+    requests_.pop_front();
+    ++first_id_;
+    --in_flight_;
+
+    // Short transfers only happen at the end of a file or on errors, and
+    // requests the kernel did not take are not done at all; finish them
+    // synchronously, which tells the error if there is one.
+    const auto done{static_cast<std::size_t>(std::max(result, 0))};
+    if (request.write) {
+      if (done < request.length &&
+          file_.write_at(request.buffer.data() + done, request.length - done,
+                         request.offset + done) < request.length - done) {
+        request.error = errno;
+      }
+    } else {
+      auto total{done};
+      if (done < request.length) {
+        total += file_.read_at(request.buffer.data() + done,
+                               request.length - done, request.offset + done);
+        if (total < request.length) request.error = errno;
+      }
+      request.buffer.resize(total);
+    }
+    return request;
+  }
+
+ protected:
+  void submit(io_request request) override {
+    const auto id{first_id_ + requests_.size()};
+    const auto tail{*sq_tail_};
+    const auto index{tail & sq_mask_};
+    auto& sqe{sqes_[index]};
+    std::memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe.fd = file_.fd();
+    sqe.addr = reinterpret_cast<std::uint64_t>(request.buffer.data());
+    sqe.len = static_cast<std::uint32_t>(request.length);
+    sqe.off = request.offset;
+    sqe.user_data = id;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+    requests_.push_back({std::move(request)});
+    ++in_flight_;
+    while (enter(1, 0, 0) < 0 && errno == EINTR) {
+    }
+    // Unless the kernel took the entry, no completion will come for it: take
+    // it back, and leave the request to wait(), as a transfer of 0 bytes.
+    if (__atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == tail) {
+      __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+      requests_.back().completed = true;
+    }
+  }
+
+ private:
+  struct slot {
+    io_request request;
+    bool completed{false};
+    int result{0};
+  };
+
+  void* map(std::size_t size, off_t offset) {
+    auto* p{::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd_, offset)};
+    return p == MAP_FAILED ? nullptr : p;
+  }
+
+  long enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return ::syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete,
+                     flags, nullptr, 0);
+  }
+
+  template <typename T>
+  static T* at(void* base, std::uint32_t offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+  }
+
+  void reap() {
+    auto head{*cq_head_};
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      enter(0, 1, IORING_ENTER_GETEVENTS);
+    }
+    for (; head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE); ++head) {
+      const auto& cqe{cqes_[head & cq_mask_]};
+      auto& completed{requests_[cqe.user_data - first_id_]};
+      completed.completed = true;
+      completed.result = cqe.res;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+  file_handle& file_;
+  int ring_fd_{-1};
+  bool ready_{false};
+  std::size_t sq_size_{0};
+  std::size_t cq_size_{0};
+  std::size_t sqes_size_{0};
+  void* sq_{nullptr};
+  void* cq_{nullptr};
+  io_uring_sqe* sqes_{nullptr};
+  unsigned* sq_head_{nullptr};
+  unsigned* sq_tail_{nullptr};
+  unsigned sq_mask_{0};
+  unsigned* sq_array_{nullptr};
+  unsigned* cq_head_{nullptr};
+  unsigned* cq_tail_{nullptr};
+  unsigned cq_mask_{0};
+  io_uring_cqe* cqes_{nullptr};
+  std::deque<slot> requests_;
+  std::uint64_t first_id_{0};
+};
+#endif
+
+// The queue for backend, falling back to the worker thread when io_uring is
+// not available. At most depth requests may be in flight.
+inline std::unique_ptr<io_queue> make_io_queue(file_handle& file,
+                                               io_backend backend,
+                                               std::size_t depth) {
+  if (backend == io_backend::synchronous) {
+    return std::make_unique<synchronous_queue>(file);
+  }
+#ifdef __linux__
+  if (backend == io_backend::uring) {
+    auto queue{std::make_unique<uring_queue>(file, depth)};
+    if (queue->ready()) return queue;
+  }
+#else
+  static_cast<void>(backend);
+  static_cast<void>(depth);
+#endif
+  return std::make_unique<thread_queue>(file);
+}
+}  // namespace tool
@@ -0,0 +1,405 @@
+#pragma once
+
+// Hash join against a second CSV file.
+// Every row of the input gets the columns of the row of the joined file with
+// the same key: columns of the joined file that the input also has replace
+// the values of the input, the others are appended. Rows without a match are
+// kept, with the columns they would have replaced unchanged and the ones
+// they would have appended empty. When several rows of the joined file have
+// the same key, the first one is used.
+//
+// The joined file is expected to be the smaller one, and in the same
+// dialect as the input. It is loaded into a hash table, its keys and fields
+// copied into an arena. When it is larger than the memory budget, both files
+// are partitioned on disk by key instead (a Grace hash join): each partition
+// of the joined file is loaded in turn and the input rows of the same
+// partition are joined against it. The joined rows are numbered so that the
+// partitions can be merged back into the input order.
+//
+// All the partitions of both files are written at once, each through a
+// small block of its own, written synchronously rather than by a ring or a
+// thread per file. The blocks take at most half the memory budget, and are
+// freed before the partitions are loaded into the other half. A partition
+// that cannot be written whole, or read back whole, fails the join: finish()
+// tells of it.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.h"
+#include "hash.h"
+#include "header.h"
+#include "io.h"
+#include "options.h"
+#include "output.h"
+#include "scanner.h"
+#include "sort.h"
+#include "tokenizer.h"
+
+namespace tool {
+constexpr std::size_t JOIN_TABLE_MIN_CAPACITY{1024};
+// The largest block a partition file is written through.
+constexpr std::size_t JOIN_PARTITION_BLOCK_SIZE{64 * 1024};
+
+// Rows of the joined file by key, in open addressing with linear probing.
+// A slot holds the hash of the key, so that most mismatches cost no access to
+// the row, and a pointer to the row in the arena:
+// [key length][end of each field][key][fields], lengths as 32 bit integers,
+// fields ending relative to the end of the key.
+class join_table {
+ public:
+  explicit join_table(std::size_t fields) : fields_{fields} {}
+
+  join_table(const join_table&) = delete;
+  join_table& operator=(const join_table&) = delete;
+
+  // Adds a row unless one with the same key is already there. fields are
+  // the tokens at positions columns.
+  void add(std::string_view key, const tokens& tokens,
+           const std::vector<std::size_t>& columns) {
+    if (2 * (size_ + 1) > slots_.size()) {
+      grow();
+    }
+    const auto hash{hash_bytes(key)};
+    auto& slot{slots_[find_slot(hash, key)]};
+    if (slot.row != nullptr) return;
+
+    std::size_t bytes{key.size()};
+    for (const auto column : columns) bytes += tokens[column].size();
+    const auto header_size{(1 + fields_) * sizeof(std::uint32_t)};
+    auto* row{static_cast<char*>(
+        arena_.allocate(header_size + bytes, alignof(std::uint32_t)))};
+
+    std::uint32_t header[1]{static_cast<std::uint32_t>(key.size())};
+    std::memcpy(row, header, sizeof header);
+    std::memcpy(row + header_size, key.data(), key.size());
+    auto end{std::size_t{0}};
+    for (std::size_t i{0}; i < fields_; ++i) {
+      const auto field{tokens[columns[i]]};
+      std::memcpy(row + header_size + key.size() + end, field.data(),
+                  field.size());
+      end += field.size();
+      const auto end32{static_cast<std::uint32_t>(end)};
+      std::memcpy(row + (1 + i) * sizeof(std::uint32_t), &end32,
+                  sizeof end32);
+    }
+
+    slot = {hash, row};
+    ++size_;
+  }
+
+  // The row with key, or nullptr.
+  const char* find(std::string_view key) const {
+    if (slots_.empty()) return nullptr;
+    const auto hash{hash_bytes(key)};
+    return slots_[find_slot(hash, key)].row;
+  }
+
+  std::string_view field(const char* row, std::size_t i) const {
+    const auto header_size{(1 + fields_) * sizeof(std::uint32_t)};
+    const auto begin{i == 0 ? 0 : length(row, i)};
+    return {row + header_size + length(row, 0) + begin,
+            length(row, 1 + i) - begin};
+  }
+
+  std::size_t size() const { return size_; }
+
+  void clear() {
+    arena_.reset();
+    slots_.clear();
+    size_ = 0;
+  }
+
+ private:
+  struct slot {
+    std::uint64_t hash{0};
+    const char* row{nullptr};
+  };
+
+  static std::size_t length(const char* row, std::size_t i) {
+    std::uint32_t value;
+    std::memcpy(&value, row + i * sizeof value, sizeof value);
+    return value;
+  }
+
+  std::string_view key(const char* row) const {
+    return {row + (1 + fields_) * sizeof(std::uint32_t), length(row, 0)};
+  }
+
+  // The slot holding key, or the empty slot where it belongs.
+  std::size_t find_slot(std::uint64_t hash, std::string_view key) const {
+    const auto mask{slots_.size() - 1};
+    for (auto i{static_cast<std::size_t>(hash) & mask};; i = (i + 1) & mask) {
+      const auto& slot{slots_[i]};
+      if (slot.row == nullptr ||
+          (slot.hash == hash && this->key(slot.row) == key)) {
+        return i;
+      }
+    }
+  }
+
+  void grow() {
+    std::vector<slot> old(
+        std::max(JOIN_TABLE_MIN_CAPACITY, 2 * slots_.size()));
+    old.swap(slots_);
+    const auto mask{slots_.size() - 1};
+    for (const auto& slot : old) {
+      if (slot.row == nullptr) continue;
+      auto i{static_cast<std::size_t>(slot.hash) & mask};
+      while (slots_[i].row != nullptr) i = (i + 1) & mask;
+      slots_[i] = slot;
+    }
+  }
+
+  std::size_t fields_;
+  arena_resource arena_;
+  std::vector<slot> slots_;
+  std::size_t size_{0};
+};
+
+template <typename Dialect>
+class hash_join {
+ public:
+  // Loads or partitions the file to join with the input, which has header.
+  // Returns 0, or one of the error_codes after reporting the problem.
+  int open(const options& options, const csv_header& header) {
+    options_ = &options;
+    auto file{file_handle::open_read(options.join_filename)};
+    if (!file.is_open()) {
+      std::cerr << "join file missing\n";
+      return error_codes::NO_CSV_INPUT_FILE;
+    }
+    block_reader<Dialect> reader{file, options.io};
+    input_block block;
+    reader.next_block(block);
+    auto records{block.records};
+    joined_header_ = parse_header<Dialect>(
+        records.empty() ? record{} : next_record<Dialect>(records));
+
+    const auto input_key{header.find(options.join_column)};
+    const auto joined_key{joined_header_.find(options.join_column)};
+    if (!input_key || !joined_key) {
+      std::cerr << "column name doesn't exists in the input file\n";
+      return error_codes::NO_COLUMN_NAME;
+    }
+    input_key_ = *input_key;
+    joined_key_ = *joined_key;
+
+    auto appended{header.number_of_columns()};
+    for (std::size_t i{0}; i < joined_header_.number_of_columns(); ++i) {
+      if (i == joined_key_) continue;
+      columns_.push_back(i);
+      const auto& name{joined_header_.column_names[i]};
+      if (const auto target{header.find(name)}) {
+        targets_.push_back(*target);
+      } else {
+        targets_.push_back(appended++);
+        appended_names_.push_back(name);
+      }
+    }
+    width_ = appended;
+    table_.emplace(columns_.size());
+
+    if (file.size() > options.memory_budget) {
+      partition(file.size());
+    }
+
+    arena_resource arena;
+    std::string storage;
+    do {
+      while (!records.empty()) {
+        auto line{next_record<Dialect>(records).line};
+        strip_trailing_delimiter<Dialect>(joined_header_, line);
+        const auto tokens{split_line_into_tokens<Dialect>(line, &arena)};
+        if (tokens.size() != joined_header_.number_of_columns()) continue;
+
+        const auto key{field_value<Dialect>(tokens[joined_key_], storage)};
+        if (partitioned()) {
+          write_run_record(*build_[partition_of(key)], key, line);
+        } else {
+          table_->add(key, tokens, columns_);
+        }
+      }
+      arena.reset();
+      reader.recycle(std::move(block.buffer));
+      if (!reader.next_block(block)) break;
+      records = block.records;
+    } while (true);
+    return 0;
+  }
+
+  // The header line of the joined output, given the one of the input.
+  std::string header_line(const csv_header& header) const {
+    std::string line{header.line};
+    if (header.trailing_delimiter) line.pop_back();
+    for (const auto& name : appended_names_) {
+      line += Dialect::delimiter;
+      line += quote_field<Dialect>(name);
+    }
+    if (header.trailing_delimiter) line += Dialect::delimiter;
+    return line;
+  }
+
+  // The names of the columns the join appends.
+  const std::vector<std::string>& appended_names() const {
+    return appended_names_;
+  }
+
+  // Whether rows go to disk through defer() rather than being joined at once
+  // by apply().
+  bool partitioned() const { return !build_files_.empty(); }
+
+  // Joins the row made of tokens with its match.
+  void apply(tokens& tokens, std::string& storage) const {
+    const auto* match{
+        table_->find(field_value<Dialect>(tokens[input_key_], storage))};
+    tokens.resize(width_);
+    for (std::size_t i{0}; i < columns_.size(); ++i) {
+      if (match != nullptr) {
+        tokens[targets_[i]] = table_->field(match, i);
+      }
+    }
+  }
+
+  // Sets aside a row, whose tokens are those of line, to be joined by
+  // finish() with the rows of its partition.
+  void defer(const tokens& tokens, std::string_view line,
+             std::string_view ending, std::string& storage) {
+    const auto key{field_value<Dialect>(tokens[input_key_], storage)};
+    // Big endian, so that the byte order of the keys is the row order.
+    char number[8];
+    for (std::size_t i{0}; i < sizeof number; ++i) {
+      number[i] = static_cast<char>(rows_ >> (56 - 8 * i));
+    }
+    ++rows_;
+    write_run_record(*probe_[partition_of(key)], {number, sizeof number},
+                     {line.data(), line.size() + ending.size()});
+  }
+
+  // Joins the rows set aside by defer(), a partition at a time, and passes
+  // them to write(record) in input order. row(line, ending, chunk) appends
+  // the rewritten row to chunk, calling apply() as the rewrite does. Returns
+  // false, with error() telling why, when a partition could not be written
+  // or read back whole.
+  template <typename Row, typename Write>
+  bool finish(Row&& row, Write&& write) {
+    if (!partitioned()) return true;
+
+    // The blocks of the partitions give their memory back to the table.
+    for (auto* writers : {&build_, &probe_}) {
+      for (auto& writer : *writers) {
+        if (!writer->close()) fail(writer->error());
+      }
+      writers->clear();
+    }
+    if (error_ != 0) return false;
+
+    // For the tokens of a row of the joined file, one at a time.
+    arena_resource arena;
+    std::pmr::string chunk;
+    std::vector<std::string> joined;
+    for (std::size_t p{0}; p < build_files_.size(); ++p) {
+      table_->clear();
+      fail(merge_runs({build_files_[p]}, key_type::lexicographic,
+                      RUN_BUFFER_SIZE,
+                      [&](std::string_view key, std::string_view line) {
+                        table_->add(
+                            key, split_line_into_tokens<Dialect>(line, &arena),
+                            columns_);
+                        arena.reset();
+                      }));
+      files_->remove(build_files_[p]);
+      if (error_ != 0) return false;
+
+      joined.push_back(files_->create());
+      output_file run{joined.back(), write_mode::buffered, options_->io};
+      fail(merge_runs({probe_files_[p]}, key_type::lexicographic,
+                      RUN_BUFFER_SIZE,
+                      [&](std::string_view number, std::string_view record) {
+                        auto rest{record};
+                        const auto [line, ending]{next_record<Dialect>(rest)};
+                        chunk.clear();
+                        row(line, ending, chunk);
+                        write_run_record(run, number, chunk);
+                      }));
+      files_->remove(probe_files_[p]);
+      if (!run.close()) fail(run.error());
+      if (error_ != 0) return false;
+    }
+
+    fail(merge_runs(joined, key_type::lexicographic, options_->memory_budget,
+                    [&](std::string_view, std::string_view record) {
+                      write(record);
+                    }));
+    return error_ == 0;
+  }
+
+  // The errno of the first partition that could not be written or read back
+  // whole, 0 if none.
+  int error() const { return error_; }
+
+ private:
+  static constexpr std::size_t RUN_BUFFER_SIZE{1 << 20};
+
+  // Enough partitions that each should fit in half the memory budget, with
+  // no more than can be merged in one pass. Their blocks, two per partition,
+  // share the other half, down to a page each.
+  void partition(std::uint64_t size) {
+    const auto budget{std::max<std::size_t>(options_->memory_budget, 1)};
+    const auto partitions{static_cast<std::size_t>(
+        std::clamp<std::uint64_t>(2 * size / budget + 1, 2, MERGE_FAN_IN))};
+    const auto block_size{std::clamp<std::size_t>(
+        budget / 2 / (2 * partitions) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT,
+        BUFFER_ALIGNMENT, JOIN_PARTITION_BLOCK_SIZE)};
+    files_.emplace(options_->temp_directory, "join");
+    for (std::size_t p{0}; p < partitions; ++p) {
+      build_files_.push_back(files_->create());
+      build_.push_back(std::make_unique<output_file>(
+          build_files_.back(), write_mode::buffered, io_backend::synchronous,
+          block_size));
+      probe_files_.push_back(files_->create());
+      probe_.push_back(std::make_unique<output_file>(
+          probe_files_.back(), write_mode::buffered, io_backend::synchronous,
+          block_size));
+    }
+  }
+
+  // Keeps the first error.
+  void fail(int error) {
+    if (error_ == 0) error_ = error;
+  }
+
+  // The high bits of the hash: the table indexes slots with the low ones.
+  std::size_t partition_of(std::string_view key) const {
+    return static_cast<std::size_t>((hash_bytes(key) >> 32) % build_.size());
+  }
+
+  const options* options_{nullptr};
+  csv_header joined_header_;
+  std::size_t input_key_{0};
+  std::size_t joined_key_{0};
+  // The columns of the joined file that go into the output, and where.
+  std::vector<std::size_t> columns_;
+  std::vector<std::size_t> targets_;
+  std::vector<std::string> appended_names_;
+  // Number of columns of a joined row.
+  std::size_t width_{0};
+  std::optional<join_table> table_;
+
+  std::optional<temp_files> files_;
+  std::vector<std::string> build_files_;
+  std::vector<std::string> probe_files_;
+  std::vector<std::unique_ptr<output_file>> build_;
+  std::vector<std::unique_ptr<output_file>> probe_;
+  std::uint64_t rows_{0};
+  int error_{0};
+};
+}  // namespace tool
@@ -0,0 +1,118 @@
+#pragma once
+
+// JSON Lines output.
+// Each row becomes an object on a line of its own, with a member per column
+// named after the header. The member names, quoted and escaped along with
+// their braces, commas and colons, are built once from the header, so a row
+// only escapes its values; those are scanned eight bytes at a time for the
+// characters JSON escapes, and copied in runs between them.
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "swar.h"
+#include "tokenizer.h"
+
+namespace tool {
+namespace detail {
+template <typename String>
+void append_json_escape(char c, String& out) {
+  switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    case '\b':
+      out += "\\b";
+      break;
+    case '\f':
+      out += "\\f";
+      break;
+    default: {
+      constexpr char digits[]{"0123456789abcdef"};
+      out += "\\u00";
+      out += digits[(c >> 4) & 0xF];
+      out += digits[c & 0xF];
+    }
+  }
+}
+
+constexpr bool needs_json_escape(char c) {
+  return c == '"' || c == '\\' || static_cast<unsigned char>(c) < 0x20;
+}
+
+// The position of the first character of value from pos on that JSON
+// escapes, or value.size().
+inline std::size_t find_json_escape(std::string_view value, std::size_t pos) {
+  constexpr auto quotes{swar::broadcast('"')};
+  constexpr auto backslashes{swar::broadcast('\\')};
+  for (; pos + swar::WORD_SIZE <= value.size(); pos += swar::WORD_SIZE) {
+    const auto w{swar::load(value.data() + pos)};
+    const auto mask{swar::match(w, quotes) | swar::match(w, backslashes) |
+                    swar::less_than(w, 0x20)};
+    if (mask != 0) return pos + swar::first(mask);
+  }
+  for (; pos < value.size(); ++pos) {
+    if (needs_json_escape(value[pos])) return pos;
+  }
+  return value.size();
+}
+}  // namespace detail
+
+// Appends value to out as a JSON string. Bytes above 0x7F are copied as
+// they are, so UTF-8 input makes UTF-8 output.
+template <typename String>
+void append_json_string(std::string_view value, String& out) {
+  out += '"';
+  std::size_t start{0};
+  while (true) {
+    const auto special{detail::find_json_escape(value, start)};
+    out.append(value.data() + start, special - start);
+    if (special == value.size()) break;
+    detail::append_json_escape(value[special], out);
+    start = special + 1;
+  }
+  out += '"';
+}
+
+class json_lines {
+ public:
+  explicit json_lines(const std::vector<std::string>& column_names) {
+    for (const auto& name : column_names) {
+      std::string member{members_.empty() ? "{" : ","};
+      append_json_string(name, member);
+      member += ':';
+      members_.push_back(std::move(member));
+    }
+  }
+
+  // Appends the object for the row made of fields, one per column, with
+  // every value a string.
+  template <typename Dialect, typename String>
+  void append_row(const tokens& fields, String& out) {
+    if (members_.empty()) out += '{';
+    for (std::size_t i{0}; i < members_.size(); ++i) {
+      out += members_[i];
+      append_json_string(field_value<Dialect>(fields[i], storage_), out);
+    }
+    out += "}\n";
+  }
+
+ private:
+  std::vector<std::string> members_;
+  std::string storage_;
+};
+}  // namespace tool
@@ -0,0 +1,123 @@
+#pragma once
+
+// NUMA placement.
+// On a machine with several memory nodes, a worker reading a block held in
+// the memory of another node pays for every cache miss twice over. With
+// --numa the workers are spread evenly over the nodes and pinned to the
+// processors of theirs, and each input block is queued for the workers of
+// one node, its pages moved to that node the first time the buffer is seen.
+// Buffers are recycled, so each is moved once. Workers take the blocks of
+// their own node, and only take those of another node when it falls behind.
+// Memory a worker allocates itself, such as its arena, is placed on its
+// node by the kernel, which puts a page where it is first touched.
+//
+// The topology comes from /sys/devices/system/node. Without it, or on
+// other systems, the machine is one node and nothing is pinned or moved.
+
+#include <cstddef>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace tool {
+struct numa_node {
+  int id;
+  std::vector<int> cpus;
+};
+
+// Parses a sysfs CPU list such as "0-3,8-11".
+inline std::vector<int> parse_cpu_list(const std::string& text) {
+  std::vector<int> cpus;
+  std::istringstream ranges{text};
+  for (std::string range; std::getline(ranges, range, ',');) {
+    const auto dash{range.find('-')};
+    try {
+      const auto first{std::stoi(range.substr(0, dash))};
+      const auto last{dash == std::string::npos
+                          ? first
+                          : std::stoi(range.substr(dash + 1))};
+      for (auto cpu{first}; cpu <= last; ++cpu) cpus.push_back(cpu);
+    } catch (const std::exception&) {
+      // An empty list, as a node without processors has.
+    }
+  }
+  return cpus;
+}
+
+class numa_topology {
+ public:
+  // The nodes that have processors. A single node with no processors
+  // listed when the system tells nothing.
+  static numa_topology detect() {
+    numa_topology topology;
+#ifdef __linux__
+    const std::string root{"/sys/devices/system/node/"};
+    std::ifstream online{root + "has_cpu"};
+    std::string list;
+    std::getline(online, list);
+    for (const auto id : parse_cpu_list(list)) {
+      std::ifstream cpus{root + "node" + std::to_string(id) + "/cpulist"};
+      std::string cpu_list;
+      std::getline(cpus, cpu_list);
+      topology.nodes_.push_back({id, parse_cpu_list(cpu_list)});
+    }
+#endif
+    if (topology.nodes_.empty()) topology.nodes_.push_back({0, {}});
+    return topology;
+  }
+
+  std::size_t nodes() const { return nodes_.size(); }
+
+  // The node of worker out of workers: consecutive workers share a node,
+  // and every node gets as many workers as the others, give or take one.
+  std::size_t node_of_worker(std::size_t worker, std::size_t workers) const {
+    return worker * nodes_.size() / workers;
+  }
+
+  // Restricts the calling thread to the processors of node, if the system
+  // lets it.
+  void pin_to_node(std::size_t node) const {
+#ifdef __linux__
+    if (nodes_.size() < 2 || nodes_[node].cpus.empty()) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto cpu : nodes_[node].cpus) {
+      if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    ::pthread_setaffinity_np(::pthread_self(), sizeof set, &set);
+#else
+    static_cast<void>(node);
+#endif
+  }
+
+  // Asks for the pages of [data, data + size), which must be page aligned,
+  // to be on node, moving those already there. Best effort.
+  void move_to_node(void* data, std::size_t size, std::size_t node) const {
+#ifdef __linux__
+    if (nodes_.size() < 2) return;
+    const auto id{static_cast<std::size_t>(nodes_[node].id)};
+    constexpr auto bits{8 * sizeof(unsigned long)};
+    std::vector<unsigned long> mask(id / bits + 1);
+    mask[id / bits] = 1ul << (id % bits);
+    ::syscall(SYS_mbind, data, size, MPOL_PREFERRED, mask.data(),
+              mask.size() * bits + 1, MPOL_MF_MOVE);
+#else
+    static_cast<void>(data);
+    static_cast<void>(size);
+    static_cast<void>(node);
+#endif
+  }
+
+ private:
+  std::vector<numa_node> nodes_;
+};
+}  // namespace tool
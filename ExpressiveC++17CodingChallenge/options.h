@@ -0,0 +1,424 @@
+#pragma once
+
+// Command line parsing.
+// Flags start with "--" and may appear anywhere; the remaining arguments are
+// the four positional parameters of the original tool.
+
+#include <charconv>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <gsl/multi_span>
+
+#include "dialect.h"
+#include "group.h"
+#include "io.h"
+#include "output.h"
+#include "profile.h"
+#include "pseudonym.h"
+#include "sniffer.h"
+#include "sort.h"
+
+namespace tool {
+const auto NUMBER_OF_PARAMETERS{4};
+
+namespace error_codes {
+constexpr auto NOT_ENOUGH_PARAMETERS{1};
+constexpr auto NO_CSV_INPUT_FILE{2};
+constexpr auto NO_COLUMN_NAME{3};
+constexpr auto INVALID_OPTION{4};
+constexpr auto MALFORMED_ROWS{5};
+constexpr auto NO_CSV_OUTPUT_FILE{6};
+constexpr auto INVALID_TEXT{7};
+};  // namespace error_codes
+
+namespace parameter_position {
+constexpr auto CSV_INPUT_FILE{1};
+constexpr auto COLUMN_NAME{2};
+constexpr auto REPLACEMENT_STRING{3};
+constexpr auto CSV_OUTPUT_FILE{4};
+// In the modes that take no column name and replacement string.
+constexpr auto MODE_OUTPUT_FILE{2};
+};  // namespace parameter_position
+
+enum class run_mode {
+  rewrite,
+  // Only checks that every row has as many fields as the header.
+  check,
+  // Sorts the rows by a column.
+  sort,
+  // Aggregates the rows by the value of a column.
+  group,
+  // Only infers the types of the columns from a sample of the rows.
+  schema,
+  // Runs rewrite jobs sent over a Unix domain socket.
+  serve
+};
+
+// The format of the rewritten rows.
+enum class output_format { csv, arrow, jsonl };
+
+// The rows of the input rewritten: all of them, the first or the last
+// ones, or a random sample.
+enum class row_selection { all, head, tail, sample };
+
+struct options {
+  run_mode mode{run_mode::rewrite};
+  std::string input_filename;
+  std::string column_name;
+  std::string replacement;
+  std::string output_filename;
+  dialect_config dialect;
+  // Parts of the dialect given on the command line; the others are sniffed.
+  bool explicit_delimiter{false};
+  bool explicit_escape{false};
+  bool explicit_crlf{false};
+  std::size_t sniff_bytes{SNIFF_BYTES};
+  write_mode output_mode{write_mode::buffered};
+  output_format format{output_format::csv};
+  // Keeps rewriting the rows appended to the input until it is removed.
+  bool follow{false};
+  // Reuses the output of the previous rewrite for the unchanged parts of
+  // the input.
+  bool incremental{false};
+  // Rewrites only the rows whose where_column holds one of where_values;
+  // the others are copied as they are, or left out with drop_others.
+  std::string where_column;
+  std::vector<std::string> where_values;
+  bool drop_others{false};
+  row_selection selection{row_selection::all};
+  // How many rows the selection keeps.
+  std::size_t selected_rows{0};
+  // Seeds the sample, which is different every run without it.
+  std::optional<std::size_t> sample_seed;
+  io_backend io{io_backend::uring};
+  // Puts I/O buffers and arenas on huge pages when the system has them.
+  bool huge_pages{false};
+  // Columns to profile while rewriting.
+  std::vector<std::string> profile_columns;
+  std::size_t top_k{TOP_K};
+  std::string sort_column;
+  key_type sort_keys{key_type::lexicographic};
+  std::size_t memory_budget{SORT_MEMORY_BUDGET};
+  // Where sorted runs and join partitions are spilled; the system's
+  // temporary directory if empty.
+  std::string temp_directory;
+  // The file joined with the input, on a column both have.
+  std::string join_filename;
+  std::string join_column;
+  // Replaces values with keyed pseudonyms rather than with the replacement
+  // string.
+  std::optional<siphash_key> pseudonym_key;
+  std::string group_column;
+  std::string socket_path;
+  std::vector<aggregate> aggregates{{aggregate_function::count, {}}};
+  // Worker threads, one per hardware thread if 0.
+  std::size_t threads{0};
+  // Places workers and the blocks they work on on NUMA nodes.
+  bool numa{false};
+};
+
+inline bool parse_delimiter(std::string_view value, char& delimiter) {
+  if (value == "comma" || value == ",") {
+    delimiter = ',';
+  } else if (value == "semicolon" || value == ";") {
+    delimiter = ';';
+  } else if (value == "tab" || value == "\\t" || value == "\t") {
+    delimiter = '\t';
+  } else if (value == "pipe" || value == "|") {
+    delimiter = '|';
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline bool parse_io_backend(std::string_view value, io_backend& backend) {
+  if (value == "uring") {
+    backend = io_backend::uring;
+  } else if (value == "threads") {
+    backend = io_backend::threads;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline bool parse_output_format(std::string_view value,
+                                output_format& format) {
+  if (value == "csv") {
+    format = output_format::csv;
+  } else if (value == "arrow") {
+    format = output_format::arrow;
+  } else if (value == "jsonl") {
+    format = output_format::jsonl;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline bool parse_size(std::string_view value, std::size_t& size) {
+  const auto last{value.data() + value.size()};
+  const auto [end, error]{std::from_chars(value.data(), last, size)};
+  return error == std::errc{} && end == last && size > 0;
+}
+
+// Reads a SipHash key from a file, so that it does not show in the command
+// line of the process.
+inline bool read_key_file(const std::string& filename,
+                          std::optional<siphash_key>& key) {
+  std::ifstream file(filename);
+  std::string text;
+  key.emplace();
+  return static_cast<bool>(file >> text) && parse_siphash_key(text, *key);
+}
+
+inline bool parse_escape(std::string_view value, escape_rule& escape) {
+  if (value == "none") {
+    escape = escape_rule::none;
+  } else if (value == "double") {
+    escape = escape_rule::doubled_quote;
+  } else if (value == "backslash") {
+    escape = escape_rule::backslash;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Fills result from the command line and returns 0, or returns one of the
+// error_codes after reporting the problem.
+inline int parse_options(gsl::multi_span<char*> args, options& result) {
+  std::vector<std::string_view> positional;
+  // Which of --head, --tail and --sample was given.
+  std::string_view selection_option;
+  for (std::ptrdiff_t i{0}; i < args.size(); ++i) {
+    const std::string_view arg{args[i]};
+    if (i == 0 || arg.substr(0, 2) != "--") {
+      positional.push_back(arg);
+      continue;
+    }
+
+    const auto has_value{i + 1 < args.size()};
+    const std::string_view value{has_value ? args[i + 1] : ""};
+    auto valid{has_value};
+    if (arg == "--delimiter") {
+      valid = valid && parse_delimiter(value, result.dialect.delimiter);
+      result.explicit_delimiter = true;
+      ++i;
+    } else if (arg == "--quote") {
+      valid = valid && parse_escape(value, result.dialect.escape);
+      result.explicit_escape = true;
+      ++i;
+    } else if (arg == "--crlf") {
+      result.dialect.crlf = true;
+      result.explicit_crlf = true;
+      valid = true;
+    } else if (arg == "--check") {
+      result.mode = run_mode::check;
+      valid = true;
+    } else if (arg == "--serve") {
+      result.mode = run_mode::serve;
+      result.socket_path = std::string{value};
+      valid = valid && !value.empty();
+      ++i;
+    } else if (arg == "--schema") {
+      result.mode = run_mode::schema;
+      valid = true;
+    } else if (arg == "--direct-io") {
+      result.output_mode = write_mode::direct;
+      valid = true;
+    } else if (arg == "--follow") {
+      result.follow = true;
+      valid = true;
+    } else if (arg == "--incremental") {
+      result.incremental = true;
+      valid = true;
+    } else if (arg == "--where") {
+      const auto equals{value.find('=')};
+      const auto column{value.substr(0, equals)};
+      valid = valid && equals != std::string_view::npos &&
+              (result.where_column.empty() || result.where_column == column);
+      if (valid) {
+        result.where_column = column;
+        result.where_values.emplace_back(value.substr(equals + 1));
+      }
+      ++i;
+    } else if (arg == "--drop-others") {
+      result.drop_others = true;
+      valid = true;
+    } else if (arg == "--head" || arg == "--tail" || arg == "--sample") {
+      valid = valid && result.selection == row_selection::all &&
+              parse_size(value, result.selected_rows);
+      result.selection = arg == "--head"   ? row_selection::head
+                         : arg == "--tail" ? row_selection::tail
+                                           : row_selection::sample;
+      selection_option = arg;
+      ++i;
+    } else if (arg == "--seed") {
+      std::size_t seed{0};
+      valid = valid && parse_size(value, seed);
+      result.sample_seed = seed;
+      ++i;
+    } else if (arg == "--huge-pages") {
+      result.huge_pages = true;
+      valid = true;
+    } else if (arg == "--io") {
+      valid = valid && parse_io_backend(value, result.io);
+      ++i;
+    } else if (arg == "--format") {
+      valid = valid && parse_output_format(value, result.format);
+      ++i;
+    } else if (arg == "--pseudonymize") {
+      valid = valid && read_key_file(std::string{value}, result.pseudonym_key);
+      ++i;
+    } else if (arg == "--profile") {
+      result.profile_columns.emplace_back(value);
+      ++i;
+    } else if (arg == "--top-k") {
+      valid = valid && parse_size(value, result.top_k);
+      ++i;
+    } else if (arg == "--sort-by") {
+      result.mode = run_mode::sort;
+      result.sort_column = value;
+      ++i;
+    } else if (arg == "--join") {
+      result.join_filename = value;
+      ++i;
+    } else if (arg == "--on") {
+      result.join_column = value;
+      ++i;
+    } else if (arg == "--group-by") {
+      result.mode = run_mode::group;
+      result.group_column = value;
+      ++i;
+    } else if (arg == "--agg") {
+      valid = valid && parse_aggregates(value, result.aggregates);
+      ++i;
+    } else if (arg == "--threads") {
+      valid = valid && parse_size(value, result.threads);
+      ++i;
+    } else if (arg == "--numa") {
+      result.numa = true;
+      valid = true;
+    } else if (arg == "--numeric") {
+      result.sort_keys = key_type::numeric;
+      valid = true;
+    } else if (arg == "--memory-budget") {
+      valid = valid && parse_size(value, result.memory_budget);
+      ++i;
+    } else if (arg == "--temp-dir") {
+      result.temp_directory = value;
+      ++i;
+    } else if (arg == "--sniff-bytes") {
+      valid = valid && parse_size(value, result.sniff_bytes);
+      ++i;
+    } else {
+      valid = false;
+    }
+
+    if (!valid) {
+      std::cerr << "invalid option: " << arg << '\n';
+      return error_codes::INVALID_OPTION;
+    }
+  }
+
+  if (result.join_filename.empty() != result.join_column.empty()) {
+    std::cerr << "invalid option: "
+              << (result.join_column.empty() ? "--join" : "--on") << '\n';
+    return error_codes::INVALID_OPTION;
+  }
+
+  if (result.format != output_format::csv && result.mode != run_mode::rewrite) {
+    std::cerr << "invalid option: --format\n";
+    return error_codes::INVALID_OPTION;
+  }
+
+  // A followed rewrite writes its rows as they come: not whole pages, nor a
+  // file that only makes sense once finished.
+  if (result.follow &&
+      (result.mode != run_mode::rewrite ||
+       result.output_mode == write_mode::direct ||
+       result.format == output_format::arrow)) {
+    std::cerr << "invalid option: --follow\n";
+    return error_codes::INVALID_OPTION;
+  }
+
+  // An incremental rewrite copies rows from the previous output: it cannot
+  // see the joined file change, nor profile the rows it copies.
+  if (result.incremental &&
+      (result.mode != run_mode::rewrite || result.follow ||
+       result.output_mode == write_mode::direct ||
+       result.format == output_format::arrow ||
+       !result.join_filename.empty() || !result.profile_columns.empty())) {
+    std::cerr << "invalid option: --incremental\n";
+    return error_codes::INVALID_OPTION;
+  }
+
+  // The rows --where leaves alone are copied as they are, which only fits
+  // CSV output with the columns of the input.
+  if (!result.where_column.empty() &&
+      (result.mode != run_mode::rewrite ||
+       (!result.drop_others && (result.format != output_format::csv ||
+                                !result.join_filename.empty())))) {
+    std::cerr << "invalid option: --where\n";
+    return error_codes::INVALID_OPTION;
+  }
+  if (result.drop_others && result.where_column.empty()) {
+    std::cerr << "invalid option: --drop-others\n";
+    return error_codes::INVALID_OPTION;
+  }
+
+  // A selection of rows is one more way of rewriting, of a file that is
+  // there to be read in any order.
+  if (result.selection != row_selection::all &&
+      (result.mode != run_mode::rewrite || result.follow ||
+       result.incremental)) {
+    std::cerr << "invalid option: " << selection_option << '\n';
+    return error_codes::INVALID_OPTION;
+  }
+  if (result.sample_seed && result.selection != row_selection::sample) {
+    std::cerr << "invalid option: --seed\n";
+    return error_codes::INVALID_OPTION;
+  }
+
+  // The server gets its files from its jobs.
+  if (result.mode == run_mode::serve) {
+    return 0;
+  }
+
+  // A check or a schema only needs the input file, and ignores the other
+  // parameters.
+  if (result.mode == run_mode::check || result.mode == run_mode::schema) {
+    if (positional.size() <= parameter_position::CSV_INPUT_FILE) {
+      return error_codes::NOT_ENOUGH_PARAMETERS;
+    }
+    result.input_filename = positional[parameter_position::CSV_INPUT_FILE];
+    return 0;
+  }
+
+  if (result.mode == run_mode::sort || result.mode == run_mode::group) {
+    if (positional.size() != parameter_position::MODE_OUTPUT_FILE + 1) {
+      return error_codes::NOT_ENOUGH_PARAMETERS;
+    }
+    result.input_filename = positional[parameter_position::CSV_INPUT_FILE];
+    result.output_filename = positional[parameter_position::MODE_OUTPUT_FILE];
+    return 0;
+  }
+
+  if (positional.size() != NUMBER_OF_PARAMETERS + 1) {
+    return error_codes::NOT_ENOUGH_PARAMETERS;
+  }
+
+  result.input_filename = positional[parameter_position::CSV_INPUT_FILE];
+  result.column_name = positional[parameter_position::COLUMN_NAME];
+  result.replacement = positional[parameter_position::REPLACEMENT_STRING];
+  result.output_filename = positional[parameter_position::CSV_OUTPUT_FILE];
+  return 0;
+}
+}  // namespace tool
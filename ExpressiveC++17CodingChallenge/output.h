@@ -0,0 +1,264 @@
+#pragma once
+
+// Output file.
+// Writes go through page aligned blocks, which are handed to an io_queue
+// when full so that several writes are in flight behind the rewrite, or
+// just the one block written in place on the synchronous queue. In
+// direct mode the file is preallocated from an estimate of its final size,
+// so it is not grown one write at a time, and the blocks bypass the page
+// cache: with O_DIRECT when the file system supports it, otherwise by
+// dropping each block from the cache once it is on disk. Either way the file
+// is truncated to the exact number of bytes written when closed.
+//
+// Writes are not checked one by one as they are made: the first that fails
+// is kept, and close() tells of it. The writes after it are still made,
+// but the file is not complete.
+//
+// Direct mode needs Linux; elsewhere it behaves as the buffered mode.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "buffer.h"
+#include "io.h"
+
+namespace tool {
+constexpr std::size_t OUTPUT_BLOCK_SIZE{1 << 20};
+
+enum class write_mode { buffered, direct };
+
+class output_file {
+ public:
+  // block_size must be a multiple of BUFFER_ALIGNMENT.
+  output_file(const std::string& filename, write_mode mode,
+              io_backend backend = io_backend::uring,
+              std::size_t block_size = OUTPUT_BLOCK_SIZE)
+      : filename_{filename},
+        mode_{mode},
+        block_size_{block_size},
+        depth_{backend == io_backend::synchronous ? 1 : IO_QUEUE_DEPTH},
+        buffer_{block_size} {
+    unbuffered_ = mode_ == write_mode::direct;
+    file_ = file_handle::open_write(filename, unbuffered_);
+    created_ = is_open();
+    if (!created_) error_ = errno;
+    queue_ = make_io_queue(file_, backend, depth_);
+  }
+
+  output_file(const output_file&) = delete;
+  output_file& operator=(const output_file&) = delete;
+
+  ~output_file() { close(); }
+
+  bool is_open() const { return file_.is_open(); }
+
+  // Reserves size bytes on disk in direct mode; a no-op otherwise, or when
+  // the file system cannot preallocate.
+  void preallocate(std::uint64_t size) {
+#ifdef __linux__
+    if (mode_ == write_mode::direct && is_open() && size > 0) {
+      ::fallocate(file_.fd(), 0, 0, static_cast<off_t>(size));
+    }
+#else
+    static_cast<void>(size);
+#endif
+  }
+
+  void write(std::string_view data) {
+    while (!data.empty()) {
+      const auto n{std::min(data.size(), buffer_.available())};
+      std::memcpy(buffer_.data() + buffer_.size(), data.data(), n);
+      buffer_.resize(buffer_.size() + n);
+      data.remove_prefix(n);
+      if (buffer_.available() == 0) {
+        flush_block();
+      }
+    }
+  }
+
+  output_file& operator<<(std::string_view data) {
+    write(data);
+    return *this;
+  }
+
+  std::uint64_t bytes_written() const { return written_ + buffer_.size(); }
+
+  // The errno of the first write that failed, or of opening the file, 0 if
+  // none did.
+  int error() const { return error_; }
+
+  // Writes out everything written so far, for readers of the file to see.
+  // Buffered mode only: direct writes are whole pages.
+  void flush() {
+    if (unbuffered_) return;
+    flush_block();
+    while (queue_->in_flight() > 0) {
+      auto request{queue_->wait()};
+      completed(request);
+    }
+  }
+
+  // Appends length bytes of source from offset. On Linux the kernel copies
+  // them, sharing the blocks when the file system can; elsewhere, or when
+  // the kernel cannot, they are read and written. Buffered mode only.
+  void copy_from(file_handle& source, std::uint64_t offset,
+                 std::uint64_t length) {
+    flush_block();
+#ifdef __linux__
+    auto in{static_cast<loff_t>(offset)};
+    auto out{static_cast<loff_t>(written_)};
+    while (length > 0) {
+      const auto n{::copy_file_range(source.fd(), &in, file_.fd(), &out,
+                                     length, 0)};
+      if (n < 0 && errno == EINTR) continue;
+      // Errors included: the copy below meets them again, and tells.
+      if (n <= 0) break;
+      offset += static_cast<std::uint64_t>(n);
+      written_ += static_cast<std::uint64_t>(n);
+      length -= static_cast<std::uint64_t>(n);
+    }
+#endif
+    while (length > 0) {
+      const auto n{source.read_at(
+          buffer_.data(),
+          static_cast<std::size_t>(std::min<std::uint64_t>(
+              length, buffer_.capacity())),
+          offset)};
+      if (n == 0) {
+        // The source ends before length, or cannot be read.
+        failed(errno != 0 ? errno : EIO);
+        return;
+      }
+      buffer_.resize(n);
+      offset += n;
+      length -= n;
+      flush_block();
+    }
+  }
+
+  // Closes the file and removes it, for output an error left incomplete.
+  void discard() {
+    close();
+    if (created_) std::remove(filename_.c_str());
+    created_ = false;
+  }
+
+  // Writes out what is left and closes the file. False when a write failed,
+  // or closing did, which error() then tells.
+  bool close() {
+    if (!is_open()) return error_ == 0;
+
+    const auto size{bytes_written()};
+    if (unbuffered_) {
+      // O_DIRECT only writes whole pages: pad the last one, the truncation
+      // below drops the padding.
+      const auto padded{(buffer_.size() + BUFFER_ALIGNMENT - 1) /
+                        BUFFER_ALIGNMENT * BUFFER_ALIGNMENT};
+      std::memset(buffer_.data() + buffer_.size(), 0,
+                  padded - buffer_.size());
+      buffer_.resize(padded);
+    }
+    flush_block();
+    while (queue_->in_flight() > 0) {
+      auto request{queue_->wait()};
+      completed(request);
+    }
+#ifdef __linux__
+    drop_from_cache();
+    if (mode_ == write_mode::direct &&
+        ::ftruncate(file_.fd(), static_cast<off_t>(size)) != 0) {
+      failed(errno);
+    }
+#endif
+    queue_.reset();
+    if (!file_.close()) failed(errno);
+    written_ = size;
+    return error_ == 0;
+  }
+
+ private:
+  // Queues the current block and continues in a free one, waiting for the
+  // oldest write when all of them are in flight.
+  void flush_block() {
+    if (buffer_.size() == 0) return;
+
+    const auto size{buffer_.size()};
+    queue_->write(std::move(buffer_), written_);
+    written_ += size;
+
+    if (queue_->in_flight() < depth_) {
+      buffer_ = aligned_buffer{block_size_};
+    } else {
+      auto request{queue_->wait()};
+      completed(request);
+      buffer_ = std::move(request.buffer);
+    }
+    buffer_.resize(0);
+  }
+
+  void completed(io_request& request) {
+    if (request.error != 0) failed(request.error);
+#ifdef __linux__
+    if (mode_ == write_mode::direct && !unbuffered_) {
+      // Start writing this block back, and drop the previous one, whose
+      // write back has had a block's worth of time to complete: the pages
+      // must be clean before the kernel agrees to drop them.
+      const auto offset{static_cast<off_t>(request.offset)};
+      const auto size{static_cast<off_t>(request.length)};
+      ::sync_file_range(file_.fd(), offset, size, SYNC_FILE_RANGE_WRITE);
+      drop_from_cache();
+      pending_offset_ = offset;
+      pending_size_ = size;
+    }
+#endif
+  }
+
+  // Keeps the first error.
+  void failed(int error) {
+    if (error_ == 0) error_ = error;
+  }
+
+#ifdef __linux__
+  void drop_from_cache() {
+    if (pending_size_ == 0) return;
+    // Waiting for the write back tells if it failed.
+    if (::sync_file_range(file_.fd(), pending_offset_, pending_size_,
+                          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                              SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+      failed(errno);
+    }
+    ::posix_fadvise(file_.fd(), pending_offset_, pending_size_,
+                    POSIX_FADV_DONTNEED);
+    pending_size_ = 0;
+  }
+
+  // The block written before the last one, still in the page cache.
+  off_t pending_offset_{0};
+  off_t pending_size_{0};
+#endif
+
+  std::string filename_;
+  bool created_{false};
+  write_mode mode_;
+  std::size_t block_size_;
+  // Blocks written at once at most.
+  std::size_t depth_;
+  bool unbuffered_{false};
+  file_handle file_;
+  std::unique_ptr<io_queue> queue_;
+  aligned_buffer buffer_;
+  std::uint64_t written_{0};
+  int error_{0};
+};
+}  // namespace tool
@@ -0,0 +1,198 @@
+#pragma once
+
+// Huge pages.
+// On multi-gigabyte inputs the input blocks, output blocks and arena blocks
+// are touched once per byte, and every 4 KiB page of them costs a TLB miss.
+// With --huge-pages they come from 2 MiB pages instead: explicit huge pages
+// (MAP_HUGETLB) when the system has reserved some, else transparent huge
+// pages asked for with madvise(MADV_HUGEPAGE), which the kernel grants when
+// it finds free 2 MiB ranges, else plain pages.
+//
+// Blocks smaller than a huge page are carved out of huge pages. A freed
+// block is kept for the next block of its size, which is how blocks are
+// used here: a few sizes, recycled over and over. The huge pages are only
+// given back when the process ends.
+//
+// huge_page_stats() tells how much of that memory really is on huge pages:
+// all of it when explicit, and for transparent pages what
+// /proc/self/smaps reports. Huge pages need Linux; elsewhere the flag is
+// accepted and the blocks come from the heap.
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace tool {
+constexpr std::size_t BASE_PAGE_SIZE{4096};
+constexpr std::size_t HUGE_PAGE_SIZE{2 << 20};
+
+struct huge_page_stats {
+  // Bytes mapped to be backed by huge pages.
+  std::uint64_t mapped{0};
+  // Of those, the bytes on explicit and on transparent huge pages.
+  std::uint64_t explicit_bytes{0};
+  std::uint64_t transparent_bytes{0};
+};
+
+class page_allocator {
+ public:
+  static page_allocator& instance() {
+    static page_allocator allocator;
+    return allocator;
+  }
+
+  // Must be called before the first allocation.
+  void use_huge_pages(bool enabled) {
+#ifdef __linux__
+    huge_pages_ = enabled;
+#else
+    static_cast<void>(enabled);
+#endif
+  }
+
+  // size bytes aligned on a page. Throws std::bad_alloc.
+  void* allocate(std::size_t size) {
+    if (!huge_pages_) {
+      return ::operator new(size, std::align_val_t{BASE_PAGE_SIZE});
+    }
+    size = round_up(size, BASE_PAGE_SIZE);
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    auto& free{free_[size]};
+    if (!free.empty()) {
+      const auto p{free.back()};
+      free.pop_back();
+      return p;
+    }
+    if (size >= HUGE_PAGE_SIZE) {
+      return map(round_up(size, HUGE_PAGE_SIZE));
+    }
+    if (region_left_ < size) {
+      region_ = static_cast<char*>(map(HUGE_PAGE_SIZE));
+      region_left_ = HUGE_PAGE_SIZE;
+    }
+    const auto p{region_};
+    region_ += size;
+    region_left_ -= size;
+    return p;
+  }
+
+  void deallocate(void* p, std::size_t size) noexcept {
+    if (!huge_pages_) {
+      ::operator delete(p, std::align_val_t{BASE_PAGE_SIZE});
+      return;
+    }
+    std::lock_guard<std::mutex> lock{mutex_};
+    free_[round_up(size, BASE_PAGE_SIZE)].push_back(p);
+  }
+
+  huge_page_stats stats() const {
+    huge_page_stats stats;
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      stats.mapped = mapped_;
+      stats.explicit_bytes = explicit_bytes_;
+    }
+#ifdef __linux__
+    // Only these blocks are mapped with madvise(MADV_HUGEPAGE), so the
+    // mappings flagged "hg" are theirs.
+    std::ifstream smaps{"/proc/self/smaps"};
+    std::uint64_t anon_huge_kb{0};
+    for (std::string line; std::getline(smaps, line);) {
+      std::istringstream fields{line};
+      std::string name;
+      fields >> name;
+      if (name == "AnonHugePages:") {
+        fields >> anon_huge_kb;
+      } else if (name == "VmFlags:") {
+        for (std::string flag; fields >> flag;) {
+          if (flag == "hg") stats.transparent_bytes += anon_huge_kb * 1024;
+        }
+        anon_huge_kb = 0;
+      }
+    }
+#endif
+    return stats;
+  }
+
+ private:
+  page_allocator() = default;
+
+  static std::size_t round_up(std::size_t size, std::size_t unit) {
+    return (size + unit - 1) / unit * unit;
+  }
+
+  // size bytes, a multiple of HUGE_PAGE_SIZE, aligned on a huge page.
+  void* map(std::size_t size) {
+#ifdef __linux__
+    constexpr auto protection{PROT_READ | PROT_WRITE};
+    constexpr auto flags{MAP_PRIVATE | MAP_ANONYMOUS};
+    mapped_ += size;
+    if (const auto p{::mmap(nullptr, size, protection, flags | MAP_HUGETLB,
+                            -1, 0)};
+        p != MAP_FAILED) {
+      explicit_bytes_ += size;
+      return p;
+    }
+
+    // Over-allocated to cut an aligned range out of it, since the kernel
+    // only backs aligned 2 MiB ranges with huge pages.
+    const auto p{static_cast<char*>(::mmap(
+        nullptr, size + HUGE_PAGE_SIZE, protection, flags, -1, 0))};
+    if (p == MAP_FAILED) {
+      mapped_ -= size;
+      throw std::bad_alloc{};
+    }
+    const auto aligned{reinterpret_cast<char*>(
+        round_up(reinterpret_cast<std::uintptr_t>(p), HUGE_PAGE_SIZE))};
+    if (aligned > p) ::munmap(p, aligned - p);
+    const auto tail{p + size + HUGE_PAGE_SIZE - (aligned + size)};
+    if (tail > 0) ::munmap(aligned + size, tail);
+    ::madvise(aligned, size, MADV_HUGEPAGE);
+    return aligned;
+#else
+    static_cast<void>(size);
+    throw std::bad_alloc{};
+#endif
+  }
+
+  bool huge_pages_{false};
+  mutable std::mutex mutex_;
+  // Freed blocks, by size.
+  std::map<std::size_t, std::vector<void*>> free_;
+  // What is left of the huge page small blocks are carved out of.
+  char* region_{nullptr};
+  std::size_t region_left_{0};
+  std::uint64_t mapped_{0};
+  std::uint64_t explicit_bytes_{0};
+};
+
+// Gives memory from the page_allocator back to it.
+struct page_deleter {
+  std::size_t size;
+
+  void operator()(void* p) const noexcept {
+    page_allocator::instance().deallocate(p, size);
+  }
+};
+
+// Writes how much of the memory meant for huge pages got them.
+template <typename Stream>
+void print_huge_page_stats(Stream& out) {
+  const auto stats{page_allocator::instance().stats()};
+  constexpr auto mib{[](std::uint64_t bytes) { return bytes >> 20; }};
+  out << "huge pages: " << mib(stats.explicit_bytes + stats.transparent_bytes)
+      << " of " << mib(stats.mapped) << " MiB (" << mib(stats.explicit_bytes)
+      << " explicit, " << mib(stats.transparent_bytes) << " transparent)\n";
+}
+}  // namespace tool
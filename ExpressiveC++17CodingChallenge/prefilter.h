@@ -0,0 +1,146 @@
+#pragma once
+
+// Row prefilter.
+// With --where COLUMN=VALUE, a row is only rewritten when COLUMN holds one
+// of the values, and when most rows do not, splitting every one of them
+// into fields to find out costs most of the run. A row can only hold a
+// value if the value, or the longest part of it the dialect writes as is
+// (between quotes and escapes), occurs somewhere in the row: the prefilter
+// searches the raw block for those needles and only the rows they occur in
+// are split and compared field by field. The rows in between are passed on
+// as whole runs, found by their line breaks alone.
+//
+// The search is the SWAR counterpart of the SIMD first and last byte
+// filter: per eight positions, the bytes matching the first byte of a
+// needle are and-ed with those matching its last byte one needle length
+// further, and only the positions left are compared with the whole needle.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "scanner.h"
+#include "swar.h"
+
+namespace tool {
+// The longest part of value written as is in a field: without the quote
+// and escape characters, which may be written otherwise.
+template <typename Dialect>
+std::string_view verbatim_part(std::string_view value) {
+  if constexpr (!Dialect::quoting) {
+    return value;
+  } else {
+    constexpr char special[]{Dialect::quote, '\\'};
+    const std::string_view specials{
+        special, Dialect::escape == escape_rule::backslash ? 2u : 1u};
+    std::string_view longest;
+    while (!value.empty()) {
+      const auto end{std::min(value.find_first_of(specials), value.size())};
+      if (end > longest.size()) longest = value.substr(0, end);
+      value.remove_prefix(std::min(end + 1, value.size()));
+    }
+    return longest;
+  }
+}
+
+// Finds the first occurrence of any of a few needles.
+class needle_search {
+ public:
+  // needles must not be empty, nor hold an empty needle.
+  explicit needle_search(std::vector<std::string> needles)
+      : needles_{std::move(needles)} {
+    for (const auto& needle : needles_) {
+      firsts_.push_back(swar::broadcast(needle.front()));
+      lasts_.push_back(swar::broadcast(needle.back()));
+      longest_ = std::max(longest_, needle.size());
+    }
+  }
+
+  // The position of the first needle occurring in data at or after from,
+  // or npos.
+  std::size_t find(std::string_view data, std::size_t from) const {
+    auto pos{from};
+    // Far enough from the end to load the last bytes of every needle.
+    for (; pos + longest_ - 1 + swar::WORD_SIZE <= data.size();
+         pos += swar::WORD_SIZE) {
+      auto found{swar::WORD_SIZE};
+      for (std::size_t n{0}; n < needles_.size(); ++n) {
+        const auto& needle{needles_[n]};
+        auto candidates{
+            swar::match(swar::load(data.data() + pos), firsts_[n]) &
+            swar::match(swar::load(data.data() + pos + needle.size() - 1),
+                        lasts_[n])};
+        for (; candidates != 0; candidates = swar::drop_first(candidates)) {
+          const auto i{swar::first(candidates)};
+          if (i >= found) break;
+          if (std::memcmp(data.data() + pos + i, needle.data(),
+                          needle.size()) == 0) {
+            found = i;
+            break;
+          }
+        }
+      }
+      if (found < swar::WORD_SIZE) return pos + found;
+    }
+
+    auto first{std::string_view::npos};
+    for (const auto& needle : needles_) {
+      first = std::min(first, data.find(needle, pos));
+    }
+    return first;
+  }
+
+ private:
+  std::vector<std::string> needles_;
+  std::vector<swar::word> firsts_;
+  std::vector<swar::word> lasts_;
+  std::size_t longest_{0};
+};
+
+template <typename Dialect>
+class row_prefilter {
+ public:
+  explicit row_prefilter(std::vector<std::string> needles)
+      : search_{std::move(needles)} {}
+
+  // Cuts records, a run of whole records, into the records in which a
+  // needle occurs, each passed to candidate(), and the runs of records in
+  // between, passed to others(), in the order of records.
+  template <typename Others, typename Candidate>
+  void split(std::string_view records, Others&& others,
+             Candidate&& candidate) const {
+    std::size_t begin{0};
+    while (begin < records.size()) {
+      const auto found{search_.find(records, begin)};
+      if (found == std::string_view::npos) break;
+
+      // The record holding found: in a dialect without quoting, the lines
+      // around it; otherwise the records are walked up to it.
+      auto start{begin};
+      auto end{std::string_view::npos};
+      if constexpr (!Dialect::quoting) {
+        start = records.rfind('\n', found);
+        start = start == std::string_view::npos || start < begin ? begin
+                                                                 : start + 1;
+        end = records.find('\n', found);
+      } else {
+        while ((end = find_record_end<Dialect>(records, start)) < found) {
+          start = end + 1;
+        }
+      }
+      end = end == std::string_view::npos ? records.size() : end + 1;
+
+      if (start > begin) others(records.substr(begin, start - begin));
+      candidate(records.substr(start, end - start));
+      begin = end;
+    }
+    if (begin < records.size()) others(records.substr(begin));
+  }
+
+ private:
+  needle_search search_;
+};
+}  // namespace tool
@@ -0,0 +1,244 @@
+#pragma once
+
+// Keyed pseudonymization.
+// A value is replaced by a token derived from it with SipHash-2-4 under a
+// secret key: equal values get equal tokens, in every file rewritten with
+// the same key, so the output can still be joined on the column; without the
+// key, tokens can neither be traced back to values nor be computed for
+// guessed values.
+//
+// Values are hashed in batches, PSEUDONYM_LANES at a time, with the state of
+// each lane in its own array element: every step is the same operation on
+// all lanes, which compilers turn into SIMD instructions where the target
+// has them, and into independent instruction streams otherwise. Only the
+// words a value has past the shortest value of its batch are absorbed by
+// its lane alone.
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "swar.h"
+
+namespace tool {
+constexpr std::size_t PSEUDONYM_LANES{4};
+// Rows whose values are hashed together.
+constexpr std::size_t PSEUDONYM_BATCH{64};
+// Hexadecimal digits of a token.
+constexpr std::size_t PSEUDONYM_SIZE{16};
+
+using siphash_key = std::array<std::uint64_t, 2>;
+
+// Parses a key written as 32 hexadecimal digits, the bytes of the key in
+// order, as in the SipHash reference implementation.
+inline bool parse_siphash_key(std::string_view text, siphash_key& key) {
+  if (text.size() != 32) return false;
+  std::uint8_t bytes[16];
+  for (std::size_t i{0}; i < 32; ++i) {
+    const auto c{text[i]};
+    std::uint8_t digit;
+    if (c >= '0' && c <= '9') {
+      digit = static_cast<std::uint8_t>(c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+      digit = static_cast<std::uint8_t>(c - 'a' + 10);
+    } else if (c >= 'A' && c <= 'F') {
+      digit = static_cast<std::uint8_t>(c - 'A' + 10);
+    } else {
+      return false;
+    }
+    bytes[i / 2] = static_cast<std::uint8_t>(i % 2 == 0 ? digit << 4
+                                                        : bytes[i / 2] | digit);
+  }
+  std::memcpy(key.data(), bytes, sizeof bytes);
+  return true;
+}
+
+namespace detail {
+constexpr std::uint64_t rotate_left(std::uint64_t x, int bits) {
+  return (x << bits) | (x >> (64 - bits));
+}
+
+inline void sip_round(std::uint64_t& v0, std::uint64_t& v1, std::uint64_t& v2,
+                      std::uint64_t& v3) {
+  v0 += v1;
+  v1 = rotate_left(v1, 13);
+  v1 ^= v0;
+  v0 = rotate_left(v0, 32);
+  v2 += v3;
+  v3 = rotate_left(v3, 16);
+  v3 ^= v2;
+  v0 += v3;
+  v3 = rotate_left(v3, 21);
+  v3 ^= v0;
+  v2 += v1;
+  v1 = rotate_left(v1, 17);
+  v1 ^= v2;
+  v2 = rotate_left(v2, 32);
+}
+
+// SipHash state for lanes messages.
+template <std::size_t Lanes>
+struct sip_lanes {
+  std::uint64_t v0[Lanes];
+  std::uint64_t v1[Lanes];
+  std::uint64_t v2[Lanes];
+  std::uint64_t v3[Lanes];
+
+  explicit sip_lanes(const siphash_key& key) {
+    for (std::size_t i{0}; i < Lanes; ++i) {
+      v0[i] = key[0] ^ 0x736F6D6570736575;
+      v1[i] = key[1] ^ 0x646F72616E646F6D;
+      v2[i] = key[0] ^ 0x6C7967656E657261;
+      v3[i] = key[1] ^ 0x7465646279746573;
+    }
+  }
+
+  void round() {
+    for (std::size_t i{0}; i < Lanes; ++i) {
+      sip_round(v0[i], v1[i], v2[i], v3[i]);
+    }
+  }
+
+  // Absorbs a message word in each lane.
+  void compress(const std::uint64_t* words) {
+    for (std::size_t i{0}; i < Lanes; ++i) v3[i] ^= words[i];
+    round();
+    round();
+    for (std::size_t i{0}; i < Lanes; ++i) v0[i] ^= words[i];
+  }
+
+  // Absorbs a message word in lane alone.
+  void compress(std::size_t lane, std::uint64_t word) {
+    v3[lane] ^= word;
+    sip_round(v0[lane], v1[lane], v2[lane], v3[lane]);
+    sip_round(v0[lane], v1[lane], v2[lane], v3[lane]);
+    v0[lane] ^= word;
+  }
+
+  void finish(std::uint64_t* hashes) {
+    for (std::size_t i{0}; i < Lanes; ++i) v2[i] ^= 0xFF;
+    round();
+    round();
+    round();
+    round();
+    for (std::size_t i{0}; i < Lanes; ++i) {
+      hashes[i] = v0[i] ^ v1[i] ^ v2[i] ^ v3[i];
+    }
+  }
+};
+
+// The word with the bytes of value past its last whole word, and the length
+// of value in the top byte.
+inline std::uint64_t last_word(std::string_view value) {
+  const auto* bytes{value.data() + value.size() / 8 * 8};
+  const auto left{value.size() % 8};
+  std::uint64_t word{0};
+  if (left >= 4) {
+    // Two loads of four bytes, overlapping when fewer than eight are left.
+    std::uint32_t low;
+    std::uint32_t high;
+    std::memcpy(&low, bytes, sizeof low);
+    std::memcpy(&high, bytes + left - 4, sizeof high);
+    word = low | static_cast<std::uint64_t>(high) << (8 * (left - 4));
+  } else if (left > 0) {
+    // The first, middle and last bytes cover up to three.
+    word = static_cast<std::uint64_t>(static_cast<unsigned char>(bytes[0])) |
+           static_cast<std::uint64_t>(
+               static_cast<unsigned char>(bytes[left / 2]))
+               << (8 * (left / 2)) |
+           static_cast<std::uint64_t>(
+               static_cast<unsigned char>(bytes[left - 1]))
+               << (8 * (left - 1));
+  }
+  return word | (static_cast<std::uint64_t>(value.size()) << 56);
+}
+}  // namespace detail
+
+// SipHash-2-4 of up to PSEUDONYM_LANES values at once. The whole words all
+// the values have are absorbed in every lane at once, then each lane goes
+// on alone with the words of its value past those, and the last words,
+// which every value has, are absorbed at once again.
+inline void siphash_lanes(const siphash_key& key,
+                          const std::string_view* values, std::size_t count,
+                          std::uint64_t* hashes) {
+  constexpr auto lanes{PSEUDONYM_LANES};
+  std::size_t words[lanes]{};
+  auto common{values[0].size() / 8};
+  for (std::size_t i{0}; i < count; ++i) {
+    words[i] = values[i].size() / 8;
+    common = std::min(common, words[i]);
+  }
+
+  // Lanes past count hash nothing, and their hashes are left out.
+  detail::sip_lanes<lanes> state{key};
+  std::uint64_t message[lanes]{};
+  for (std::size_t w{0}; w < common; ++w) {
+    for (std::size_t i{0}; i < count; ++i) {
+      message[i] = swar::load(values[i].data() + 8 * w);
+    }
+    state.compress(message);
+  }
+  for (std::size_t i{0}; i < count; ++i) {
+    for (auto w{common}; w < words[i]; ++w) {
+      state.compress(i, swar::load(values[i].data() + 8 * w));
+    }
+    message[i] = detail::last_word(values[i]);
+  }
+  state.compress(message);
+
+  std::uint64_t result[lanes];
+  state.finish(result);
+  std::copy(result, result + count, hashes);
+}
+
+inline std::uint64_t siphash(const siphash_key& key, std::string_view value) {
+  std::uint64_t hash;
+  siphash_lanes(key, &value, 1, &hash);
+  return hash;
+}
+
+// Hashes values[0, count) into hashes, PSEUDONYM_LANES at a time.
+inline void siphash_batch(const siphash_key& key,
+                          const std::string_view* values, std::size_t count,
+                          std::uint64_t* hashes) {
+  for (std::size_t i{0}; i < count; i += PSEUDONYM_LANES) {
+    siphash_lanes(key, values + i, std::min(PSEUDONYM_LANES, count - i),
+                  hashes + i);
+  }
+}
+
+namespace detail {
+// The eight lowercase hexadecimal digits of the 32 bits of half, most
+// significant first in memory order, eight at a time: the nibbles are
+// spread one per byte, then offset into '0' to '9' or 'a' to 'f'.
+inline std::uint64_t hex_digits(std::uint64_t half) {
+  auto x{(half >> 16) | (half & 0xFFFF) << 32};
+  x = (x >> 8 & 0x000000FF000000FF) | (x & 0x000000FF000000FF) << 16;
+  x = (x >> 4 & 0x000F000F000F000F) | (x & 0x000F000F000F000F) << 8;
+  const auto letters{(x + 0x0606060606060606) >> 4 & swar::ONES};
+  return x + 0x3030303030303030 + letters * ('a' - '0' - 10);
+}
+}  // namespace detail
+
+// Writes the PSEUDONYM_SIZE lowercase hexadecimal digits of hash to out.
+inline void write_pseudonym_digits(char* out, std::uint64_t hash) {
+  const std::uint64_t digits[]{detail::hex_digits(hash >> 32),
+                               detail::hex_digits(hash & 0xFFFFFFFF)};
+  std::memcpy(out, digits, sizeof digits);
+}
+
+// Appends the token for hash to token: prefix, then PSEUDONYM_SIZE
+// lowercase hexadecimal digits.
+template <typename String>
+void append_pseudonym(String& token, std::string_view prefix,
+                      std::uint64_t hash) {
+  char digits[PSEUDONYM_SIZE];
+  write_pseudonym_digits(digits, hash);
+  token += prefix;
+  token.append(digits, PSEUDONYM_SIZE);
+}
+}  // namespace tool
@@ -0,0 +1,252 @@
+#pragma once
+
+// Lazy row ranges.
+// A record_range walks a run of whole records, handing each out as views
+// into the buffer holding them: nothing is copied or allocated. filter,
+// transform and take wrap a range in another, and compose with |:
+//
+//   for (auto& row : records_of<Dialect>(block.records) |
+//                        split_rows<Dialect>(header, &arena) |
+//                        filter(well_formed) | take(10)) {
+//
+// The ranges are pulled from the end of the pipeline: every step of the
+// outermost iterator pulls a single record through all the stages, so the
+// pipeline compiles to one loop with no container between stages. Every
+// range ends with a range_end sentinel, since a run of records does not
+// know how many it holds.
+
+#include <cstddef>
+#include <memory_resource>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "header.h"
+#include "scanner.h"
+#include "tokenizer.h"
+
+namespace tool {
+struct range_end {};
+
+template <typename Dialect>
+class record_range {
+ public:
+  class iterator {
+   public:
+    explicit iterator(std::string_view records) : rest_{records} { ++*this; }
+
+    const record& operator*() const { return current_; }
+
+    iterator& operator++() {
+      done_ = rest_.empty();
+      if (!done_) current_ = next_record<Dialect>(rest_);
+      return *this;
+    }
+
+    bool operator!=(range_end) const { return !done_; }
+
+   private:
+    std::string_view rest_;
+    record current_;
+    bool done_{false};
+  };
+
+  explicit record_range(std::string_view records) : records_{records} {}
+
+  iterator begin() const { return iterator{records_}; }
+  range_end end() const { return {}; }
+
+ private:
+  std::string_view records_;
+};
+
+template <typename Dialect>
+record_range<Dialect> records_of(std::string_view records) {
+  return record_range<Dialect>{records};
+}
+
+template <typename Range, typename Fn>
+class transform_range {
+ public:
+  class iterator {
+   public:
+    using base = decltype(std::declval<const Range&>().begin());
+
+    iterator(base it, const Fn& fn) : it_{std::move(it)}, fn_{&fn} {}
+
+    decltype(auto) operator*() { return (*fn_)(*it_); }
+
+    iterator& operator++() {
+      ++it_;
+      return *this;
+    }
+
+    bool operator!=(range_end end) const { return it_ != end; }
+
+   private:
+    base it_;
+    const Fn* fn_;
+  };
+
+  transform_range(Range range, Fn fn)
+      : range_{std::move(range)}, fn_{std::move(fn)} {}
+
+  iterator begin() const { return {range_.begin(), fn_}; }
+  range_end end() const { return {}; }
+
+ private:
+  Range range_;
+  Fn fn_;
+};
+
+// Keeps the elements pred accepts. An element is computed once, and held
+// by the iterator while it is the current one.
+template <typename Range, typename Pred>
+class filter_range {
+ public:
+  class iterator {
+   public:
+    using base = decltype(std::declval<const Range&>().begin());
+    using value_type = std::decay_t<decltype(*std::declval<base&>())>;
+
+    iterator(base it, const Pred& pred) : it_{std::move(it)}, pred_{&pred} {
+      satisfy();
+    }
+
+    value_type& operator*() { return *current_; }
+
+    iterator& operator++() {
+      ++it_;
+      satisfy();
+      return *this;
+    }
+
+    bool operator!=(range_end) const { return current_.has_value(); }
+
+   private:
+    void satisfy() {
+      for (; it_ != range_end{}; ++it_) {
+        current_.emplace(*it_);
+        if ((*pred_)(*current_)) return;
+      }
+      current_.reset();
+    }
+
+    base it_;
+    const Pred* pred_;
+    std::optional<value_type> current_;
+  };
+
+  filter_range(Range range, Pred pred)
+      : range_{std::move(range)}, pred_{std::move(pred)} {}
+
+  iterator begin() const { return {range_.begin(), pred_}; }
+  range_end end() const { return {}; }
+
+ private:
+  Range range_;
+  Pred pred_;
+};
+
+// The first count elements. The one past them is never pulled.
+template <typename Range>
+class take_range {
+ public:
+  class iterator {
+   public:
+    using base = decltype(std::declval<const Range&>().begin());
+
+    iterator(base it, std::size_t count) : it_{std::move(it)}, left_{count} {}
+
+    decltype(auto) operator*() { return *it_; }
+
+    iterator& operator++() {
+      if (--left_ > 0) ++it_;
+      return *this;
+    }
+
+    bool operator!=(range_end end) const { return left_ > 0 && it_ != end; }
+
+   private:
+    base it_;
+    std::size_t left_;
+  };
+
+  take_range(Range range, std::size_t count)
+      : range_{std::move(range)}, count_{count} {}
+
+  iterator begin() const { return {range_.begin(), count_}; }
+  range_end end() const { return {}; }
+
+ private:
+  Range range_;
+  std::size_t count_;
+};
+
+// The right-hand sides of |.
+template <typename Fn>
+struct transform_adaptor {
+  Fn fn;
+};
+
+template <typename Pred>
+struct filter_adaptor {
+  Pred pred;
+};
+
+struct take_adaptor {
+  std::size_t count;
+};
+
+template <typename Fn>
+transform_adaptor<Fn> transform(Fn fn) {
+  return {std::move(fn)};
+}
+
+template <typename Pred>
+filter_adaptor<Pred> filter(Pred pred) {
+  return {std::move(pred)};
+}
+
+inline take_adaptor take(std::size_t count) { return {count}; }
+
+template <typename Range, typename Fn>
+transform_range<Range, Fn> operator|(Range range,
+                                     transform_adaptor<Fn> adaptor) {
+  return {std::move(range), std::move(adaptor.fn)};
+}
+
+template <typename Range, typename Pred>
+filter_range<Range, Pred> operator|(Range range,
+                                    filter_adaptor<Pred> adaptor) {
+  return {std::move(range), std::move(adaptor.pred)};
+}
+
+template <typename Range>
+take_range<Range> operator|(Range range, take_adaptor adaptor) {
+  return {std::move(range), adaptor.count};
+}
+
+// A record split into fields, the trailing delimiter the header announces
+// left out.
+struct csv_row {
+  // The record as it was in the input.
+  record source;
+  std::string_view line;
+  // Whether the line had a trailing delimiter.
+  bool terminated;
+  tokens fields;
+};
+
+// Splits records into csv_rows, their fields allocated from memory.
+template <typename Dialect>
+auto split_rows(const csv_header& header, std::pmr::memory_resource* memory) {
+  return transform([&header, memory](const record& source) {
+    auto line{source.line};
+    const auto terminated{strip_trailing_delimiter<Dialect>(header, line)};
+    return csv_row{source, line, terminated,
+                   split_line_into_tokens<Dialect>(line, memory)};
+  });
+}
+}  // namespace tool
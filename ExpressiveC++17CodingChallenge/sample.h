@@ -0,0 +1,246 @@
+#pragma once
+
+// Row selection.
+// --head, --tail and --sample rewrite a few rows of the input for a quick
+// look at a big file, and read no more of it than they must.
+//
+// --head N stops reading after the first N rows.
+//
+// --tail N reads the end of the file, in a window twice as large every
+// time it holds fewer than N rows, and rewrites only the last N. The
+// header is still read from the start. A window starting in the middle of
+// the file may start inside a quoted field, where a line break does not
+// end a row: rows are found by parsing forward, as the rewrite does, from
+// the first line break of the window both as if a row started after it
+// and as if a quoted field went on, and only the rows after the point
+// where both parses meet are known to be rows. Past TAIL_MAX_WINDOW the
+// window stops growing, and the file is read forward from the header on,
+// keeping the last N rows only.
+//
+// --sample K keeps a uniform random sample of K rows in a single pass, with
+// Li's algorithm L: rather than drawing a number per row, it draws how
+// many rows to skip before the next one to keep, so the skipped rows are
+// only scanned for their end. The sample is written in input order.
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "io.h"
+#include "scanner.h"
+
+namespace tool {
+// The largest window --tail reads from the end of the file.
+constexpr std::uint64_t TAIL_MAX_WINDOW{16 * INPUT_BLOCK_SIZE};
+
+// The first of records, up to left of them, whose number is taken off
+// left.
+template <typename Dialect>
+std::string_view first_records(std::string_view records, std::size_t& left) {
+  auto rest{records};
+  for (; left > 0 && !rest.empty(); --left) {
+    next_record<Dialect>(rest);
+  }
+  return records.substr(0, records.size() - rest.size());
+}
+
+// The positions in data past the end of each record ending in it, from
+// begin on, but for the one ending data.
+template <typename Dialect>
+void follow_records(std::string_view data, std::size_t begin,
+                    std::vector<std::size_t>& starts) {
+  for (auto end{find_record_end<Dialect>(data, begin)};
+       end != std::string_view::npos && end + 1 < data.size();
+       end = find_record_end<Dialect>(data, end + 1)) {
+    starts.push_back(end + 1);
+  }
+}
+
+// The positions in data, which ends where a record does, where records
+// known to be whole start. When data starts a record, at_record, those are
+// all of its records. Otherwise the first line break of data either ends a
+// record or is inside a quoted field, and the records are only known from
+// where the parses following from both cases meet.
+template <typename Dialect>
+std::vector<std::size_t> record_starts(std::string_view data,
+                                       bool at_record) {
+  std::vector<std::size_t> starts;
+  if (at_record) {
+    starts.push_back(0);
+    follow_records<Dialect>(data, 0, starts);
+    return starts;
+  }
+  const auto first{data.find('\n')};
+  if (first == std::string_view::npos || first + 1 == data.size()) {
+    return starts;
+  }
+  starts.push_back(first + 1);
+  follow_records<Dialect>(data, first + 1, starts);
+  if constexpr (!Dialect::quoting) {
+    return starts;
+  } else {
+    // The line break as if inside a quoted field: the field ends at the
+    // next quote closing it, and the record at the end of the field or of
+    // a field after it.
+    auto end{find_closing_quote<Dialect>(data, first)};
+    // With no quote to close it, no quoted field went on.
+    if (end == std::string_view::npos) return starts;
+    while (end < data.size() && data[end] != Dialect::delimiter &&
+           data[end] != '\n') {
+      ++end;
+    }
+    if (end < data.size() && data[end] == Dialect::delimiter) {
+      end = find_record_end<Dialect>(data, end + 1);
+    }
+    // Records known whole past where the parses meet, none if they do not.
+    auto known{starts.begin()};
+    while (end != std::string_view::npos && end + 1 < data.size()) {
+      known = std::lower_bound(known, starts.end(), end + 1);
+      if (known == starts.end()) break;
+      if (*known == end + 1) {
+        starts.erase(starts.begin(), known);
+        return starts;
+      }
+      end = find_record_end<Dialect>(data, end + 1);
+    }
+    starts.clear();
+    return starts;
+  }
+}
+
+// The last count records of file, those starting at or after begin, read
+// forward from begin keeping count records at most.
+template <typename Dialect>
+std::string last_records_forward(file_handle& file, std::uint64_t begin,
+                                 std::size_t count) {
+  std::deque<std::string> kept;
+  const auto keep{[&](std::string_view record) {
+    kept.emplace_back(record);
+    if (kept.size() > count) kept.pop_front();
+  }};
+  std::string data;
+  for (auto offset{begin};;) {
+    const auto kept_bytes{data.size()};
+    data.resize(kept_bytes + INPUT_BLOCK_SIZE);
+    const auto n{file.read_at(data.data() + kept_bytes, INPUT_BLOCK_SIZE,
+                              offset)};
+    data.resize(kept_bytes + n);
+    if (n == 0) break;
+    offset += n;
+    std::size_t record{0};
+    for (auto end{find_record_end<Dialect>(data, 0)};
+         end != std::string_view::npos;
+         end = find_record_end<Dialect>(data, record)) {
+      keep(std::string_view{data}.substr(record, end + 1 - record));
+      record = end + 1;
+    }
+    data.erase(0, record);
+  }
+  if (!data.empty()) keep(data);
+
+  std::string records;
+  for (const auto& record : kept) records += record;
+  return records;
+}
+
+// The last count records of file, those starting at or after begin, read
+// backwards from its end.
+template <typename Dialect>
+std::string last_records(file_handle& file, std::uint64_t begin,
+                         std::size_t count) {
+  const auto size{file.size()};
+  if (count == 0 || size <= begin) return {};
+
+  // The window read grows until it holds count records known to be whole,
+  // or reaches begin.
+  std::uint64_t window{INPUT_BLOCK_SIZE};
+  while (true) {
+    const auto start{size - std::min(window, size - begin)};
+    std::string tail(static_cast<std::size_t>(size - start), '\0');
+    tail.resize(file.read_at(tail.data(), tail.size(), start));
+    if (tail.empty()) return {};
+    const auto starts{record_starts<Dialect>(tail, start == begin)};
+    if (starts.size() >= count || start == begin) {
+      if (starts.size() >= count) {
+        tail.erase(0, starts[starts.size() - count]);
+      }
+      return tail;
+    }
+    if (window >= TAIL_MAX_WINDOW) {
+      return last_records_forward<Dialect>(file, begin, count);
+    }
+    window *= 2;
+  }
+}
+
+// A uniform random sample of the records added to it.
+template <typename Dialect>
+class record_sample {
+ public:
+  record_sample(std::size_t size, std::uint64_t seed)
+      : size_{size}, random_{seed} {
+    kept_.reserve(size);
+  }
+
+  void add(std::string_view records) {
+    while (!records.empty() && size_ > 0) {
+      const auto rest{records};
+      next_record<Dialect>(records);
+      if (seen_ == next_) {
+        keep(rest.substr(0, rest.size() - records.size()));
+      }
+      ++seen_;
+    }
+  }
+
+  // The records kept, in the order they were added.
+  std::string records() {
+    std::sort(kept_.begin(), kept_.end());
+    std::string records;
+    for (const auto& [index, text] : kept_) records += text;
+    return records;
+  }
+
+ private:
+  void keep(std::string_view text) {
+    if (kept_.size() < size_) {
+      kept_.emplace_back(seen_, text);
+      if (kept_.size() < size_) {
+        ++next_;
+        return;
+      }
+      weight_ = std::exp(std::log(uniform()) / size_);
+    } else {
+      std::uniform_int_distribution<std::size_t> slot{0, size_ - 1};
+      kept_[slot(random_)] = {seen_, std::string{text}};
+      weight_ *= std::exp(std::log(uniform()) / size_);
+    }
+    skip();
+  }
+
+  // Sets next_ past the records not kept after the current one.
+  void skip() {
+    const auto skipped{std::floor(std::log(uniform()) /
+                                  std::log1p(-weight_))};
+    next_ = seen_ + 1 + static_cast<std::uint64_t>(std::min(skipped, 1e18));
+  }
+
+  // In (0, 1].
+  double uniform() { return 1.0 - (random_() >> 11) * 0x1p-53; }
+
+  std::size_t size_;
+  std::mt19937_64 random_;
+  std::vector<std::pair<std::uint64_t, std::string>> kept_;
+  std::uint64_t seen_{0};
+  // The index of the next record to keep.
+  std::uint64_t next_{0};
+  double weight_{0};
+};
+}  // namespace tool
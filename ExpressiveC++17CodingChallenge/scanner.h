@@ -0,0 +1,261 @@
+#pragma once
+
+// Block scanner.
+// The input is read in large blocks that are cut on a record boundary, and
+// records are cut out of a block without copying. Line endings and the
+// UTF-8 byte order mark are dealt with here, while looking for the end of a
+// record, so neither costs a second pass over the line: a record knows the
+// terminator it had in the input and the rewrite writes it back unchanged.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "buffer.h"
+#include "dialect.h"
+#include "io.h"
+#include "tokenizer.h"
+
+namespace tool {
+constexpr std::size_t INPUT_BLOCK_SIZE{1 << 20};
+constexpr std::size_t CARRY_SIZE{64 * 1024};
+constexpr std::string_view UTF8_BOM{"\xEF\xBB\xBF"};
+constexpr std::string_view LF{"\n"};
+constexpr std::string_view CRLF{"\r\n"};
+
+struct record {
+  // Without its terminator.
+  std::string_view line;
+  // LF, CRLF, or empty for a last line with no terminator.
+  std::string_view ending;
+};
+
+// Returns the position of the '\n' ending the record starting at begin,
+// skipping the ones inside quoted fields, or npos when data ends first.
+template <typename Dialect>
+std::size_t find_record_end(std::string_view data, std::size_t begin) {
+  const auto newline{data.find('\n', begin)};
+  if constexpr (Dialect::quoting) {
+    // Only up to the newline: on quote-free data a search to the end would
+    // go over the rest of the block for every record.
+    const auto line{data.substr(
+        begin, newline == std::string_view::npos ? newline : newline - begin)};
+    if (line.find(Dialect::quote) != std::string_view::npos) {
+      // Walk the fields so that only quotes opening a field count, exactly
+      // as in find_field_end().
+      auto pos{begin};
+      while (true) {
+        if (pos < data.size() && data[pos] == Dialect::quote) {
+          pos = find_closing_quote<Dialect>(data, pos);
+          if (pos == std::string_view::npos) return pos;
+        }
+        while (pos < data.size() && data[pos] != Dialect::delimiter &&
+               data[pos] != '\n') {
+          ++pos;
+        }
+        if (pos == data.size()) return std::string_view::npos;
+        if (data[pos] == '\n') return pos;
+        ++pos;
+      }
+    }
+  }
+  return newline;
+}
+
+// Removes the first record from records, which must not be empty. Without
+// a final '\n', everything left is the record.
+template <typename Dialect>
+record next_record(std::string_view& records) {
+  const auto end{find_record_end<Dialect>(records, 0)};
+  if (end == std::string_view::npos) {
+    const record last{records, {}};
+    records = {};
+    return last;
+  }
+
+  record result{records.substr(0, end), LF};
+  if (!result.line.empty() && result.line.back() == '\r') {
+    result.line.remove_suffix(1);
+    result.ending = CRLF;
+  }
+  records.remove_prefix(end + 1);
+  return result;
+}
+
+// The position just past the last complete record of data, 0 if none.
+template <typename Dialect>
+std::size_t last_record_boundary(std::string_view data) {
+  if constexpr (!Dialect::quoting) {
+    // npos + 1 wraps around to 0.
+    return data.rfind('\n') + 1;
+  } else {
+    std::size_t boundary{0};
+    for (auto end{find_record_end<Dialect>(data, 0)};
+         end != std::string_view::npos;
+         end = find_record_end<Dialect>(data, boundary)) {
+      boundary = end + 1;
+    }
+    return boundary;
+  }
+}
+
+// A run of whole records and the buffer holding them. The buffer goes back
+// to the reader with recycle() once the records have been processed.
+struct input_block {
+  aligned_buffer buffer;
+  std::string_view records;
+};
+
+template <typename Dialect>
+class block_reader {
+ public:
+  block_reader(file_handle& file, io_backend backend,
+               std::size_t block_size = INPUT_BLOCK_SIZE)
+      : file_size_{file.size()},
+        block_size_{block_size},
+        queue_{make_io_queue(file, backend, IO_QUEUE_DEPTH)} {
+    read_ahead();
+  }
+
+  // The byte order mark the input started with, if any. It is not part of
+  // the first record.
+  std::string_view bom() const { return bom_; }
+
+  // The errno of the first read that failed, 0 if none did. The blocks
+  // stop at a failed read, as they would at the end of the input.
+  int error() const { return error_; }
+
+  // Moves the next run of whole records into block. False at the end of the
+  // input.
+  //
+  // Blocks are read ahead and handed over without copying. Only a record
+  // cut in two by the end of a read is copied, into a block of its own.
+  bool next_block(input_block& block) {
+    while (!data_.empty() || fetch()) {
+      if (carry_.size() > 0) {
+        if (complete_carry()) {
+          block.records = carry_.view();
+          block.buffer = std::move(carry_);
+          carry_ = std::move(spare_carry_);
+          return true;
+        }
+        continue;
+      }
+
+      const auto boundary{last_record_boundary<Dialect>(data_)};
+      const auto records{data_.substr(0, boundary)};
+      append_to_carry(data_.substr(boundary));
+      data_ = {};
+      if (!records.empty()) {
+        block.records = records;
+        block.buffer = std::move(current_);
+        return true;
+      }
+    }
+
+    // Whatever is left is a last record with no terminator.
+    if (carry_.size() > 0) {
+      block.records = carry_.view();
+      block.buffer = std::move(carry_);
+      return true;
+    }
+    return false;
+  }
+
+  // Gives back the buffer of a block returned by next_block().
+  void recycle(aligned_buffer buffer) {
+    buffer.resize(0);
+    if (buffer.capacity() == block_size_) {
+      free_.push_back(std::move(buffer));
+    } else if (buffer.capacity() > spare_carry_.capacity()) {
+      spare_carry_ = std::move(buffer);
+    }
+  }
+
+ private:
+  // Keeps IO_QUEUE_DEPTH reads in flight.
+  void read_ahead() {
+    while (queue_->in_flight() < IO_QUEUE_DEPTH && next_offset_ < file_size_) {
+      aligned_buffer buffer;
+      if (free_.empty()) {
+        buffer = aligned_buffer{block_size_};
+      } else {
+        buffer = std::move(free_.back());
+        free_.pop_back();
+      }
+
+      const auto length{static_cast<std::size_t>(
+          std::min<std::uint64_t>(block_size_, file_size_ - next_offset_))};
+      queue_->read(std::move(buffer), next_offset_, length);
+      next_offset_ += length;
+    }
+  }
+
+  // Makes the oldest read the current buffer.
+  bool fetch() {
+    if (current_.capacity() != 0) {
+      recycle(std::move(current_));
+    }
+    if (queue_->in_flight() == 0 || error_ != 0) {
+      return false;
+    }
+
+    auto request{queue_->wait()};
+    current_ = std::move(request.buffer);
+    error_ = request.error;
+    read_ahead();
+    data_ = current_.view();
+    if (at_start_) {
+      at_start_ = false;
+      if (data_.substr(0, UTF8_BOM.size()) == UTF8_BOM) {
+        bom_ = UTF8_BOM;
+        data_.remove_prefix(UTF8_BOM.size());
+      }
+    }
+    return !data_.empty();
+  }
+
+  // Moves data_ into the carried record up to its next '\n', and tells
+  // whether that completed the record.
+  bool complete_carry() {
+    const auto newline{data_.find('\n')};
+    const auto n{newline == std::string_view::npos ? data_.size()
+                                                    : newline + 1};
+    append_to_carry(data_.substr(0, n));
+    data_.remove_prefix(n);
+    return newline != std::string_view::npos &&
+           find_record_end<Dialect>(carry_.view(), 0) !=
+               std::string_view::npos;
+  }
+
+  void append_to_carry(std::string_view data) {
+    if (data.empty()) return;
+    if (carry_.available() < data.size()) {
+      aligned_buffer grown{
+          std::max({carry_.capacity() * 2, carry_.size() + data.size(),
+                    CARRY_SIZE})};
+      std::copy(carry_.view().begin(), carry_.view().end(), grown.data());
+      grown.resize(carry_.size());
+      carry_ = std::move(grown);
+    }
+    std::copy(data.begin(), data.end(), carry_.data() + carry_.size());
+    carry_.resize(carry_.size() + data.size());
+  }
+
+  std::uint64_t file_size_;
+  std::size_t block_size_;
+  std::unique_ptr<io_queue> queue_;
+  std::uint64_t next_offset_{0};
+  std::vector<aligned_buffer> free_;
+  aligned_buffer current_;
+  std::string_view data_;
+  aligned_buffer carry_;
+  aligned_buffer spare_carry_;
+  bool at_start_{true};
+  std::string_view bom_;
+  int error_{0};
+};
+}  // namespace tool
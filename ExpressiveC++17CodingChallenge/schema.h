@@ -0,0 +1,219 @@
+#pragma once
+
+// Column types.
+// The type of a column is the narrowest of integer, real, date and text that
+// every non-empty value in a sample of its rows parses as. Values are parsed
+// with std::from_chars straight from the input buffer, quotes aside, so that
+// typed reads allocate nothing; every feature reading numbers goes through
+// the parsers here, and so agrees on what a number is.
+
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "header.h"
+#include "rows.h"
+#include "scanner.h"
+#include "tokenizer.h"
+
+namespace tool {
+// Rows read to infer the types of the columns.
+constexpr std::uint64_t SCHEMA_SAMPLE_ROWS{10000};
+
+enum class column_type {
+  // Only empty values so far: any type fits.
+  empty,
+  integer,
+  real,
+  // An ISO 8601 calendar date, YYYY-MM-DD.
+  date,
+  text
+};
+
+inline const char* column_type_name(column_type type) {
+  switch (type) {
+    case column_type::empty:
+      return "empty";
+    case column_type::integer:
+      return "integer";
+    case column_type::real:
+      return "real";
+    case column_type::date:
+      return "date";
+    default:
+      return "text";
+  }
+}
+
+struct civil_date {
+  std::int32_t year;
+  unsigned month;
+  unsigned day;
+
+  // Days since 1970-01-01, in the proleptic Gregorian calendar.
+  std::int64_t days() const {
+    const std::int64_t y{month <= 2 ? year - 1 : year};
+    const auto era{(y >= 0 ? y : y - 399) / 400};
+    const auto year_of_era{y - era * 400};
+    const std::int64_t march_month{month > 2 ? month - 3 : month + 9};
+    const auto day_of_year{(153 * march_month + 2) / 5 + day - 1};
+    const auto day_of_era{year_of_era * 365 + year_of_era / 4 -
+                          year_of_era / 100 + day_of_year};
+    return era * 146097 + day_of_era - 719468;
+  }
+};
+
+namespace detail {
+template <typename Number>
+bool parse_whole(std::string_view text, Number& number) {
+  const auto last{text.data() + text.size()};
+  const auto [end, error]{std::from_chars(text.data(), last, number)};
+  return error == std::errc{} && end == last;
+}
+
+constexpr bool is_leap_year(std::int32_t year) {
+  return year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+}
+}  // namespace detail
+
+// The parsers take the whole of text or fail; none accepts spaces or a
+// leading '+'.
+inline bool parse_value(std::string_view text, std::int64_t& number) {
+  return !text.empty() && detail::parse_whole(text, number);
+}
+
+// NaN is not a number here: it would not order or sum.
+inline bool parse_value(std::string_view text, double& number) {
+  return !text.empty() && detail::parse_whole(text, number) &&
+         !std::isnan(number);
+}
+
+inline bool parse_value(std::string_view text, civil_date& date) {
+  if (text.size() != 10 || text[4] != '-' || text[7] != '-') return false;
+  for (const auto i : {0, 1, 2, 3, 5, 6, 8, 9}) {
+    if (text[i] < '0' || text[i] > '9') return false;
+  }
+  detail::parse_whole(text.substr(0, 4), date.year);
+  detail::parse_whole(text.substr(5, 2), date.month);
+  detail::parse_whole(text.substr(8, 2), date.day);
+
+  constexpr unsigned month_days[]{31, 28, 31, 30, 31, 30,
+                                  31, 31, 30, 31, 30, 31};
+  if (date.month < 1 || date.month > 12 || date.day < 1) return false;
+  const auto days{month_days[date.month - 1] +
+                  (date.month == 2 && detail::is_leap_year(date.year))};
+  return date.day <= days;
+}
+
+// A field without its surrounding quotes. Escapes are left in place: no
+// number or date has any, so a value with one is text either way.
+template <typename Dialect>
+std::string_view bare_value(std::string_view field) {
+  if constexpr (Dialect::quoting) {
+    if (field.size() >= 2 && field.front() == Dialect::quote &&
+        field.back() == Dialect::quote) {
+      return field.substr(1, field.size() - 2);
+    }
+  }
+  return field;
+}
+
+// The value of field as a T, if it is one.
+template <typename Dialect, typename T>
+std::optional<T> field_as(std::string_view field) {
+  T value;
+  if (!parse_value(bare_value<Dialect>(field), value)) return std::nullopt;
+  return value;
+}
+
+// Reads one column of split rows as T: std::int64_t, double or civil_date.
+template <typename Dialect, typename T>
+class typed_column {
+ public:
+  explicit typed_column(std::size_t index) : index_{index} {}
+
+  std::optional<T> operator()(const tokens& fields) const {
+    return field_as<Dialect, T>(fields[index_]);
+  }
+
+ private:
+  std::size_t index_;
+};
+
+// The narrowest type of value.
+inline column_type detect_type(std::string_view value) {
+  if (value.empty()) return column_type::empty;
+  if (std::int64_t integer; parse_value(value, integer)) {
+    return column_type::integer;
+  }
+  if (double real; parse_value(value, real)) return column_type::real;
+  if (civil_date date; parse_value(value, date)) return column_type::date;
+  return column_type::text;
+}
+
+// The narrowest type holding both a and b: integers widen to reals, any
+// other mix to text.
+inline column_type widen(column_type a, column_type b) {
+  if (a == column_type::empty || a == b) return b;
+  if (b == column_type::empty) return a;
+  const auto numeric{[](column_type type) {
+    return type == column_type::integer || type == column_type::real;
+  }};
+  if (numeric(a) && numeric(b)) return column_type::real;
+  return column_type::text;
+}
+
+struct csv_schema {
+  std::vector<column_type> types;
+  // Per column, the empty values in the sample.
+  std::vector<std::uint64_t> empty_values;
+  // The rows sampled.
+  std::uint64_t rows{0};
+};
+
+// Widens the types of schema with the rows of records, until it has seen
+// SCHEMA_SAMPLE_ROWS rows. Rows with the wrong number of fields are left
+// out, as the rewrite skips them.
+template <typename Dialect>
+void infer_schema(std::string_view records, const csv_header& header,
+                  csv_schema& schema) {
+  const auto columns{header.number_of_columns()};
+  schema.types.resize(columns, column_type::empty);
+  schema.empty_values.resize(columns, 0);
+
+  const auto lines{transform([&header](const record& record) {
+    auto line{record.line};
+    strip_trailing_delimiter<Dialect>(header, line);
+    return line;
+  })};
+  const auto complete{[columns](std::string_view line) {
+    return count_fields<Dialect>(line) == columns;
+  }};
+  for (const auto line : records_of<Dialect>(records) | lines |
+                             filter(complete) |
+                             take(SCHEMA_SAMPLE_ROWS - schema.rows)) {
+    ++schema.rows;
+    std::size_t begin{0};
+    for (std::size_t column{0}; column < columns; ++column) {
+      const auto end{find_field_end<Dialect>(line, begin)};
+      auto& type{schema.types[column]};
+      const auto value{bare_value<Dialect>(line.substr(begin, end - begin))};
+      if (value.empty()) {
+        ++schema.empty_values[column];
+      } else if (type != column_type::text) {
+        type = widen(type, detect_type(value));
+      }
+      begin = end + 1;
+    }
+  }
+}
+
+inline bool schema_complete(const csv_schema& schema) {
+  return schema.rows >= SCHEMA_SAMPLE_ROWS;
+}
+}  // namespace tool
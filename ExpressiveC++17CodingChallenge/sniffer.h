@@ -0,0 +1,121 @@
+#pragma once
+
+// Dialect sniffing.
+// Only a bounded prefix of the input is looked at, so the cost does not
+// depend on the size of the file. Every candidate delimiter and quoting rule
+// splits the lines of that prefix, and the candidate giving the most lines
+// with the same number of fields wins.
+
+#include <algorithm>
+#include <cstddef>
+#include <istream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dialect.h"
+#include "tokenizer.h"
+
+namespace tool {
+constexpr std::size_t SNIFF_BYTES{64 * 1024};
+
+// Reads at most max_bytes from the beginning of input and rewinds it.
+// complete is set when the whole input fits in the sample.
+inline std::string read_sample(std::istream& input, std::size_t max_bytes,
+                               bool& complete) {
+  std::string sample(max_bytes, '\0');
+  input.read(sample.data(), static_cast<std::streamsize>(max_bytes));
+  sample.resize(static_cast<std::size_t>(input.gcount()));
+  complete = sample.size() < max_bytes;
+
+  input.clear();
+  input.seekg(0);
+  return sample;
+}
+
+namespace detail {
+// The lines of the sample, without their line ending. A last line cut by
+// the sample boundary is left out.
+inline std::vector<std::string_view> sample_lines(std::string_view sample,
+                                                  bool complete,
+                                                  bool& crlf) {
+  std::vector<std::string_view> lines;
+  std::size_t crlf_lines{0};
+  std::size_t begin{0};
+  while (begin < sample.size()) {
+    auto end{sample.find('\n', begin)};
+    if (end == std::string_view::npos) {
+      if (!complete) break;
+      end = sample.size();
+    }
+
+    auto line{sample.substr(begin, end - begin)};
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+      ++crlf_lines;
+    }
+    if (!line.empty()) {
+      lines.push_back(line);
+    }
+    begin = end + 1;
+  }
+
+  crlf = !lines.empty() && crlf_lines * 2 > lines.size();
+  return lines;
+}
+
+struct candidate_score {
+  std::size_t consistent_lines{0};
+  std::size_t number_of_columns{0};
+
+  bool operator>(const candidate_score& other) const {
+    if (consistent_lines != other.consistent_lines) {
+      return consistent_lines > other.consistent_lines;
+    }
+    return number_of_columns > other.number_of_columns;
+  }
+};
+
+template <typename Dialect>
+candidate_score score_candidate(const std::vector<std::string_view>& lines) {
+  std::map<std::size_t, std::size_t> lines_per_count;
+  for (const auto& line : lines) {
+    ++lines_per_count[count_fields<Dialect>(line)];
+  }
+
+  candidate_score best;
+  for (const auto& [count, number_of_lines] : lines_per_count) {
+    // A single column is what every wrong delimiter produces.
+    if (count < 2) continue;
+    const candidate_score score{number_of_lines, count};
+    if (score > best) best = score;
+  }
+  return best;
+}
+}  // namespace detail
+
+// Picks among the given delimiters and escape rules, in order of preference
+// when scores are tied. The line ending is the one used by most lines.
+inline dialect_config sniff_dialect(std::string_view sample, bool complete,
+                                    const std::vector<char>& delimiters,
+                                    const std::vector<escape_rule>& escapes) {
+  dialect_config best{delimiters.front(), escapes.front(), false};
+  const auto lines{detail::sample_lines(sample, complete, best.crlf)};
+
+  detail::candidate_score best_score;
+  for (const auto delimiter : delimiters) {
+    for (const auto escape : escapes) {
+      const dialect_config candidate{delimiter, escape, best.crlf};
+      const auto score{dispatch_dialect(candidate, [&](auto dialect) {
+        return detail::score_candidate<decltype(dialect)>(lines);
+      })};
+      if (score > best_score) {
+        best_score = score;
+        best = candidate;
+      }
+    }
+  }
+  return best;
+}
+}  // namespace tool
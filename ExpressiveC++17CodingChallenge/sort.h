@@ -0,0 +1,452 @@
+#pragma once
+
+// External merge sort of records by key.
+// Records are gathered in memory up to a budget, sorted there by several
+// threads, and spilled to a temporary file as a sorted run whenever the
+// budget is reached. The runs are then merged through a loser tree, in
+// several passes when there are more than MERGE_FAN_IN of them. Records with
+// equal keys keep their input order: the sort in memory is stable, and the
+// merge breaks ties in favour of the earlier run.
+//
+// A run that cannot be written whole, or read back whole, fails the sort:
+// the sorter keeps the first error and finish() tells of it.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "io.h"
+#include "output.h"
+#include "schema.h"
+
+namespace tool {
+constexpr std::size_t SORT_MEMORY_BUDGET{std::size_t{256} << 20};
+constexpr std::size_t MERGE_FAN_IN{64};
+constexpr std::size_t MIN_RUN_BUFFER_SIZE{64 * 1024};
+// Below this many records a single thread sorts faster than it starts others.
+constexpr std::size_t PARALLEL_SORT_THRESHOLD{1 << 16};
+
+enum class key_type { lexicographic, numeric };
+
+struct sort_key {
+  std::string_view text;
+  double number{0};
+  bool is_number{false};
+};
+
+inline sort_key make_sort_key(std::string_view text, key_type type) {
+  sort_key key{text};
+  if (type == key_type::numeric) {
+    key.is_number = parse_value(text, key.number);
+  }
+  return key;
+}
+
+// Numbers come first, in numeric order, then everything else in byte order.
+// Lexicographic keys are never numbers.
+inline bool key_less(const sort_key& a, const sort_key& b) {
+  if (a.is_number != b.is_number) return a.is_number;
+  if (a.is_number) return a.number < b.number;
+  return a.text < b.text;
+}
+
+// Sorts part of items on each thread, then merges neighbouring parts, the
+// merges of a level in parallel too.
+template <typename T, typename Less>
+void parallel_stable_sort(std::vector<T>& items, Less less) {
+  const std::size_t parts{std::max(1u, std::thread::hardware_concurrency())};
+  if (parts == 1 || items.size() < PARALLEL_SORT_THRESHOLD) {
+    std::stable_sort(items.begin(), items.end(), less);
+    return;
+  }
+
+  std::vector<typename std::vector<T>::iterator> bounds;
+  for (std::size_t i{0}; i <= parts; ++i) {
+    bounds.push_back(items.begin() + static_cast<std::ptrdiff_t>(
+                                         i * items.size() / parts));
+  }
+
+  std::vector<std::thread> threads;
+  for (std::size_t i{0}; i < parts; ++i) {
+    threads.emplace_back(
+        [&, i] { std::stable_sort(bounds[i], bounds[i + 1], less); });
+  }
+  for (auto& thread : threads) thread.join();
+
+  for (std::size_t width{1}; width < parts; width *= 2) {
+    threads.clear();
+    for (std::size_t i{0}; i + width < parts; i += 2 * width) {
+      threads.emplace_back([&, i] {
+        std::inplace_merge(bounds[i], bounds[i + width],
+                           bounds[std::min(i + 2 * width, parts)], less);
+      });
+    }
+    for (auto& thread : threads) thread.join();
+  }
+}
+
+// A sorted run on disk. Each record is stored with its key in front:
+// [key length][record length][key][record], the lengths as native 32 bit
+// integers, since the file never outlives the sort.
+class run_reader {
+ public:
+  run_reader(const std::string& filename, key_type type,
+             std::size_t buffer_size)
+      : file_{file_handle::open_read(filename)},
+        type_{type},
+        buffer_(std::max(buffer_size, MIN_RUN_BUFFER_SIZE)) {
+    if (!file_.is_open()) {
+      error_ = errno;
+      done_ = true;
+      return;
+    }
+    next();
+  }
+
+  bool done() const { return done_; }
+  // The errno of a read that failed, or EIO for a run cut short, 0 if none
+  // did. A run that failed is done.
+  int error() const { return error_; }
+  const sort_key& key() const { return key_; }
+  std::string_view record() const { return record_; }
+
+  // Moves on to the next record; the previous key and record are no longer
+  // valid afterwards.
+  void next() {
+    std::uint32_t lengths[2];
+    if (!fill(sizeof lengths)) {
+      // Only a run ending between two records is whole.
+      if (end_ > begin_) fail(EIO);
+      done_ = true;
+      return;
+    }
+    std::memcpy(lengths, buffer_.data() + begin_, sizeof lengths);
+    begin_ += sizeof lengths;
+    if (!fill(std::size_t{lengths[0]} + lengths[1])) {
+      fail(EIO);
+      done_ = true;
+      return;
+    }
+
+    const auto data{buffer_.data() + begin_};
+    key_ = make_sort_key({data, lengths[0]}, type_);
+    record_ = {data + lengths[0], lengths[1]};
+    begin_ += std::size_t{lengths[0]} + lengths[1];
+  }
+
+ private:
+  // Makes sure the buffer holds needed bytes from begin_, and tells whether
+  // the run had them.
+  bool fill(std::size_t needed) {
+    if (end_ - begin_ >= needed) return true;
+
+    std::copy(buffer_.begin() + static_cast<std::ptrdiff_t>(begin_),
+              buffer_.begin() + static_cast<std::ptrdiff_t>(end_),
+              buffer_.begin());
+    end_ -= begin_;
+    begin_ = 0;
+    if (buffer_.size() < needed) {
+      buffer_.resize(needed);
+    }
+    const auto n{file_.read_at(buffer_.data() + end_, buffer_.size() - end_,
+                               offset_)};
+    if (n < buffer_.size() - end_ && errno != 0) fail(errno);
+    offset_ += n;
+    end_ += n;
+    return end_ >= needed;
+  }
+
+  void fail(int error) {
+    if (error_ == 0) error_ = error;
+  }
+
+  file_handle file_;
+  std::uint64_t offset_{0};
+  key_type type_;
+  std::vector<char> buffer_;
+  std::size_t begin_{0};
+  std::size_t end_{0};
+  bool done_{false};
+  int error_{0};
+  sort_key key_;
+  std::string_view record_;
+};
+
+// Tournament over sorted runs. Each inner node keeps the loser of the match
+// played there and the overall winner is kept apart, so that replacing the
+// winner replays only the matches on the path from its leaf to the root:
+// log2(k) comparisons, where a heap needs up to twice as many.
+class loser_tree {
+ public:
+  static constexpr std::size_t NONE{static_cast<std::size_t>(-1)};
+
+  explicit loser_tree(std::vector<run_reader>& runs)
+      : runs_{runs}, tree_(std::max<std::size_t>(runs.size(), 1), NONE) {
+    if (!runs_.empty()) {
+      tree_[0] = build(1);
+    }
+  }
+
+  // The run holding the next record, or NONE once all are exhausted.
+  std::size_t winner() const {
+    return tree_[0] == NONE || runs_[tree_[0]].done() ? NONE : tree_[0];
+  }
+
+  // Advances the winning run and replays its matches.
+  void pop() {
+    auto winner{tree_[0]};
+    runs_[winner].next();
+    for (auto node{(winner + runs_.size()) / 2}; node > 0; node /= 2) {
+      if (beats(tree_[node], winner)) {
+        std::swap(tree_[node], winner);
+      }
+    }
+    tree_[0] = winner;
+  }
+
+ private:
+  // Nodes 1 to k - 1 are inner nodes, k to 2k - 1 the leaves for the runs.
+  std::size_t build(std::size_t node) {
+    if (node >= runs_.size()) {
+      return node - runs_.size();
+    }
+    const auto left{build(2 * node)};
+    const auto right{build(2 * node + 1)};
+    if (beats(right, left)) {
+      tree_[node] = left;
+      return right;
+    }
+    tree_[node] = right;
+    return left;
+  }
+
+  bool beats(std::size_t a, std::size_t b) const {
+    if (runs_[a].done()) return false;
+    if (runs_[b].done()) return true;
+    if (key_less(runs_[a].key(), runs_[b].key())) return true;
+    if (key_less(runs_[b].key(), runs_[a].key())) return false;
+    return a < b;
+  }
+
+  std::vector<run_reader>& runs_;
+  std::vector<std::size_t> tree_;
+};
+
+// Names temporary files in a directory, and removes the ones still there
+// when destroyed.
+class temp_files {
+ public:
+  temp_files(const std::string& directory, std::string_view purpose) {
+    std::random_device random;
+    prefix_ = directory + "/tool-" + std::string{purpose} + "-" +
+              std::to_string(random()) + "-";
+  }
+
+  temp_files(const temp_files&) = delete;
+  temp_files& operator=(const temp_files&) = delete;
+
+  ~temp_files() {
+    for (const auto& name : names_) {
+      std::remove(name.c_str());
+    }
+  }
+
+  std::string create() {
+    names_.push_back(prefix_ + std::to_string(names_.size() + removed_));
+    return names_.back();
+  }
+
+  void remove(const std::string& name) {
+    std::remove(name.c_str());
+    names_.erase(std::find(names_.begin(), names_.end(), name));
+    ++removed_;
+  }
+
+ private:
+  std::string prefix_;
+  std::vector<std::string> names_;
+  std::size_t removed_{0};
+};
+
+inline void write_run_record(output_file& run, std::string_view key,
+                             std::string_view record) {
+  const std::uint32_t lengths[2]{static_cast<std::uint32_t>(key.size()),
+                                 static_cast<std::uint32_t>(record.size())};
+  run.write({reinterpret_cast<const char*>(lengths), sizeof lengths});
+  run << key << record;
+}
+
+// Calls sink with the key and the record of every record of the runs, in key
+// order, reading them through memory bytes of buffers. Ties go to the
+// earlier run. Returns 0, or the error of a run that could not be read
+// whole, in which case sink was not given all the records.
+template <typename Sink>
+int merge_runs(const std::vector<std::string>& runs, key_type type,
+                std::size_t memory, Sink&& sink) {
+  std::vector<run_reader> readers;
+  readers.reserve(runs.size());
+  for (const auto& name : runs) {
+    readers.emplace_back(name, type, memory / std::max<std::size_t>(
+                                                  runs.size(), 1));
+  }
+  loser_tree tree{readers};
+  for (auto winner{tree.winner()}; winner != loser_tree::NONE;
+       winner = tree.winner()) {
+    sink(readers[winner].key().text, readers[winner].record());
+    tree.pop();
+  }
+  for (const auto& reader : readers) {
+    if (reader.error() != 0) return reader.error();
+  }
+  return 0;
+}
+
+class external_sorter {
+ public:
+  external_sorter(key_type type, std::size_t memory_budget,
+                  const std::string& temp_directory, io_backend io)
+      : type_{type},
+        memory_budget_{memory_budget},
+        files_{temp_directory, "sort"},
+        io_{io} {}
+
+  // Adds the record made of line and ending, to be sorted by key. Does
+  // nothing once a run failed.
+  void add(std::string_view key, std::string_view line,
+           std::string_view ending) {
+    if (error_ != 0) return;
+    entries_.push_back({data_.size(), static_cast<std::uint32_t>(key.size()),
+                        static_cast<std::uint32_t>(line.size() +
+                                                   ending.size()),
+                        0, false});
+    data_ += key;
+    data_ += line;
+    data_ += ending;
+    if (type_ == key_type::numeric) {
+      const auto parsed{make_sort_key(key, type_)};
+      entries_.back().number = parsed.number;
+      entries_.back().is_number = parsed.is_number;
+    }
+
+    if (data_.size() + entries_.size() * sizeof(entry) >= memory_budget_) {
+      spill();
+    }
+  }
+
+  // Calls sink with every record, in key order. False when a run could not
+  // be written or read back, as error() tells, in which case sink was not
+  // given all the records.
+  template <typename Sink>
+  bool finish(Sink&& sink) {
+    if (error_ == 0 && runs_.empty()) {
+      sort_entries();
+      for (const auto& entry : entries_) {
+        sink(record(entry));
+      }
+      entries_.clear();
+      data_.clear();
+      return true;
+    }
+
+    if (!entries_.empty()) {
+      spill();
+    }
+    while (error_ == 0 && runs_.size() > MERGE_FAN_IN) {
+      merge_pass();
+    }
+    if (error_ != 0) return false;
+    fail(merge_runs(runs_, type_, memory_budget_,
+                    [&](std::string_view, std::string_view record) {
+                      sink(record);
+                    }));
+    return error_ == 0;
+  }
+
+  // The errno of the first run that failed, 0 if none did.
+  int error() const { return error_; }
+
+ private:
+  struct entry {
+    std::size_t offset;
+    std::uint32_t key_length;
+    std::uint32_t record_length;
+    double number;
+    bool is_number;
+  };
+
+  sort_key key(const entry& entry) const {
+    return {{data_.data() + entry.offset, entry.key_length},
+            entry.number,
+            entry.is_number};
+  }
+
+  std::string_view record(const entry& entry) const {
+    return {data_.data() + entry.offset + entry.key_length,
+            entry.record_length};
+  }
+
+  void sort_entries() {
+    parallel_stable_sort(entries_, [this](const entry& a, const entry& b) {
+      return key_less(key(a), key(b));
+    });
+  }
+
+  void spill() {
+    sort_entries();
+    runs_.push_back(files_.create());
+    output_file run{runs_.back(), write_mode::buffered, io_};
+    for (const auto& entry : entries_) {
+      write_run_record(run, key(entry).text, record(entry));
+    }
+    if (!run.close()) fail(run.error());
+    entries_.clear();
+    data_.clear();
+  }
+
+  // Merges every MERGE_FAN_IN consecutive runs into one, which keeps the
+  // runs in input order.
+  void merge_pass() {
+    std::vector<std::string> merged;
+    for (std::size_t first{0}; first < runs_.size(); first += MERGE_FAN_IN) {
+      const auto last{std::min(first + MERGE_FAN_IN, runs_.size())};
+      const std::vector<std::string> group(
+          runs_.begin() + static_cast<std::ptrdiff_t>(first),
+          runs_.begin() + static_cast<std::ptrdiff_t>(last));
+
+      merged.push_back(files_.create());
+      output_file run{merged.back(), write_mode::buffered, io_};
+      fail(merge_runs(group, type_, memory_budget_,
+                      [&](std::string_view key, std::string_view record) {
+                        write_run_record(run, key, record);
+                      }));
+      if (!run.close()) fail(run.error());
+      for (const auto& name : group) {
+        files_.remove(name);
+      }
+    }
+    runs_ = std::move(merged);
+  }
+
+  void fail(int error) {
+    if (error_ == 0) error_ = error;
+  }
+
+  key_type type_;
+  std::size_t memory_budget_;
+  temp_files files_;
+  io_backend io_;
+  std::vector<entry> entries_;
+  // The key and the record of each entry, one after the other.
+  std::string data_;
+  // In input order.
+  std::vector<std::string> runs_;
+  int error_{0};
+};
+}  // namespace tool
@@ -0,0 +1,76 @@
+#pragma once
+
+// Byte parallel scanning within a 64 bit register (SWAR): eight bytes are
+// compared per step with plain integer arithmetic, which every compiler and
+// target supports, unlike SIMD intrinsics. A match mask has the high bit of
+// each matching byte set; bytes are numbered in memory order, which assumes
+// a little endian target.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace tool {
+namespace swar {
+using word = std::uint64_t;
+
+constexpr std::size_t WORD_SIZE{sizeof(word)};
+constexpr word ONES{0x0101010101010101};
+constexpr word LOW_BITS{0x7F7F7F7F7F7F7F7F};
+
+constexpr word broadcast(char c) {
+  return ONES * static_cast<unsigned char>(c);
+}
+
+inline word load(const char* p) {
+  word w;
+  std::memcpy(&w, p, sizeof w);
+  return w;
+}
+
+// The bytes of x that are zero. Exact: unlike the shorter
+// (x - ONES) & ~x & HIGH_BITS, no borrow marks the byte above a zero.
+constexpr word zero_bytes(word x) {
+  return ~(((x & LOW_BITS) + LOW_BITS) | x | LOW_BITS);
+}
+
+// The bytes of w equal to the byte broadcast in pattern.
+constexpr word match(word w, word pattern) { return zero_bytes(w ^ pattern); }
+
+// The bytes of w below n, which must be at most 0x80. Exact, as zero_bytes().
+constexpr word less_than(word w, unsigned char n) {
+  return ~(((w & LOW_BITS) + ONES * (0x80u - n)) | w | LOW_BITS);
+}
+
+inline unsigned count(word mask) {
+#ifdef _MSC_VER
+  return static_cast<unsigned>(__popcnt64(mask));
+#else
+  return static_cast<unsigned>(__builtin_popcountll(mask));
+#endif
+}
+
+// The position of the first match of mask, which must not be 0.
+inline std::size_t first(word mask) {
+#ifdef _MSC_VER
+  unsigned long bit;
+  _BitScanForward64(&bit, mask);
+  return bit / 8;
+#else
+  return static_cast<std::size_t>(__builtin_ctzll(mask)) / 8;
+#endif
+}
+
+// The matches of mask before the first match of other, which must not be 0.
+constexpr word before(word mask, word other) {
+  return mask & ((other & (~other + 1)) - 1);
+}
+
+// Mask without its first match.
+constexpr word drop_first(word mask) { return mask & (mask - 1); }
+}  // namespace swar
+}  // namespace tool
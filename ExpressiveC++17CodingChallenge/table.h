@@ -0,0 +1,250 @@
+#pragma once
+
+// Load-once columnar table.
+// A service applying many overwrites to the same file loads it once into a
+// csv_table rather than reading and splitting it for every rewrite. The
+// records are copied into one heap, and each column is an array of the
+// offsets and sizes of its fields in that heap or, when the column has few
+// distinct values, a dictionary of them and an array of indices. Fields are
+// kept verbatim, quotes and escapes included, as the rewrite keeps them.
+//
+// Overwriting a column swaps in another column, in constant time, and
+// swapping again restores it. Writing the table back gathers slabs of rows
+// on several threads at once, and writes the slabs in order. Every row is
+// written with the terminator and trailing delimiter of the header.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "header.h"
+#include "io.h"
+#include "options.h"
+#include "output.h"
+#include "scanner.h"
+#include "tokenizer.h"
+
+namespace tool {
+// A column is dictionary-encoded when it has at least this many rows per
+// distinct value.
+constexpr std::size_t TABLE_DICTIONARY_RATIO{4};
+// Rows that must already show that ratio for the rest to be looked at.
+constexpr std::size_t TABLE_DICTIONARY_SAMPLE{64 * 1024};
+// Rows gathered by a thread at a time when writing a table.
+constexpr std::size_t TABLE_SLAB_ROWS{16 * 1024};
+
+class table_column {
+ public:
+  table_column() = default;
+
+  // A column with field in every row, which stores nothing per row. field
+  // is written as it is, so it must be quoted as the dialect requires.
+  static table_column constant(std::string field) {
+    table_column column;
+    column.dictionary_.push_back(std::move(field));
+    return column;
+  }
+
+  // The field of row, given the heap of the table.
+  std::string_view field(std::string_view heap, std::size_t row) const {
+    if (dictionary_.empty()) return heap.substr(offsets_[row], sizes_[row]);
+    return dictionary_[codes_.empty() ? 0 : codes_[row]];
+  }
+
+  bool dictionary_encoded() const { return !dictionary_.empty(); }
+
+  std::size_t bytes() const {
+    auto bytes{offsets_.capacity() * sizeof(std::uint64_t) +
+               sizes_.capacity() * sizeof(std::uint32_t) +
+               codes_.capacity() * sizeof(std::uint32_t)};
+    for (const auto& field : dictionary_) bytes += sizeof field + field.size();
+    return bytes;
+  }
+
+ private:
+  template <typename Dialect>
+  friend class csv_table;
+
+  void add(std::uint64_t offset, std::uint32_t size) {
+    offsets_.push_back(offset);
+    sizes_.push_back(size);
+  }
+
+  // Replaces the offsets by a dictionary when rows have few distinct fields.
+  void encode(std::string_view heap) {
+    const auto rows{offsets_.size()};
+    std::unordered_map<std::string_view, std::uint32_t> indices;
+    std::vector<std::uint32_t> codes(rows);
+    for (std::size_t row{0}; row < rows; ++row) {
+      const auto [found, added]{indices.emplace(
+          field(heap, row), static_cast<std::uint32_t>(indices.size()))};
+      if (added && indices.size() * TABLE_DICTIONARY_RATIO > rows) return;
+      if (row + 1 == TABLE_DICTIONARY_SAMPLE &&
+          indices.size() * TABLE_DICTIONARY_RATIO > TABLE_DICTIONARY_SAMPLE) {
+        return;
+      }
+      codes[row] = found->second;
+    }
+    if (indices.empty()) return;
+
+    dictionary_.resize(indices.size());
+    for (const auto& [value, index] : indices) {
+      dictionary_[index] = std::string{value};
+    }
+    codes_ = std::move(codes);
+    offsets_ = {};
+    sizes_ = {};
+  }
+
+  // Without a dictionary, where the fields are in the heap.
+  std::vector<std::uint64_t> offsets_;
+  std::vector<std::uint32_t> sizes_;
+  // With one, the fields, and the index of the field of every row; a
+  // constant column has a single field and no indices.
+  std::vector<std::string> dictionary_;
+  std::vector<std::uint32_t> codes_;
+};
+
+template <typename Dialect>
+class csv_table {
+ public:
+  // Loads filename. Rows with another number of fields than the header are
+  // left out, as the rewrite leaves them out, and counted. Returns 0, or
+  // NO_CSV_INPUT_FILE when the file cannot be read, for the caller to tell
+  // whoever asked for it.
+  int load(const std::string& filename, io_backend io) {
+    auto file{file_handle::open_read(filename)};
+    if (!file.is_open()) return error_codes::NO_CSV_INPUT_FILE;
+
+    block_reader<Dialect> reader{file, io};
+    heap_.clear();
+    heap_.reserve(file.size());
+    columns_.clear();
+    rows_ = 0;
+    skipped_rows_ = 0;
+    input_block block;
+    auto first{true};
+    while (reader.next_block(block)) {
+      const auto base{heap_.size()};
+      heap_ += block.records;
+      reader.recycle(std::move(block.buffer));
+
+      auto records{std::string_view{heap_}.substr(base)};
+      if (first) {
+        header_ = parse_header<Dialect>(next_record<Dialect>(records));
+        columns_.resize(header_.number_of_columns());
+        first = false;
+      }
+      add_records(records);
+    }
+    if (reader.error() != 0) return error_codes::NO_CSV_INPUT_FILE;
+    bom_ = reader.bom();
+
+    for (auto& column : columns_) column.encode(heap_);
+    return 0;
+  }
+
+  const csv_header& header() const { return header_; }
+  std::size_t rows() const { return rows_; }
+  std::uint64_t skipped_rows() const { return skipped_rows_; }
+
+  // The memory the table takes, roughly.
+  std::size_t bytes() const {
+    auto bytes{heap_.capacity()};
+    for (const auto& column : columns_) bytes += column.bytes();
+    return bytes;
+  }
+
+  const table_column& column(std::size_t position) const {
+    return columns_[position];
+  }
+
+  std::string_view field(std::size_t row, std::size_t column) const {
+    return columns_[column].field(heap_, row);
+  }
+
+  // Exchanges the column at position with column, which must have a field
+  // per row or be constant.
+  void swap_column(std::size_t position, table_column& column) {
+    std::swap(columns_[position], column);
+  }
+
+  // Writes the table as CSV in its dialect, on workers threads.
+  void write(output_file& output, std::size_t workers) const {
+    output << bom_;
+    output << header_.line;
+    output << header_.line_ending;
+
+    workers = std::max<std::size_t>(workers, 1);
+    std::vector<std::string> slabs(workers);
+    const auto gather{[&](std::size_t slab, std::size_t begin) {
+      auto& text{slabs[slab]};
+      text.clear();
+      const auto end{std::min(begin + TABLE_SLAB_ROWS, rows_)};
+      for (auto row{begin}; row < end; ++row) {
+        for (std::size_t i{0}; i < columns_.size(); ++i) {
+          if (i > 0) text += Dialect::delimiter;
+          text += columns_[i].field(heap_, row);
+        }
+        if (header_.trailing_delimiter) text += Dialect::delimiter;
+        text += header_.line_ending;
+      }
+    }};
+
+    for (std::size_t begin{0}; begin < rows_;
+         begin += workers * TABLE_SLAB_ROWS) {
+      std::vector<std::thread> threads;
+      std::size_t slabs_used{1};
+      for (; slabs_used < workers &&
+             begin + slabs_used * TABLE_SLAB_ROWS < rows_;
+           ++slabs_used) {
+        threads.emplace_back(gather, slabs_used,
+                             begin + slabs_used * TABLE_SLAB_ROWS);
+      }
+      gather(0, begin);
+      for (auto& thread : threads) thread.join();
+      for (std::size_t slab{0}; slab < slabs_used; ++slab) {
+        output << slabs[slab];
+      }
+    }
+  }
+
+ private:
+  void add_records(std::string_view records) {
+    const auto columns{columns_.size()};
+    while (!records.empty()) {
+      auto line{next_record<Dialect>(records).line};
+      strip_trailing_delimiter<Dialect>(header_, line);
+      if (count_fields<Dialect>(line) != columns) {
+        ++skipped_rows_;
+        continue;
+      }
+
+      const auto line_offset{
+          static_cast<std::uint64_t>(line.data() - heap_.data())};
+      std::size_t begin{0};
+      for (auto& column : columns_) {
+        const auto end{find_field_end<Dialect>(line, begin)};
+        column.add(line_offset + begin,
+                   static_cast<std::uint32_t>(end - begin));
+        begin = end + 1;
+      }
+      ++rows_;
+    }
+  }
+
+  std::string heap_;
+  csv_header header_;
+  std::string_view bom_;
+  std::vector<table_column> columns_;
+  std::size_t rows_{0};
+  std::uint64_t skipped_rows_{0};
+};
+}  // namespace tool
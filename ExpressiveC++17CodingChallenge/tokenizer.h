@@ -0,0 +1,177 @@
+#pragma once
+
+// Splitting lines into fields and merging them back, for a given dialect.
+// Fields are kept verbatim, quotes and escapes included, so a row that is
+// not rewritten is written back byte for byte.
+
+#include <algorithm>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dialect.h"
+
+namespace tool {
+// Views into the line being rewritten; the vector itself lives in the arena
+// of the chunk the line belongs to.
+using tokens = std::pmr::vector<std::string_view>;
+
+// Returns the position just past the quote closing the quoted field opened
+// at open, or npos when data ends inside the field.
+template <typename Dialect>
+std::size_t find_closing_quote(std::string_view data, std::size_t open) {
+  auto i{open + 1};
+  while (i < data.size()) {
+    const auto c{data[i]};
+    if constexpr (Dialect::escape == escape_rule::backslash) {
+      if (c == '\\') {
+        i += 2;
+        continue;
+      }
+    } else {
+      if (c == Dialect::quote && i + 1 < data.size() &&
+          data[i + 1] == Dialect::quote) {
+        i += 2;
+        continue;
+      }
+    }
+    ++i;
+    if (c == Dialect::quote) return i;
+  }
+  return std::string_view::npos;
+}
+
+// Returns the position of the delimiter ending the field starting at begin,
+// or line.size() for the last field.
+template <typename Dialect>
+std::size_t find_field_end(std::string_view line, std::size_t begin) {
+  if constexpr (Dialect::quoting) {
+    if (begin < line.size() && line[begin] == Dialect::quote) {
+      const auto closed{find_closing_quote<Dialect>(line, begin)};
+      // Anything between the closing quote and the delimiter is kept in the
+      // field rather than rejected.
+      return std::min(line.find(Dialect::delimiter, closed), line.size());
+    }
+  }
+  return std::min(line.find(Dialect::delimiter, begin), line.size());
+}
+
+// An empty line has no field. Otherwise a trailing delimiter ends an empty
+// last field, as in RFC 4180.
+template <typename Dialect>
+auto split_line_into_tokens(std::string_view line,
+                            std::pmr::memory_resource* resource) {
+  tokens result{resource};
+  if (line.empty()) {
+    return result;
+  }
+
+  std::size_t begin{0};
+  while (true) {
+    const auto end{find_field_end<Dialect>(line, begin)};
+    result.push_back(line.substr(begin, end - begin));
+    if (end == line.size()) break;
+    begin = end + 1;
+  }
+
+  return result;
+}
+
+// The number of tokens split_line_into_tokens() would return, without
+// materializing them.
+template <typename Dialect>
+std::size_t count_fields(std::string_view line) {
+  if (line.empty()) {
+    return 0;
+  }
+
+  std::size_t count{1};
+  for (auto end{find_field_end<Dialect>(line, 0)}; end != line.size();
+       end = find_field_end<Dialect>(line, end + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+template <typename Dialect>
+void merge_tokens_into_line(const tokens& tokens, std::pmr::string& line) {
+  auto first{true};
+  for (const auto& token : tokens) {
+    if (!first) {
+      line += Dialect::delimiter;
+    }
+    line += token;
+    first = false;
+  }
+}
+
+// The value of a field, without its surrounding quotes and escapes.
+template <typename Dialect>
+std::string unquote_field(std::string_view field) {
+  if constexpr (Dialect::quoting) {
+    if (field.size() >= 2 && field.front() == Dialect::quote &&
+        field.back() == Dialect::quote) {
+      std::string value;
+      value.reserve(field.size() - 2);
+      for (std::size_t i{1}; i + 1 < field.size(); ++i) {
+        const auto escaped{Dialect::escape == escape_rule::backslash
+                               ? field[i] == '\\'
+                               : field[i] == Dialect::quote};
+        if (escaped && i + 2 < field.size()) ++i;
+        value += field[i];
+      }
+      return value;
+    }
+  }
+  return std::string{field};
+}
+
+// The value of a field: the field itself unless it is quoted, in which case
+// it is the field inside its quotes when nothing in there is escaped, and
+// is unquoted into storage otherwise.
+template <typename Dialect>
+std::string_view field_value(std::string_view field, std::string& storage) {
+  if constexpr (Dialect::quoting) {
+    if (!field.empty() && field.front() == Dialect::quote) {
+      constexpr char escape{Dialect::escape == escape_rule::backslash
+                                ? '\\'
+                                : Dialect::quote};
+      if (field.size() >= 2 && field.back() == Dialect::quote) {
+        const auto inside{field.substr(1, field.size() - 2)};
+        if (inside.find(escape) == std::string_view::npos) return inside;
+      }
+      storage = unquote_field<Dialect>(field);
+      return storage;
+    }
+  }
+  return field;
+}
+
+// The field to write for value, quoted only when the dialect requires it.
+template <typename Dialect>
+std::string quote_field(std::string_view value) {
+  if constexpr (Dialect::quoting) {
+    constexpr char special[]{Dialect::delimiter, Dialect::quote, '\\', '\r',
+                             '\n'};
+    const auto needs_quotes{
+        value.find_first_of(std::string_view{special, sizeof special}) !=
+        std::string_view::npos};
+    if (needs_quotes) {
+      std::string field{Dialect::quote};
+      for (const auto c : value) {
+        if (c == Dialect::quote) {
+          field += Dialect::escape == escape_rule::backslash ? '\\'
+                                                             : Dialect::quote;
+        } else if (c == '\\' && Dialect::escape == escape_rule::backslash) {
+          field += '\\';
+        }
+        field += c;
+      }
+      field += Dialect::quote;
+      return field;
+    }
+  }
+  return std::string{value};
+}
+}  // namespace tool
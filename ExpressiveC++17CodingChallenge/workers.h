@@ -0,0 +1,141 @@
+#pragma once
+
+// Parallel processing of input blocks.
+// The thread reading the input hands each block to the first free worker,
+// and workers give the buffers back when done with them, for the reading
+// thread to return to the reader. A block holds whole records, so workers
+// need no coordination; an order that matters must be restored by the
+// caller.
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "buffer.h"
+#include "numa.h"
+#include "scanner.h"
+
+namespace tool {
+// Blocks waiting for a worker, per worker: enough to keep them busy while
+// the reader waits on the disk, few enough to bound the memory.
+constexpr std::size_t BLOCKS_PER_WORKER{2};
+
+// The number of workers to use when requested is 0: one per hardware
+// thread.
+inline std::size_t worker_count(std::size_t requested) {
+  if (requested > 0) return requested;
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Calls work(records, worker) on one of workers threads for the records of
+// block, then for those of every block left in reader. worker numbers the
+// thread calling, from 0 to workers - 1. With numa, the workers are placed
+// on its nodes, and so are the blocks they work on (see numa.h).
+template <typename Dialect, typename Work>
+void for_each_block(block_reader<Dialect>& reader, input_block& block,
+                    std::size_t workers, Work&& work,
+                    const numa_topology* numa = nullptr) {
+  const std::size_t nodes{numa ? numa->nodes() : 1};
+  const auto node_of_worker{[&](std::size_t worker) -> std::size_t {
+    return numa ? numa->node_of_worker(worker, workers) : 0;
+  }};
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::condition_variable space;
+  // Blocks waiting, per node.
+  std::vector<std::deque<input_block>> pending(nodes);
+  std::size_t waiting{0};
+  std::vector<aligned_buffer> done;
+  auto closed{false};
+
+  // A worker takes a block of another node when that node has more than
+  // its share of the blocks waiting, or when the input is over.
+  const auto take{[&](std::size_t node, input_block& next) {
+    auto* queue{&pending[node]};
+    if (queue->empty()) {
+      for (auto& other : pending) {
+        if (other.size() > workers * BLOCKS_PER_WORKER / nodes ||
+            (closed && !other.empty())) {
+          queue = &other;
+          break;
+        }
+      }
+    }
+    if (queue->empty()) return false;
+    next = std::move(queue->front());
+    queue->pop_front();
+    --waiting;
+    return true;
+  }};
+
+  std::vector<std::thread> threads;
+  for (std::size_t worker{0}; worker < workers; ++worker) {
+    threads.emplace_back([&, worker] {
+      const auto node{node_of_worker(worker)};
+      if (numa) numa->pin_to_node(node);
+      while (true) {
+        input_block next;
+        {
+          std::unique_lock<std::mutex> lock{mutex};
+          auto taken{false};
+          ready.wait(lock, [&] {
+            taken = take(node, next);
+            return taken || closed;
+          });
+          if (!taken) return;
+        }
+        space.notify_one();
+
+        work(next.records, worker);
+        std::lock_guard<std::mutex> lock{mutex};
+        done.push_back(std::move(next.buffer));
+      }
+    });
+  }
+
+  // The node of each buffer seen, by address. Buffers are handed out to
+  // the workers in turn, so to the nodes in proportion to their workers.
+  std::unordered_map<const char*, std::size_t> buffer_nodes;
+  std::vector<aligned_buffer> returned;
+  do {
+    auto [known, added]{buffer_nodes.try_emplace(
+        block.buffer.data(), node_of_worker(buffer_nodes.size() % workers))};
+    if (added && numa) {
+      numa->move_to_node(block.buffer.data(), block.buffer.capacity(),
+                         known->second);
+    }
+    {
+      std::unique_lock<std::mutex> lock{mutex};
+      space.wait(lock, [&] { return waiting < workers * BLOCKS_PER_WORKER; });
+      pending[known->second].push_back(std::move(block));
+      ++waiting;
+      returned.swap(done);
+    }
+    if (nodes > 1) {
+      ready.notify_all();
+    } else {
+      ready.notify_one();
+    }
+    for (auto& buffer : returned) {
+      reader.recycle(std::move(buffer));
+    }
+    returned.clear();
+  } while (reader.next_block(block));
+
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    closed = true;
+  }
+  ready.notify_all();
+  for (auto& thread : threads) thread.join();
+  for (auto& buffer : done) {
+    reader.recycle(std::move(buffer));
+  }
+}
+}  // namespace tool